@@ -0,0 +1,441 @@
+// Measures how long one joyShockPollCallback tick takes for a range of gyro, stick and smoothing configurations.
+// The controller is simulated with synthetic IMU, stick and button streams, and the platform backends are stubs,
+// so the figures only reflect the mapping code.
+#include "JoyShockMapper.h"
+#include "JoyShock.h"
+#include "JSMAssignment.hpp"
+#include "CmdRegistry.h"
+#include "SettingsManager.h"
+#include "InputHelpers.h"
+#define _USE_MATH_DEFINES
+#include <math.h> // M_PI
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <unordered_map>
+
+// Defined in main.cpp
+extern shared_ptr<JslWrapper> jsl;
+extern vector<JSMButton> mappings;
+extern unordered_map<int, shared_ptr<JoyShock>> handle_to_joyshock;
+void initJsmSettings(CmdRegistry *commandRegistry);
+void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE lastState, IMU_STATE imuState, IMU_STATE lastImuState, float deltaTime);
+Mapping filterMapping(Mapping current, Mapping next);
+
+// A single DualShock 4 whose state is generated from the tick number
+class BenchmarkJsl : public JslWrapper
+{
+public:
+	static constexpr int HANDLE = 1;
+
+	// Move the synthetic controller to its state at the given tick
+	void generate(int tick, float tickTime)
+	{
+		float t = tick * tickTime;
+		// Sweeping aim with small tremors, and gravity pointing down the controller
+		_imu.gyroX = 40.f * sinf(t * 1.3f) + 0.5f * sinf(t * 97.f);
+		_imu.gyroY = 120.f * sinf(t * 0.7f) + 0.5f * cosf(t * 83.f);
+		_imu.gyroZ = 10.f * cosf(t * 0.9f);
+		_imu.accelX = 0.1f * sinf(t * 0.7f);
+		_imu.accelY = 0.99f;
+		_imu.accelZ = 0.1f * cosf(t * 0.7f);
+		// Both sticks go round, and flick every so often
+		_leftX = 0.8f * cosf(t * 2.f);
+		_leftY = 0.8f * sinf(t * 2.f);
+		bool flick = (tick / 50) % 4 == 0;
+		_rightX = flick ? cosf(t) : 0.3f * cosf(t * 5.f);
+		_rightY = flick ? sinf(t) : 0.3f * sinf(t * 5.f);
+		_leftTrigger = 0.5f + 0.5f * sinf(t * 3.f);
+		_rightTrigger = (tick / 30) % 2 == 0 ? 1.f : 0.f;
+		// Face buttons and bumpers pressed in turns
+		_buttons = 1 << (JSOFFSET_S + (tick / 20) % 4);
+		if ((tick / 45) % 2 == 0)
+		{
+			_buttons |= 1 << JSOFFSET_R;
+		}
+	}
+
+	int ConnectDevices() override
+	{
+		return 1;
+	}
+
+	int GetDeviceCount() override
+	{
+		return 1;
+	}
+
+	int GetConnectedDeviceHandles(int *deviceHandleArray, int size) override
+	{
+		if (size > 0)
+		{
+			deviceHandleArray[0] = HANDLE;
+		}
+		return 1;
+	}
+
+	void DisconnectAndDisposeAll() override
+	{
+	}
+
+	JOY_SHOCK_STATE GetSimpleState(int deviceId) override
+	{
+		return JOY_SHOCK_STATE();
+	}
+
+	IMU_STATE GetIMUState(int deviceId) override
+	{
+		return _imu;
+	}
+
+	MOTION_STATE GetMotionState(int deviceId) override
+	{
+		return MOTION_STATE();
+	}
+
+	TOUCH_STATE GetTouchState(int deviceId, bool previous) override
+	{
+		TOUCH_STATE state;
+		memset(&state, 0, sizeof(state));
+		return state;
+	}
+
+	bool GetTouchpadDimension(int deviceId, int &sizeX, int &sizeY) override
+	{
+		sizeX = 1920;
+		sizeY = 920;
+		return true;
+	}
+
+	int GetButtons(int deviceId) override
+	{
+		return _buttons;
+	}
+
+	float GetLeftX(int deviceId) override
+	{
+		return _leftX;
+	}
+
+	float GetLeftY(int deviceId) override
+	{
+		return _leftY;
+	}
+
+	float GetRightX(int deviceId) override
+	{
+		return _rightX;
+	}
+
+	float GetRightY(int deviceId) override
+	{
+		return _rightY;
+	}
+
+	float GetLeftTrigger(int deviceId) override
+	{
+		return _leftTrigger;
+	}
+
+	float GetRightTrigger(int deviceId) override
+	{
+		return _rightTrigger;
+	}
+
+	float GetGyroX(int deviceId) override
+	{
+		return _imu.gyroX;
+	}
+
+	float GetGyroY(int deviceId) override
+	{
+		return _imu.gyroY;
+	}
+
+	float GetGyroZ(int deviceId) override
+	{
+		return _imu.gyroZ;
+	}
+
+	float GetAccelX(int deviceId) override
+	{
+		return _imu.accelX;
+	}
+
+	float GetAccelY(int deviceId) override
+	{
+		return _imu.accelY;
+	}
+
+	float GetAccelZ(int deviceId) override
+	{
+		return _imu.accelZ;
+	}
+
+	int GetTouchId(int deviceId, bool secondTouch = false) override
+	{
+		return 0;
+	}
+
+	bool GetTouchDown(int deviceId, bool secondTouch = false) override
+	{
+		return false;
+	}
+
+	float GetTouchX(int deviceId, bool secondTouch = false) override
+	{
+		return 0.f;
+	}
+
+	float GetTouchY(int deviceId, bool secondTouch = false) override
+	{
+		return 0.f;
+	}
+
+	float GetStickStep(int deviceId) override
+	{
+		return 0.f;
+	}
+
+	float GetTriggerStep(int deviceId) override
+	{
+		return 0.f;
+	}
+
+	float GetPollRate(int deviceId) override
+	{
+		return 0.f;
+	}
+
+	void ResetContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void StartContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void PauseContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void GetCalibrationOffset(int deviceId, float &xOffset, float &yOffset, float &zOffset) override
+	{
+		xOffset = yOffset = zOffset = 0.f;
+	}
+
+	void SetCalibrationOffset(int deviceId, float xOffset, float yOffset, float zOffset) override
+	{
+	}
+
+	void SetCallback(void (*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float)) override
+	{
+	}
+
+	void SetTouchCallback(void (*callback)(int, TOUCH_STATE, TOUCH_STATE, float)) override
+	{
+	}
+
+	int GetControllerType(int deviceId) override
+	{
+		return JS_TYPE_DS4;
+	}
+
+	int GetControllerSplitType(int deviceId) override
+	{
+		return JS_SPLIT_TYPE_FULL;
+	}
+
+	int GetControllerColour(int deviceId) override
+	{
+		return 0;
+	}
+
+	void SetLightColour(int deviceId, int colour) override
+	{
+	}
+
+	void SetRumble(int deviceId, int smallRumble, int bigRumble) override
+	{
+	}
+
+	void SetPlayerNumber(int deviceId, int number) override
+	{
+	}
+
+	std::string GetControllerGUID(int deviceId) override
+	{
+		return "benchmark";
+	}
+
+	bool RemoveController(int handle) override
+	{
+		return false;
+	}
+
+private:
+	IMU_STATE _imu = {};
+	int _buttons = 0;
+	float _leftX = 0.f;
+	float _leftY = 0.f;
+	float _rightX = 0.f;
+	float _rightY = 0.f;
+	float _leftTrigger = 0.f;
+	float _rightTrigger = 0.f;
+};
+
+JslWrapper *JslWrapper::getNew()
+{
+	return new BenchmarkJsl();
+}
+
+struct BenchmarkOptions
+{
+	int warmupTicks = 500;
+	int ticks = 20000;
+	float tickTime = 1.f; // in ms, used as the time elapsed between two simulated reports
+};
+
+// Run the callback for the given number of ticks and print the latency percentiles
+void runConfiguration(string_view name, const BenchmarkOptions &options)
+{
+	auto &device = static_cast<BenchmarkJsl &>(*jsl);
+	auto jc = handle_to_joyshock[BenchmarkJsl::HANDLE];
+	auto tickDuration = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<float, milli>(options.tickTime));
+	JOY_SHOCK_STATE dummyState;
+	IMU_STATE dummyImu;
+	memset(&dummyState, 0, sizeof(dummyState));
+	memset(&dummyImu, 0, sizeof(dummyImu));
+
+	vector<float> latencies; // in microseconds
+	latencies.reserve(options.ticks);
+	for (int tick = 0; tick < options.warmupTicks + options.ticks; ++tick)
+	{
+		device.generate(tick, options.tickTime / 1000.f);
+		// The callback measures its delta time from the previous call: pretend a whole tick has passed
+		jc->_timeNow = chrono::steady_clock::now() - tickDuration;
+
+		auto start = chrono::steady_clock::now();
+		joyShockPollCallback(BenchmarkJsl::HANDLE, dummyState, dummyState, dummyImu, dummyImu, options.tickTime);
+		auto end = chrono::steady_clock::now();
+
+		if (tick >= options.warmupTicks)
+		{
+			latencies.push_back(chrono::duration<float, micro>(end - start).count());
+		}
+	}
+
+	sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](float p)
+	{
+		return latencies[min(latencies.size() - 1, size_t(p / 100.f * latencies.size()))];
+	};
+	COUT << left << setw(32) << name << right << fixed << setprecision(2)
+	     << setw(10) << percentile(50.f)
+	     << setw(10) << percentile(90.f)
+	     << setw(10) << percentile(99.f)
+	     << setw(10) << percentile(99.9f)
+	     << setw(10) << latencies.back() << '\n';
+}
+
+void resetConfiguration()
+{
+	SettingsManager::get<GyroSpace>(SettingID::GYRO_SPACE)->set(GyroSpace::LOCAL);
+	SettingsManager::get<StickMode>(SettingID::LEFT_STICK_MODE)->set(StickMode::NO_MOUSE);
+	SettingsManager::get<StickMode>(SettingID::RIGHT_STICK_MODE)->set(StickMode::AIM);
+	SettingsManager::get<float>(SettingID::GYRO_SMOOTH_THRESHOLD)->set(0.f);
+	SettingsManager::get<float>(SettingID::GYRO_SMOOTH_TIME)->set(0.125f);
+	SettingsManager::get<SmoothingKernel>(SettingID::GYRO_SMOOTH_KERNEL)->set(SmoothingKernel::BOX);
+	SettingsManager::get<GyroFilter>(SettingID::GYRO_FILTER)->set(GyroFilter::SMOOTH);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchmarkOptions options;
+	if (argc > 1)
+	{
+		options.ticks = max(1, atoi(argv[1]));
+	}
+	if (argc > 2)
+	{
+		options.tickTime = max(0.1f, float(atof(argv[2])));
+	}
+
+	jsl.reset(JslWrapper::getNew());
+	mappings.reserve(MAPPING_SIZE);
+	for (int id = 0; id < MAPPING_SIZE; ++id)
+	{
+		JSMButton newButton(ButtonID(id), Mapping::NO_MAPPING);
+		newButton.setFilter(&filterMapping);
+		mappings.push_back(newButton);
+	}
+	CmdRegistry commandRegistry;
+	initJsmSettings(&commandRegistry);
+	Mapping::_isCommandValid = bind(&CmdRegistry::isCommandValid, &commandRegistry, placeholders::_1);
+	// No background threads: they would compete with the measurements
+	SettingsManager::getV<Switch>(SettingID::AUTOLOAD)->set(Switch::OFF);
+	SettingsManager::getV<Switch>(SettingID::AUTOCONNECT)->set(Switch::OFF);
+
+	// Give the buttons some work to do
+	mappings[int(ButtonID::S)].set(Mapping("SPACE"));
+	mappings[int(ButtonID::E)].set(Mapping("E"));
+	mappings[int(ButtonID::W)].set(Mapping("R"));
+	mappings[int(ButtonID::N)].set(Mapping("Q"));
+	mappings[int(ButtonID::R)].set(Mapping("LMOUSE"));
+	mappings[int(ButtonID::ZR)].set(Mapping("RMOUSE"));
+
+	handle_to_joyshock[BenchmarkJsl::HANDLE] = make_shared<JoyShock>(BenchmarkJsl::HANDLE, JS_SPLIT_TYPE_FULL);
+
+	COUT << options.ticks << " ticks of " << options.tickTime << "ms per configuration. Latencies in microseconds.\n";
+	COUT << left << setw(32) << "Configuration" << right
+	     << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "p99.9" << setw(10) << "max" << '\n';
+
+	for (auto gyroSpace : magic_enum::enum_values<GyroSpace>())
+	{
+		if (gyroSpace == GyroSpace::INVALID)
+			continue;
+		resetConfiguration();
+		SettingsManager::get<GyroSpace>(SettingID::GYRO_SPACE)->set(gyroSpace);
+		runConfiguration(string("GYRO_SPACE = ") + magic_enum::enum_name(gyroSpace).data(), options);
+	}
+
+	// Stick modes past HYBRID_AIM require a virtual controller
+	for (auto stickMode : magic_enum::enum_values<StickMode>())
+	{
+		if (stickMode > StickMode::HYBRID_AIM)
+			break;
+		resetConfiguration();
+		SettingsManager::get<StickMode>(SettingID::RIGHT_STICK_MODE)->set(stickMode);
+		runConfiguration(string("RIGHT_STICK_MODE = ") + magic_enum::enum_name(stickMode).data(), options);
+	}
+
+	for (float threshold : { 0.f, 5.f, 50.f })
+	{
+		resetConfiguration();
+		SettingsManager::get<float>(SettingID::GYRO_SMOOTH_THRESHOLD)->set(threshold);
+		stringstream name;
+		name << "GYRO_SMOOTH_THRESHOLD = " << threshold;
+		runConfiguration(name.str(), options);
+	}
+
+	// The smoothing window grows as the tick time shrinks, which shouldn't change the cost of a tick
+	for (auto kernel : { SmoothingKernel::BOX, SmoothingKernel::EXPONENTIAL })
+	{
+		resetConfiguration();
+		SettingsManager::get<float>(SettingID::GYRO_SMOOTH_THRESHOLD)->set(50.f);
+		SettingsManager::get<float>(SettingID::GYRO_SMOOTH_TIME)->set(1.f);
+		SettingsManager::get<SmoothingKernel>(SettingID::GYRO_SMOOTH_KERNEL)->set(kernel);
+		runConfiguration(string("GYRO_SMOOTH_TIME = 1, GYRO_SMOOTH_KERNEL = ") + magic_enum::enum_name(kernel).data(), options);
+	}
+
+	for (auto filter : { GyroFilter::ONE_EURO, GyroFilter::LOW_PASS, GyroFilter::KALMAN })
+	{
+		resetConfiguration();
+		SettingsManager::get<GyroFilter>(SettingID::GYRO_FILTER)->set(filter);
+		runConfiguration(string("GYRO_FILTER = ") + magic_enum::enum_name(filter).data(), options);
+	}
+
+	handle_to_joyshock.clear();
+	return 0;
+}
@@ -0,0 +1,163 @@
+// Platform backends that do nothing, so that the benchmark measures the mapping code alone and runs without any
+// virtual input device, tray icon or console.
+#include "InputHelpers.h"
+#include "Gamepad.h"
+#include "TrayIcon.h"
+#include "Whitelister.h"
+#include <filesystem>
+
+#ifndef _WIN32
+std::queue<Command> commandQueue;
+std::mutex commandQueueMutex;
+std::condition_variable commandQueueCV;
+#endif
+
+float getMouseSpeed()
+{
+	return 1.0f;
+}
+
+int pressMouse(const KeyCode &vkKey, bool isPressed)
+{
+	return 0;
+}
+
+int pressKey(const KeyCode &vkKey, bool pressed)
+{
+	return 0;
+}
+
+void moveMouse(float x, float y)
+{
+}
+
+void setMouseNorm(float x, float y)
+{
+}
+
+void configureVirtualDevices(VirtualDevices layout, float mouseRate, FloatXY pointerResolution)
+{
+}
+
+OutputFrame::OutputFrame()
+{
+}
+
+OutputFrame::~OutputFrame()
+{
+}
+
+BOOL WriteToConsole(string_view command)
+{
+	return false;
+}
+
+BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+	return false;
+}
+
+void initConsole()
+{
+}
+
+void initConsole(std::function<void()>)
+{
+}
+
+#ifndef _WIN32
+void initFifoCommandListener()
+{
+}
+#endif
+
+tuple<string, string> GetActiveWindowName()
+{
+	return { "", "" };
+}
+
+vector<string> ListDirectory(string directory)
+{
+	vector<string> fileListing;
+	error_code error;
+	for (auto &entry : filesystem::directory_iterator(directory, error))
+	{
+		fileListing.push_back(entry.path().filename().string());
+	}
+	return fileListing;
+}
+
+string GetCWD()
+{
+	return filesystem::current_path().string();
+}
+
+bool SetCWD(string_view newCWD)
+{
+	error_code error;
+	filesystem::current_path(newCWD, error);
+	return !error;
+}
+
+DWORD ShowOnlineHelp()
+{
+	return 0;
+}
+
+void HideConsole()
+{
+}
+
+void UnhideConsole()
+{
+}
+
+void ShowConsole()
+{
+}
+
+void ReleaseConsole()
+{
+}
+
+bool IsVisible()
+{
+	return true;
+}
+
+bool isConsoleMinimized()
+{
+	return false;
+}
+
+bool ClearConsole()
+{
+	return true;
+}
+
+size_t Gamepad::_count = 0;
+
+Gamepad::Gamepad()
+{
+	++_count;
+}
+
+Gamepad::~Gamepad()
+{
+	--_count;
+}
+
+Gamepad *Gamepad::getNew(ControllerScheme scheme, Callback notification)
+{
+	return nullptr;
+}
+
+TrayIcon *TrayIcon::getNew(TrayIconData applicationName, std::function<void()> &&beforeShow)
+{
+	return nullptr;
+}
+
+Whitelister *Whitelister::getNew(bool add)
+{
+	return nullptr;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "ChordStack.h"
+#include "PlatformDefinitions.h"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <memory>
+#include <vector>
+
+// The keys that buttons keep in effect, like gyro actions and toggles, from the oldest to the most recent. Besides the
+// entries, a count per button tells whether a button has any without looking through them, and a bitset of the low
+// bits of the key codes rules out most keys that aren't queued. The entries are reserved when the controller connects,
+// so nothing is allocated while they fit.
+class ActionQueue
+{
+public:
+	typedef pair<ButtonID, shared_ptr<const KeyCode>> Entry;
+	typedef vector<Entry>::const_iterator const_iterator;
+
+	void reserve(size_t capacity)
+	{
+		_entries.reserve(capacity);
+	}
+
+	void push(ButtonID id, shared_ptr<const KeyCode> key)
+	{
+		if (id > ButtonID::INVALID)
+		{
+			++_perButton[indexOf(id)];
+		}
+		_keyCodes.set(key->code & KEY_MASK);
+		_entries.emplace_back(id, move(key));
+	}
+
+	bool contains(ButtonID id) const
+	{
+		return id > ButtonID::INVALID && _perButton[indexOf(id)] > 0;
+	}
+
+	bool contains(ButtonID id, const KeyCode &key) const
+	{
+		return contains(id) && find_if(begin(), end(), [id, &key](const Entry &entry)
+		                         { return entry.first == id && *entry.second == key; }) != end();
+	}
+
+	bool contains(const KeyCode &key) const
+	{
+		return _keyCodes.test(key.code & KEY_MASK) && find_if(begin(), end(), [&key](const Entry &entry)
+		                                                 { return *entry.second == key; }) != end();
+	}
+
+	// The key of the oldest entry of id, nullptr if it has none
+	shared_ptr<const KeyCode> find(ButtonID id) const
+	{
+		if (!contains(id))
+		{
+			return nullptr;
+		}
+		return find_if(begin(), end(), [id](const Entry &entry)
+		  { return entry.first == id; })
+		  ->second;
+	}
+
+	// Take every entry of key out of the queue, keeping the others in order. Returns how many were.
+	size_t erase(const KeyCode &key)
+	{
+		if (!_keyCodes.test(key.code & KEY_MASK))
+		{
+			return 0;
+		}
+		auto kept = remove_if(_entries.begin(), _entries.end(), [this, &key](const Entry &entry)
+		  {
+			  if (*entry.second == key)
+			  {
+				  if (entry.first > ButtonID::INVALID)
+				  {
+					  --_perButton[indexOf(entry.first)];
+				  }
+				  return true;
+			  }
+			  return false;
+		  });
+		size_t erased = _entries.end() - kept;
+		_entries.erase(kept, _entries.end());
+		// Other keys may share the bit
+		_keyCodes.reset();
+		for (const auto &entry : _entries)
+		{
+			_keyCodes.set(entry.second->code & KEY_MASK);
+		}
+		return erased;
+	}
+
+	bool empty() const
+	{
+		return _entries.empty();
+	}
+
+	const_iterator begin() const
+	{
+		return _entries.cbegin();
+	}
+
+	const_iterator end() const
+	{
+		return _entries.cend();
+	}
+
+private:
+	static constexpr uint16_t KEY_MASK = 0xff;
+
+	static size_t indexOf(ButtonID id)
+	{
+		return size_t(int(id) - int(ButtonID::NONE));
+	}
+
+	vector<Entry> _entries;
+	array<uint16_t, ChordStack::CAPACITY> _perButton{};
+	bitset<KEY_MASK + 1> _keyCodes;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+
+#include <array>
+#include <bitset>
+#include <iterator>
+
+// The buttons held down that act as chords, iterated from the most recently pressed to ButtonID::NONE, which always
+// sits at the bottom for the unchorded mappings. The buttons are stored bottom up in a fixed array, so pressing one
+// is an append, releasing one only moves the few pressed after it, and a bitset answers whether a button is held
+// without looking through the stack. Nothing is allocated once the controller is connected.
+class ChordStack
+{
+public:
+	// Every button can be held at once
+	static constexpr size_t CAPACITY = size_t(int(magic_enum::enum_values<ButtonID>().back()) - int(ButtonID::NONE) + 1);
+
+	typedef reverse_iterator<const ButtonID *> const_iterator;
+
+	ChordStack()
+	{
+		_buttons[0] = ButtonID::NONE;
+		_held.set(indexOf(ButtonID::NONE));
+	}
+
+	bool contains(ButtonID id) const
+	{
+		return id > ButtonID::INVALID && _held.test(indexOf(id));
+	}
+
+	// Put id on top of the stack. Returns false if it was already in it.
+	bool push(ButtonID id)
+	{
+		if (contains(id))
+		{
+			return false;
+		}
+		_buttons[_size++] = id;
+		_held.set(indexOf(id));
+		return true;
+	}
+
+	// Take id out of the stack. Returns false if it wasn't in it. NONE always stays.
+	bool erase(ButtonID id)
+	{
+		if (id == ButtonID::NONE || !contains(id))
+		{
+			return false;
+		}
+		auto found = find(_buttons.begin() + 1, _buttons.begin() + _size, id);
+		move(found + 1, _buttons.begin() + _size, found);
+		--_size;
+		_held.reset(indexOf(id));
+		return true;
+	}
+
+	// Take every button that matches predicate out of the stack. Returns how many were.
+	template<typename Predicate>
+	size_t eraseIf(Predicate predicate)
+	{
+		auto kept = remove_if(_buttons.begin() + 1, _buttons.begin() + _size, [this, &predicate](ButtonID id)
+		  {
+			  if (predicate(id))
+			  {
+				  _held.reset(indexOf(id));
+				  return true;
+			  }
+			  return false;
+		  });
+		size_t erased = _buttons.begin() + _size - kept;
+		_size -= erased;
+		return erased;
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+	const_iterator begin() const
+	{
+		return const_iterator(_buttons.data() + _size);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator(_buttons.data());
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+
+private:
+	static size_t indexOf(ButtonID id)
+	{
+		return size_t(int(id) - int(ButtonID::NONE));
+	}
+
+	array<ButtonID, CAPACITY> _buttons; // Bottom up
+	size_t _size = 1;
+	bitset<CAPACITY> _held;
+};
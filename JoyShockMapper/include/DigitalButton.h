@@ -1,20 +1,23 @@
 #pragma once
 
-#include "pocket_fsm.h"
 #include "JoyShockMapper.h"
 #include "Gamepad.h"
 #include "MotionIf.h"
+#include "TimerWheel.h"
+#include "ChordStack.h"
+#include "ActionQueue.h"
 #include <chrono>
-#include <deque>
+#include <limits>
 #include <mutex>
+#include <vector>
 
 // Forward declarations
 class JSMButton;
-class DigitalButton;      // Finite State Machine
-struct DigitalButtonImpl; // Button implementation
+class DigitalButton;
+struct DigitalButtonTable; // Data and state machine of all the buttons of a context
 class MapIterator;
 
-// The enum values match the concrete class names
+// The states of a button, as drawn in doc/ButtonStateMachine.png
 enum class BtnState
 {
 	NoPress,
@@ -66,53 +69,21 @@ struct GetDuration
 // Setter for the press time
 typedef chrono::steady_clock::time_point SetPressTime;
 
-// A basic digital button state reacts to the following events
-class DigitalButtonState : public pocket_fsm::StatePimplIF<DigitalButtonImpl>
+// Getter for the next time the button needs an event even if its input stays the same. Pass the input and settings of
+// the last Pressed or Released event. A deadline at or before in_now means every poll, time_point::max() means never.
+struct GetDeadline
 {
-	BASE_STATE(DigitalButtonState)
-
-	// Display logs on entry for debigging
-	REACT(OnEntry)
-	override;
-
-	// ignored
-	REACT(OnExit)
-	override { }
-
-	// Adds chord to stack if absent
-	REACT(Pressed);
-
-	// Remove chord from stack if present
-	REACT(Released);
-
-	// ignored by default
-	REACT(Sync) { }
-
-	// Always assign press time
-	REACT(SetPressTime)
-	final;
-
-	// Return press duration
-	REACT(GetDuration)
-	final;
-
-	// Get matching enum value
-	virtual BtnState getState() const = 0;
-
-	virtual void swapPimpl(DigitalButtonState& otherState)
-	{
-		_pimpl.swap(otherState._pimpl);
-	}
-
-	virtual void resetPimpl(DigitalButtonState & otherState)
-	{
-		_pimpl = otherState._pimpl;
-	}
+	chrono::steady_clock::time_point in_now;
+	bool in_pressed = false;
+	float in_turboTime = 0.f;
+	float in_holdTime = 0.f;
+	float in_dblPressWindow = 0.f;
+	chrono::steady_clock::time_point out_deadline;
 };
 
 // Feed this state machine with Pressed and Released events and it will sort out
-// what mappings to activate internally
-class DigitalButton : public pocket_fsm::FiniteStateMachine<DigitalButtonState>
+// what mappings to activate internally. The button only holds its slot in the table of its context.
+class DigitalButton
 {
 public:
 	// All digital _buttons need a reference to the same instance of the common structure within the same controller.
@@ -120,9 +91,12 @@ public:
 	struct Context
 	{
 		Context(Gamepad::Callback virtualControllerCallback, shared_ptr<MotionIf> mainMotion);
-		deque<pair<ButtonID, KeyCode>> gyroActionQueue; // Queue of gyro control actions currently in effect
-		deque<pair<ButtonID, KeyCode>> activeTogglesQueue;
-		deque<ButtonID> chordStack; // Represents the current active _buttons in order from most recent to latest
+		~Context();
+		// The keys are those of the compiled mappings, shared so that queuing one doesn't copy it
+		ActionQueue gyroActionQueue; // Queue of gyro control actions currently in effect
+		ActionQueue activeTogglesQueue;
+		ChordStack chordStack; // Represents the current active _buttons in order from most recent to latest
+		unsigned int chordStackRevision = 0; // Incremented whenever chordStack changes
 		unique_ptr<Gamepad> _vigemController;
 		function<DigitalButton *(ButtonID)> _getMatchingSimBtn; // A functor to JoyShock::getMatchingSimBtn
 		function<DigitalButton *(ButtonID, optional<MapIterator>&)> _getMatchingDiagBtn; // A functor to JoyShock::getMatchingDiagBtn
@@ -131,24 +105,54 @@ public:
 		shared_ptr<MotionIf> rightMainMotion = nullptr;
 		shared_ptr<MotionIf> leftMotion = nullptr;
 		int nn = 0;
+		TimerWheel timers; // Deadlines of the buttons
+		unique_ptr<DigitalButtonTable> buttons; // State and data of the buttons, indexed by their slot
 
 		void updateChordStack(bool isPressed, ButtonID index);
+
+		bool hasActiveToggle(ButtonID id) const;
 	};
 
 	DigitalButton(shared_ptr<DigitalButton::Context> _context, JSMButton &mapping);
+	DigitalButton(DigitalButton &&other) noexcept;
+	DigitalButton(const DigitalButton &) = delete;
+	DigitalButton &operator=(const DigitalButton &) = delete;
+	~DigitalButton();
 
 	const ButtonID _id;
 
-	// Get the enum identifier of the current state
-	BtnState getState() const
-	{
-		return getCurrentState()->getState();
-	}
+	// Send an event to the current state, then schedule the next time the button needs one
+	Pressed &sendEvent(Pressed &evt);
+	Released &sendEvent(Released &evt);
+	GetDuration &sendEvent(GetDuration &evt);
+	SetPressTime &sendEvent(SetPressTime &evt);
 
-	void swapState(DigitalButton& otherBtn)
+	template<typename E>
+	E sendEvent(E &&evt)
 	{
-		// Swap just the state, but leave the pimpls in their respective button
-		_currentState->swapPimpl(*otherBtn._currentState);
-		_currentState.swap(otherBtn._currentState);
+		E event(move(evt));
+		sendEvent(event);
+		return event;
 	}
+
+	// Send the input of the last event again at time now if a deadline of the current state has passed since. Used
+	// between two polls, when there is no new input to send.
+	void sendDueEvent(chrono::steady_clock::time_point now);
+
+	// Whether sending an event with this input would do nothing: the input and the chord stack are the same as for
+	// the last event, and no deadline of the current state has passed since
+	bool isIdle(bool pressed) const;
+
+	// Get the enum identifier of the current state
+	BtnState getState() const;
+
+	void swapState(DigitalButton &otherBtn);
+
+private:
+	friend struct DigitalButtonTable;
+
+	static constexpr uint32_t NO_SLOT = numeric_limits<uint32_t>::max();
+
+	shared_ptr<Context> _context;
+	uint32_t _slot; // Index in the table of the context, and of its timer. NO_SLOT once moved from.
 };
@@ -2,6 +2,8 @@
 
 #include "JoyShockMapper.h"
 #include "PlatformDefinitions.h"
+#include "OutputQueue.h"
+#include "Trace.h"
 
 #include <functional>
 #include <string>
@@ -33,20 +35,94 @@ extern std::condition_variable commandQueueCV;
 #endif
 
 
+class Gamepad;
+
+// Output sent from a thread with an active capture goes to the capture instead of the OS. A replay uses this to
+// record what the mapping produces without moving the real mouse.
+class OutputCapture
+{
+public:
+	virtual ~OutputCapture()
+	{
+	}
+
+	static OutputCapture *active()
+	{
+		return _active;
+	}
+
+	void start()
+	{
+		_active = this;
+	}
+
+	void stop()
+	{
+		_active = nullptr;
+	}
+
+	virtual void pressMouse(uint16_t code, bool isPressed) = 0;
+	virtual void pressKey(const KeyCode &key, bool pressed) = 0;
+	virtual void moveMouse(float x, float y) = 0;
+	virtual void setMouseNorm(float x, float y) = 0;
+	// Virtual controller handed out instead of a real one
+	virtual Gamepad *newGamepad(ControllerScheme scheme) = 0;
+
+private:
+	static inline thread_local OutputCapture *_active = nullptr;
+};
+
+// Output sent from a thread while it holds a frame is queued, and reaches the virtual devices in a single report when
+// the outermost frame of the thread ends. Everything a mapping tick produces is then applied at once.
+class OutputFrame
+{
+public:
+	OutputFrame();
+	~OutputFrame();
+
+	OutputFrame(const OutputFrame &) = delete;
+	OutputFrame &operator=(const OutputFrame &) = delete;
+};
+
+// Add output on its way to the OS to the trace
+inline void traceButtonOutput(const char *name, uint16_t code, bool pressed)
+{
+	if (Trace::enabled())
+	{
+		Trace::instant(name, "output", to_string(code) + (pressed ? " down" : " up"));
+	}
+}
+
+inline void traceMotionOutput(const char *name, float x, float y)
+{
+	if (Trace::enabled())
+	{
+		Trace::instant(name, "output", to_string(x) + ", " + to_string(y));
+	}
+}
+
 // get the user's mouse sensitivity multiplier from the user. In Windows it's an int, but who cares? it's well within range for float to represent it exactly
 // also, if this is ported to other platforms, we might want non-integer sensitivities
 float getMouseSpeed();
 
 // send mouse button
-int pressMouse(KeyCode vkKey, bool isPressed);
+int pressMouse(const KeyCode &vkKey, bool isPressed);
 
 // send key press
-int pressKey(KeyCode vkKey, bool pressed);
+int pressKey(const KeyCode &vkKey, bool pressed);
 
 void moveMouse(float x, float y);
 
 void setMouseNorm(float x, float y);
 
+// Lay out the virtual keyboard and mouse: a device for each or one for both, how often the mouse reports relative
+// motion at most (0 for no limit) and how many positions the absolute pointer has across the screen. Only Linux
+// creates its own devices, so it is the only one to use this.
+void configureVirtualDevices(VirtualDevices layout, float mouseRate, FloatXY pointerResolution);
+
+// Stop the threads of the virtual devices and destroy them. Called once when exiting.
+void releaseVirtualDevices();
+
 // delta time will apply to shaped movement, but the extra (velocity parameters after deltaTime) is
 // applied as given
 inline void shapedSensitivityMoveMouse(float x, float y, float deltaTime, float extraVelocityX, float extraVelocityY)
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "JslWrapper.h"
+#include "InputHelpers.h"
+
+#include <fstream>
+#include <string>
+#include <memory>
+#include <functional>
+
+// A recording is a header followed by records. Every record starts with a RecordHeader and its size is a multiple
+// of 8 bytes, so the whole file can be memory mapped and walked in place. The structures are written as they are
+// in memory, which makes recordings specific to the platform and version that produced them.
+namespace InputRecording
+{
+
+constexpr char MAGIC[8] = { 'J', 'S', 'M', 'R', 'E', 'C', '\0', '\0' };
+constexpr uint32_t VERSION = 1;
+
+struct FileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize; // sizeof(FileHeader), to detect recordings from a different layout
+};
+
+enum class RecordType : uint32_t
+{
+	DEVICE = 1, // A DeviceRecord, written every time the controllers get connected
+	POLL,       // A PollRecord followed by its IMU_SAMPLEs
+	TOUCH,      // A TouchRecord
+	COMMAND,    // The text of a command line, not null terminated
+};
+
+struct RecordHeader
+{
+	RecordType type;
+	uint32_t size;   // Payload size in bytes, without the padding to the next record
+	uint64_t timeUs; // Time since the recording started
+};
+
+struct DeviceRecord
+{
+	int32_t handle;
+	int32_t controllerType;
+	int32_t splitType;
+	int32_t colour;
+	int32_t touchpadSizeX;
+	int32_t touchpadSizeY;
+	char guid[64];
+};
+
+struct PollRecord
+{
+	int32_t handle;
+	float deltaTime;
+	JOY_SHOCK_STATE state;
+	JOY_SHOCK_STATE lastState;
+	IMU_STATE imuState;
+	IMU_STATE lastImuState;
+	TOUCH_STATE touchState;
+	TOUCH_STATE lastTouchState;
+	uint64_t imuTimestampUs; // 0 if the backend doesn't provide one
+	int32_t numImuSamples;
+	int32_t padding;
+};
+
+struct TouchRecord
+{
+	int32_t handle;
+	float deltaTime;
+	TOUCH_STATE state;
+	TOUCH_STATE prevState;
+};
+
+} // namespace InputRecording
+
+// Wraps a backend and writes everything its callbacks hand to the mapping in a recording
+class JslRecorder : public JslWrapper
+{
+public:
+	// Returns nullptr if the file can't be created
+	static JslRecorder *getNew(shared_ptr<JslWrapper> device, const string &fileName);
+
+	// Record a command line entered while recording, so that the replay applies it at the same point
+	virtual void RecordCommand(const string &line) = 0;
+
+	// The backend being recorded
+	virtual shared_ptr<JslWrapper> GetDevice() = 0;
+};
+
+// Headless backend that plays a recording back as fast as the mapping can process it
+class JslReplay : public JslWrapper
+{
+public:
+	// Returns nullptr if the file is missing or isn't a valid recording
+	static JslReplay *getNew(const string &fileName);
+
+	// Send every record to the callbacks and commands to processCommand. Returns the number of polls replayed.
+	virtual size_t Replay(function<void(const string &)> processCommand) = 0;
+
+	// Recorded time of the record being replayed
+	virtual uint64_t GetReplayTimeUs() const = 0;
+};
+
+// Writes every output of the calling thread as a line of text stamped with the replay time, so that two replays
+// of the same recording can be compared with any diff tool. Nothing reaches the OS while the capture is active.
+class ReplayOutputLog : public OutputCapture
+{
+public:
+	// out may be null to discard the output
+	ReplayOutputLog(const JslReplay &replay, ostream *out);
+
+	void pressMouse(uint16_t code, bool isPressed) override;
+	void pressKey(const KeyCode &key, bool pressed) override;
+	void moveMouse(float x, float y) override;
+	void setMouseNorm(float x, float y) override;
+	Gamepad *newGamepad(ControllerScheme scheme) override;
+
+	// Start a line for a new event with the replay time. Returns null if the output is discarded.
+	ostream *event();
+
+private:
+	const JslReplay &_replay;
+	ostream *_out;
+};
@@ -3,6 +3,7 @@
 #include "JoyShockMapper.h"
 #include "Mapping.h"
 #include <sstream>
+#include <atomic>
 
 // Global ID generator
 static unsigned int _delegateID = 1;
@@ -24,9 +25,23 @@ public:
 
 	virtual JSMVariableBase *reset() = 0;
 
+	// Incremented whenever any variable changes, so that copies of their values can tell when they are outdated.
+	static unsigned int revision()
+	{
+		return _revision.load(memory_order_relaxed);
+	}
+
+protected:
+	static void notifyRevision()
+	{
+		_revision.fetch_add(1, memory_order_relaxed);
+	}
+
 private:
 	// a user provided label
 	string _label;
+
+	static inline atomic<unsigned int> _revision = 1;
 };
 
 // JSMVariable is a wrapper class for an underlying variable of type T.
@@ -153,6 +168,7 @@ public:
 		_value = _filter(oldValue, newValue); // Pass new value through filtering
 		if (_value != oldValue)
 		{
+			JSMVariableBase::notifyRevision();
 			// Notify listeners of the change if there's a change
 			for (auto listener : _onChangeListeners)
 				listener.second(_value);
@@ -186,6 +202,7 @@ public:
 		{
 			// Create the chord when requested, using the copy constructor.
 			_chordedVariables.emplace(chord, JSMVariable<T>(*this, Base::_defVal));
+			JSMVariableBase::notifyRevision();
 		}
 		return &_chordedVariables[chord];
 	}
@@ -221,6 +238,7 @@ public:
 	{
 		JSMVariable<T>::reset();
 		_chordedVariables.clear();
+		JSMVariableBase::notifyRevision();
 		return this;
 	}
 };
@@ -264,6 +282,7 @@ public:
 			{
 				Base::_chordedVariables.erase(modeshiftVar);
 				_chordToRemove = ButtonID::NONE;
+				JSMVariableBase::notifyRevision();
 			}
 		}
 	}
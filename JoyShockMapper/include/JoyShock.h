@@ -6,7 +6,11 @@
 #include "Stick.h"
 #include "JslWrapper.h"
 #include "SettingsManager.h"
+#include "Smoothing.h"
+#include "OutputQueue.h"
 #include "../src/quatMaths.cpp"
+#include <bitset>
+#include <deque>
 
 // An instance of this class represents a single controller device that JSM is listening to.
 class JoyShock
@@ -47,8 +51,25 @@ public:
 
 	void getSmoothedGyro(float x, float y, float length, float bottomThreshold, float topThreshold, int maxSamples, float &outX, float &outY);
 
+	// Apply one of the GYRO_FILTER engines other than SMOOTH to a gyro sample
+	void getFilteredGyro(GyroFilter filter, float x, float y, float deltaTime, float &outX, float &outY);
+
+	// Returns the time in seconds between the sensor report with the given timestamp and the previous one, or 0 for a repeated report.
+	float getSensorDeltaTime(uint64_t timestampUs, float fallbackDeltaTime);
+
 	void handleButtonChange(ButtonID id, bool pressed, int touchpadID = -1);
 
+	// Take the button mask of this poll, as given by JslWrapper::GetButtons. handleButtons then only sends events to
+	// the buttons whose bit changed since the last poll, unless a button deadline is due or the chord stack changed,
+	// including in the middle of the poll.
+	void setButtonMask(int buttons);
+
+	// Send the changes of the button mask to the buttons at these bit offsets, in order
+	void handleButtons(initializer_list<pair<ButtonID, int>> buttons);
+
+	// Turn the timers to now and send the buttons whose deadline passed their last input again, without a new poll
+	void handleDueButtons(chrono::steady_clock::time_point now);
+
 	void handleTriggerChange(ButtonID softIndex, ButtonID fullIndex, TriggerMode mode, float position, AdaptiveTriggerSetting &trigger_rumble);
 
 	bool isPressed(ButtonID btn);
@@ -65,6 +86,7 @@ public:
 	vector<DigitalButton> _gridButtons;
 	vector<TouchStick> _touchpads;
 	chrono::steady_clock::time_point _timeNow;
+	float _pollInterval = 0.f; // Running average of the time between two callbacks, in seconds
 	shared_ptr<MotionIf> _motion;
 	int _handle;
 	int _controllerType;
@@ -79,6 +101,7 @@ public:
 	bool set_neutral_quat = false;
 
 	Color _light_bar;
+	bool _micLight = false; // Mic light last sent to the controllers
 	AdaptiveTriggerSetting _leftEffect;
 	AdaptiveTriggerSetting _rightEffect;
 	static AdaptiveTriggerSetting _unusedEffect;
@@ -99,7 +122,46 @@ public:
 	float gyroXVelocity = 0.f;
 	float gyroYVelocity = 0.f;
 
+	// Sensor report counters
+	uint64_t _droppedReports = 0;   // Reports the device sent that were never processed
+	uint64_t _duplicateReports = 0; // Callbacks where the device had no new report
+
+	// Keyboard and mouse output on its way to the output thread when OUTPUT_THREAD is ON. The callbacks of a controller
+	// never run at the same time, so they are the single producer the queue needs.
+	OutputQueue _outputQueue;
+
 private:
+	// Chord resolved setting values, so that reading a setting on every tick doesn't walk the chord stack and query
+	// the settings manager. Values are resolved on first read and dropped whenever a setting or the chord stack changes.
+	struct ResolvedSettings
+	{
+		static constexpr size_t SIZE = size_t(magic_enum::enum_values<SettingID>().back()) + 1;
+
+		unsigned int settingsRevision = 0;
+		unsigned int chordStackRevision = 0;
+		bitset<SIZE> hasFloat;
+		bitset<SIZE> hasFloatXY;
+		bitset<SIZE> hasEnum;
+		array<float, SIZE> floats;
+		array<FloatXY, SIZE> floatXYs;
+		array<int, SIZE> enums;
+	};
+
+	// Drop the resolved values if they are outdated
+	void refreshResolvedSettings();
+
+	int _buttonMask = 0;
+	int _changedButtons = 0; // All bits set when every button has to be visited
+	unsigned int _buttonsChordStackRevision = 0;
+	int _buttonsNn = 0;
+
+	float resolveSetting(SettingID index);
+
+	template<typename E>
+	E resolveSetting(SettingID index);
+
+	ResolvedSettings _resolved;
+
 	// this large functions is defined further down
 	float handleFlickStick(float stickX, float stickY, Stick &stick, float stickLength, StickMode mode);
 
@@ -119,17 +181,24 @@ private:
 
 	float getSmoothedStickRotation(float value, float bottomThreshold, float topThreshold, int maxSamples);
 
-	static constexpr int MAX_GYRO_SAMPLES = 256;
+	static constexpr int MAX_GYRO_SAMPLES = 1024;
 	static constexpr int NUM_SAMPLES = 256;
 
-	array<float, NUM_SAMPLES> _flickSamples;
-	int _frontSample = 0;
+	RunningAverage<1, NUM_SAMPLES> _flickSmoothing;
 
-	array<FloatXY, MAX_GYRO_SAMPLES> _gyroSamples;
-	int _frontGyroSample = 0;
+	RunningAverage<2, MAX_GYRO_SAMPLES> _gyroSmoothing;
+	ExponentialAverage<2> _gyroExponentialSmoothing;
+
+	GyroFilter _gyroFilter = GyroFilter::SMOOTH; // Last filter used, to start over when another one is selected
+	OneEuroFilter<2> _gyroOneEuro;
+	BiquadLowPass<2> _gyroLowPass;
+	KalmanFilter<2> _gyroKalman;
 
 	Vec _lastGrav = Vec(0.f, -1.f, 0.f);
 
+	uint64_t _lastSensorTimestampUs = 0;
+	uint64_t _sensorPeriodUs = 0; // Shortest interval observed between two reports
+
 	float _windingAngleLeft = 0.f;
 	float _windingAngleRight = 0.f;
 
@@ -152,10 +221,49 @@ optional<E> JoyShock::getSettingAtChord(SettingID id, ButtonID chord)
 	return nullopt;
 }
 
+inline void JoyShock::refreshResolvedSettings()
+{
+	auto revision = JSMVariableBase::revision();
+	if (_resolved.settingsRevision != revision || _resolved.chordStackRevision != _context->chordStackRevision)
+	{
+		_resolved.settingsRevision = revision;
+		_resolved.chordStackRevision = _context->chordStackRevision;
+		_resolved.hasFloat.reset();
+		_resolved.hasFloatXY.reset();
+		_resolved.hasEnum.reset();
+	}
+}
+
 template<typename E>
 E JoyShock::getSetting(SettingID index)
 {
 	static_assert(is_enum<E>::value, "Parameter of JoyShock::getSetting<E> has to be an enum type");
+	if constexpr (is_same_v<E, StickMode>)
+	{
+		// Stick modes also depend on the state of the flick stick
+		return resolveSetting<E>(index);
+	}
+	else
+	{
+		refreshResolvedSettings();
+		size_t slot = size_t(index);
+		if (slot < ResolvedSettings::SIZE && _resolved.hasEnum[slot])
+		{
+			return static_cast<E>(_resolved.enums[slot]);
+		}
+		E value = resolveSetting<E>(index);
+		if (slot < ResolvedSettings::SIZE)
+		{
+			_resolved.enums[slot] = static_cast<int>(value);
+			_resolved.hasEnum[slot] = true;
+		}
+		return value;
+	}
+}
+
+template<typename E>
+E JoyShock::resolveSetting(SettingID index)
+{
 	// Look at active chord mappings starting with the latest activates chord
 	for (auto activeChord = _context->chordStack.begin(); activeChord != _context->chordStack.end(); activeChord++)
 	{
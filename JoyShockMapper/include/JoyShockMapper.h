@@ -233,6 +233,29 @@ enum class SettingID
 	MOUSELIKE_FACTOR,
 	RETURN_DEADZONE_ANGLE,
 	RETURN_DEADZONE_ANGLE_CUTOFF,
+	EVENT_POLLING,
+	SENSOR_TIMESTAMPS,
+	PARALLEL_MAPPING,
+	GYRO_SMOOTH_KERNEL,
+	GYRO_FILTER,
+	GYRO_FILTER_CUTOFF,
+	GYRO_FILTER_BETA,
+	GYRO_FILTER_PREDICTION,
+	OUTPUT_THREAD,
+	VIRTUAL_DEVICES,
+	VIRTUAL_MOUSE_RATE,
+	VIRTUAL_POINTER_RESOLUTION,
+	OUTPUT_REPORT_RATE,
+	LATENCY_STATS,
+	LATENCY_STATS_PERIOD,
+};
+
+// SettingID outgrew magic_enum's default range of values
+template<>
+struct magic_enum::customize::enum_range<SettingID>
+{
+	static constexpr int min = -1;
+	static constexpr int max = 255;
 };
 
 // constexpr are like #define but with respect to typeness
@@ -256,6 +279,26 @@ enum class GyroSpace
 	WORLD_LEAN,
 	INVALID
 };
+enum class SmoothingKernel
+{
+	BOX,
+	EXPONENTIAL,
+	INVALID
+};
+enum class GyroFilter
+{
+	SMOOTH,
+	ONE_EURO,
+	LOW_PASS,
+	KALMAN,
+	INVALID
+};
+enum class VirtualDevices
+{
+	SEPARATE,
+	COMBINED,
+	INVALID
+};
 enum class ControllerOrientation
 {
 	FORWARD,
@@ -1,6 +1,7 @@
 // JoyShockLibrary.h - Contains declarations of functions
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <iostream>
 
@@ -172,6 +173,16 @@ typedef struct TOUCH_STATE
 
 #endif
 
+// A single sensor report and the time at which the device sampled it
+typedef struct IMU_SAMPLE
+{
+	IMU_STATE imu;
+	uint64_t timestampUs;
+} IMU_SAMPLE;
+
+// Maximum number of sensor reports buffered per device between two callbacks
+constexpr int MAX_IMU_SAMPLES = 64;
+
 class JslWrapper
 {
 protected:
@@ -229,6 +240,15 @@ public:
 	virtual void SetPlayerNumber(int deviceId, int number) = 0;
 	virtual void SetTriggerEffect(int deviceId, const AdaptiveTriggerSetting &_leftTriggerEffect, const AdaptiveTriggerSetting &_rightTriggerEffect) { };
 	virtual void SetMicLight(int deviceId, unsigned char mode) { };
+	// Effect packets sent to the controller and the changes that went out with another one since the last call. Returns
+	// false if the backend doesn't schedule the output of the controller.
+	virtual bool GetOutputReportStats(int deviceId, uint64_t &sent, uint64_t &coalesced) { return false; };
+	// Sensor timestamp in microseconds of the sample returned by the last GetIMUState call, when the backend provides one
+	virtual bool GetIMUTimestamp(int deviceId, uint64_t &timestampUs) { return false; };
+	// Move every sensor report received since the last call into samples, oldest first. Returns the number of samples written.
+	virtual int GetIMUSamples(int deviceId, IMU_SAMPLE *samples, int maxSamples) { return 0; };
+	// Time at which the state handed to the current callback was read. A replay returns the recorded time instead.
+	virtual std::chrono::steady_clock::time_point GetPollTime(int deviceId) { return std::chrono::steady_clock::now(); };
 	virtual std::string GetControllerGUID(int deviceId) = 0;
 	virtual bool RemoveController(int handle) = 0;
 };
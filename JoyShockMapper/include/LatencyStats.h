@@ -0,0 +1,108 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+#include "Trace.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+// Stages of the path from a controller report to the OS
+enum class Stage
+{
+	DEVICE_READ,
+	MOTION,
+	GYRO_SPACE,
+	SMOOTHING,
+	LEFT_STICK,
+	RIGHT_STICK,
+	MOTION_STICK,
+	BUTTONS,
+	INJECTION,
+	COUNT
+};
+
+// Time spent in each stage, when LATENCY_STATS is ON. Every thread records into histograms of its own, so that
+// recording never waits on a lock or shares a cache line with another thread. Reading adds them up.
+class LatencyStats
+{
+public:
+	struct Summary
+	{
+		uint64_t count = 0;
+		chrono::nanoseconds p50{ 0 };
+		chrono::nanoseconds p99{ 0 };
+		chrono::nanoseconds max{ 0 };
+	};
+
+	typedef array<Summary, size_t(Stage::COUNT)> Summaries;
+
+	static bool enabled()
+	{
+		return _enabled.load(memory_order_relaxed);
+	}
+
+	static void setEnabled(bool enabled)
+	{
+		_enabled.store(enabled, memory_order_relaxed);
+	}
+
+	static void record(Stage stage, chrono::nanoseconds duration);
+
+	static Summaries summarize();
+	static void reset();
+
+	// A table for the console
+	static void print(ostream &out, const Summaries &summaries);
+	// Lines appended to a CSV file, stamped with the current time
+	static bool append(const string &fileName, const Summaries &summaries);
+
+private:
+	static inline atomic_bool _enabled = false;
+};
+
+// Times a stage from its construction until stop() or its destruction, for the statistics and the trace
+class StageTimer
+{
+public:
+	explicit StageTimer(Stage stage)
+	  : _stage(stage)
+	  , _running(LatencyStats::enabled() || Trace::enabled())
+	{
+		if (_running)
+		{
+			_start = chrono::steady_clock::now();
+		}
+	}
+
+	~StageTimer()
+	{
+		stop();
+	}
+
+	StageTimer(const StageTimer &) = delete;
+	StageTimer &operator=(const StageTimer &) = delete;
+
+	void stop()
+	{
+		if (_running)
+		{
+			_running = false;
+			auto end = chrono::steady_clock::now();
+			if (LatencyStats::enabled())
+			{
+				LatencyStats::record(_stage, end - _start);
+			}
+			if (Trace::enabled())
+			{
+				Trace::complete(magic_enum::enum_name(_stage), "stage", _start, end);
+			}
+		}
+	}
+
+private:
+	Stage _stage;
+	bool _running;
+	chrono::steady_clock::time_point _start;
+};
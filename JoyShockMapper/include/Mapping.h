@@ -7,23 +7,51 @@
 class EventActionIf
 {
 public:
-	typedef function<void(EventActionIf *)> Callback;
+	// One call on the button, kept as plain data so that mappings copy and run without allocating
+	struct Callback
+	{
+		enum class Type : uint8_t
+		{
+			None,
+			BtnPress,
+			BtnRelease,
+			GyroAction,
+			RemoveGyroAction,
+			Rumble,
+			StartCalibration,
+			FinishCalibration,
+			Command,
+		};
+
+		Type type = Type::None;
+		shared_ptr<const KeyCode> key; // The key that was mapped, shared by all the calls it makes
+		int smallRumble = 0;
+		int bigRumble = 0;
+
+		explicit operator bool() const
+		{
+			return type != Type::None;
+		}
+
+		void operator()(EventActionIf *button) const;
+	};
 
-	virtual void RegisterInstant(BtnEvent evt, Callback cb) = 0;
-	virtual void ApplyGyroAction(KeyCode gyroAction) = 0;
+	virtual void RegisterInstant(BtnEvent evt, const Callback &cb) = 0;
+	virtual void ApplyGyroAction(const shared_ptr<const KeyCode> &gyroAction) = 0;
 	virtual void RemoveGyroAction() = 0;
 	virtual void SetRumble(int smallRumble, int bigRumble) = 0;
-	virtual void ApplyBtnPress(KeyCode key) = 0;
-	virtual void ApplyBtnRelease(KeyCode key) = 0;
-	virtual void ApplyButtonToggle(KeyCode key, Callback apply, Callback release) = 0;
+	virtual void ApplyBtnPress(const KeyCode &key) = 0;
+	virtual void ApplyBtnRelease(const KeyCode &key) = 0;
+	virtual void ApplyButtonToggle(const KeyCode &key, const Callback &apply, const Callback &release) = 0;
 	virtual void StartCalibration() = 0;
 	virtual void FinishCalibration() = 0;
 	virtual const char *getDisplayName() = 0;
 };
 
 // This structure handles the mapping of a button, buy processing and action
-// to be done on tap, hold, turbo and others. It holds a map of actions to perform
-// when a specific event happens. This replaces the old Mapping structure.
+// to be done on tap, hold, turbo and others. It is compiled at parse time into a
+// flat table of the steps to perform when a specific event happens, indexed by
+// event. This replaces the old Mapping structure.
 class Mapping
 {
 public:
@@ -56,15 +84,48 @@ public:
 	friend ostream &operator<<(ostream &out, const Mapping &mapping);
 
 private:
-	string _description = "no input";
-	string _command;
+	static constexpr size_t NUM_EVENTS = size_t(BtnEvent::INVALID);
 
-	map<BtnEvent, EventActionIf::Callback> _eventMapping;
-	float _tapDurationMs = MAGIC_TAP_DURATION;
-	bool _hasViGEmBtn = false;
+	// Something the mapping does on an event
+	struct Step
+	{
+		enum class Kind : uint8_t
+		{
+			Run,     // Call action
+			Toggle,  // Call action or release depending on whether the key is toggled on
+			Instant, // Have the button call action on instantEvent
+		};
+
+		Kind kind = Kind::Run;
+		BtnEvent instantEvent = BtnEvent::INVALID;
+		EventActionIf::Callback action;
+		EventActionIf::Callback release;
+	};
 
-	void InsertEventMapping(BtnEvent evt, EventActionIf::Callback action);
-	static void RunBothActions(EventActionIf *btn, EventActionIf::Callback action1, EventActionIf::Callback action2);
+	// Everything parsed out of a command. It doesn't change once parsed, so the copies of a mapping share it, and
+	// copying one doesn't copy its strings.
+	struct Compiled
+	{
+		string description = "no input";
+		string command;
+		vector<Step> steps;                            // Grouped by event, in the order they were bound
+		array<uint16_t, NUM_EVENTS + 1> eventStart{}; // The steps of event evt are [eventStart[evt], eventStart[evt + 1])
+		float tapDurationMs = MAGIC_TAP_DURATION;
+		bool hasViGEmBtn = false;
+
+		size_t numSteps(BtnEvent evt) const
+		{
+			return eventStart[size_t(evt) + 1] - eventStart[size_t(evt)];
+		}
+	};
+
+	shared_ptr<Compiled> _compiled; // Only modified through edit()
+
+	const Compiled &compiled() const;
+	// The compiled data of this mapping alone, to modify while parsing
+	Compiled &edit();
+
+	void InsertEventMapping(BtnEvent evt, const Step &step);
 
 public:
 	Mapping() = default;
@@ -78,12 +139,12 @@ public:
 
 	string_view description() const
 	{
-		return _description;
+		return compiled().description;
 	}
 
 	string_view command() const
 	{
-		return _command;
+		return compiled().command;
 	}
 	void ProcessEvent(BtnEvent evt, EventActionIf &button) const;
 
@@ -93,25 +154,19 @@ public:
 
 	inline bool isValid() const
 	{
-		return !_command.empty();
+		return !compiled().command.empty();
 	}
 
 	inline float getTapDuration() const
 	{
-		return _tapDurationMs;
+		return compiled().tapDurationMs;
 	}
 
-	inline void clear()
-	{
-		_eventMapping.clear();
-		_description.clear();
-		_tapDurationMs = MAGIC_TAP_DURATION;
-		_hasViGEmBtn = false;
-	}
+	void clear();
 
 	inline bool hasViGEmBtn() const
 	{
-		return _hasViGEmBtn;
+		return compiled().hasViGEmBtn;
 	}
 };
 
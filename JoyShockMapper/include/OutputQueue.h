@@ -0,0 +1,118 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+// A keyboard or mouse output recorded for the output thread
+struct OutputEvent
+{
+	enum class Type : uint8_t
+	{
+		KEY,
+		MOUSE_BUTTON,
+		MOVE,
+		MOVE_ABSOLUTE,
+	};
+
+	Type type;
+	bool pressed = false;
+	uint16_t code = 0;
+	float x = 0.f;
+	float y = 0.f;
+	chrono::steady_clock::time_point queuedTime;
+};
+
+// Output of one controller on its way to the output thread, so that the mapping never waits on the OS. The thread
+// mapping the controller is the only one to push and the output thread the only one to pop, so the ring needs no lock:
+// each side owns an index and only reads the other one. The output pushed during a session is made visible to the
+// output thread all at once when the session ends, so that it reaches the OS in a single report.
+class OutputQueue
+{
+public:
+	static constexpr size_t CAPACITY = 1024;
+
+	struct Metrics
+	{
+		size_t depth = 0;    // Events waiting right now
+		size_t maxDepth = 0; // Most events waiting at the end of a session
+		uint64_t events = 0; // Events sent to the OS
+		uint64_t stalls = 0; // Times the mapping had to wait for room in the ring
+		chrono::nanoseconds totalLatency{ 0 };
+		chrono::nanoseconds maxLatency{ 0 };
+	};
+
+	// Sessions opened by the calling thread while this exists use their queue even if not enabled. The parallel
+	// mapping workers need this, so that the output of each controller leaves as soon as it is mapped, from one thread.
+	class Required
+	{
+	public:
+		Required()
+		{
+			++_required;
+		}
+		~Required()
+		{
+			--_required;
+		}
+
+		Required(const Required &) = delete;
+		Required &operator=(const Required &) = delete;
+	};
+
+	// Output sent from the calling thread goes to queue for the lifetime of the session, if enabled
+	class Session
+	{
+	public:
+		Session(OutputQueue &queue, bool enabled);
+		~Session();
+
+		Session(const Session &) = delete;
+		Session &operator=(const Session &) = delete;
+
+	private:
+		OutputQueue *_queue;
+	};
+
+	OutputQueue();
+	// Whatever is still waiting is sent before the queue goes away
+	~OutputQueue();
+
+	OutputQueue(const OutputQueue &) = delete;
+	OutputQueue &operator=(const OutputQueue &) = delete;
+
+	// Push event to the queue of the calling thread's session. Returns false if there is none and event must be sent now:
+	// the queued output is sent first, so that event can't overtake it.
+	static bool push(OutputEvent event);
+
+	// Statistics since the last reset
+	Metrics metrics() const;
+	void resetMetrics();
+
+private:
+	friend class OutputThread;
+
+	void pushEvent(const OutputEvent &event);
+	void publish();
+	// Output thread side
+	const OutputEvent *front() const;
+	void pop();
+
+	array<OutputEvent, CAPACITY> _ring;
+	// Written by the mapping thread only
+	alignas(64) atomic<size_t> _tail = 0;
+	size_t _writeIndex = 0;
+	// Written by the output thread only
+	alignas(64) atomic<size_t> _head = 0;
+
+	atomic<size_t> _maxDepth = 0;
+	atomic<uint64_t> _stalls = 0;
+	atomic<uint64_t> _events = 0;
+	atomic<int64_t> _totalLatencyNs = 0;
+	atomic<int64_t> _maxLatencyNs = 0;
+
+	static inline thread_local OutputQueue *_active = nullptr;
+	static inline thread_local int _required = 0;
+};
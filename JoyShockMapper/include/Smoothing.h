@@ -0,0 +1,297 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numbers>
+
+// Average of the last values pushed, over a window that can change with every push. The sum of the window is updated
+// as values enter and leave it, so a push costs the same whatever the window length. Values pushed before the
+// first one count as zeros.
+template<int CHANNELS, int CAPACITY>
+class RunningAverage
+{
+	static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "The capacity of a RunningAverage must be a power of two");
+	static constexpr unsigned int MASK = CAPACITY - 1;
+
+public:
+	typedef array<float, CHANNELS> Value;
+
+	static constexpr int capacity()
+	{
+		return CAPACITY;
+	}
+
+	void reset()
+	{
+		for (auto &sample : _samples)
+			sample.fill(0.f);
+		_sum.fill(0.);
+		_front = 0;
+		_window = 0;
+	}
+
+	// Push value and return the average of the last window values, window included in [1, CAPACITY]
+	Value push(const Value &value, int window)
+	{
+		window = clamp(window, 1, CAPACITY);
+		// The newest value is at the front and the oldest ones follow it
+		_front = (_front - 1) & MASK;
+		if (_window == CAPACITY)
+		{
+			subtract(_samples[_front]); // The oldest value is about to be overwritten
+			--_window;
+		}
+		_samples[_front] = value;
+		add(value);
+		++_window;
+		while (_window > window)
+		{
+			subtract(_samples[(_front + --_window) & MASK]);
+		}
+		while (_window < window)
+		{
+			add(_samples[(_front + _window++) & MASK]);
+		}
+		if (_front == 0)
+		{
+			// Rounding errors would accumulate forever otherwise
+			recompute();
+		}
+		Value average;
+		for (int c = 0; c < CHANNELS; ++c)
+			average[c] = float(_sum[c] / window);
+		return average;
+	}
+
+private:
+	void add(const Value &value)
+	{
+		for (int c = 0; c < CHANNELS; ++c)
+			_sum[c] += value[c];
+	}
+
+	void subtract(const Value &value)
+	{
+		for (int c = 0; c < CHANNELS; ++c)
+			_sum[c] -= value[c];
+	}
+
+	void recompute()
+	{
+		_sum.fill(0.);
+		for (int i = 0; i < _window; ++i)
+			add(_samples[(_front + i) & MASK]);
+	}
+
+	array<Value, CAPACITY> _samples{};
+	array<double, CHANNELS> _sum{};
+	unsigned int _front = 0;
+	int _window = 0; // Number of values in _sum
+};
+
+// Exponential moving average whose weights have the same centre of mass as a window of the given length, so that
+// it lags behind the input as much as the RunningAverage it can replace, but without a hard edge.
+template<int CHANNELS>
+class ExponentialAverage
+{
+public:
+	typedef array<float, CHANNELS> Value;
+
+	void reset()
+	{
+		_average.fill(0.f);
+	}
+
+	Value push(const Value &value, int window)
+	{
+		float alpha = 2.f / (max(window, 1) + 1.f);
+		for (int c = 0; c < CHANNELS; ++c)
+			_average[c] += alpha * (value[c] - _average[c]);
+		return _average;
+	}
+
+private:
+	Value _average{};
+};
+
+// Filters for a signal sampled at irregular intervals. They start from the first value pushed after a reset so that
+// switching to one doesn't cause a transient.
+
+// One euro filter (Casiez et al. 2012): a low-pass filter whose cutoff frequency rises with the speed at which the
+// value changes, so that it removes jitter when still and adds little lag when moving. The channels share the speed,
+// and so the cutoff, so that a vector keeps its direction.
+template<int CHANNELS>
+class OneEuroFilter
+{
+public:
+	typedef array<float, CHANNELS> Value;
+
+	void reset()
+	{
+		_started = false;
+	}
+
+	Value push(const Value &value, float deltaTime, float minCutoff, float beta, float derivativeCutoff = 1.f)
+	{
+		if (!_started || deltaTime <= 0.f)
+		{
+			_started = true;
+			_value = value;
+			_derivative.fill(0.f);
+			return _value;
+		}
+		float derivativeAlpha = alpha(derivativeCutoff, deltaTime);
+		float speedSquared = 0.f;
+		for (int c = 0; c < CHANNELS; ++c)
+		{
+			_derivative[c] += derivativeAlpha * ((value[c] - _value[c]) / deltaTime - _derivative[c]);
+			speedSquared += _derivative[c] * _derivative[c];
+		}
+		float valueAlpha = alpha(minCutoff + beta * sqrtf(speedSquared), deltaTime);
+		for (int c = 0; c < CHANNELS; ++c)
+		{
+			_value[c] += valueAlpha * (value[c] - _value[c]);
+		}
+		return _value;
+	}
+
+private:
+	static float alpha(float cutoff, float deltaTime)
+	{
+		float tau = 1.f / (2.f * numbers::pi_v<float> * cutoff);
+		return 1.f / (1.f + tau / deltaTime);
+	}
+
+	bool _started = false;
+	Value _value{};
+	Value _derivative{};
+};
+
+// Second order Butterworth low-pass filter. The coefficients are computed again when the cutoff or the interval
+// between samples changes.
+template<int CHANNELS>
+class BiquadLowPass
+{
+public:
+	typedef array<float, CHANNELS> Value;
+
+	void reset()
+	{
+		_started = false;
+	}
+
+	Value push(const Value &value, float deltaTime, float cutoff)
+	{
+		if (!_started || deltaTime <= 0.f)
+		{
+			_started = true;
+			// Settle as if the value had always been there
+			_x1 = _x2 = _y1 = _y2 = value;
+			return value;
+		}
+		if (deltaTime != _deltaTime || cutoff != _cutoff)
+		{
+			computeCoefficients(deltaTime, cutoff);
+		}
+		Value output;
+		for (int c = 0; c < CHANNELS; ++c)
+		{
+			output[c] = _b0 * value[c] + _b1 * _x1[c] + _b2 * _x2[c] - _a1 * _y1[c] - _a2 * _y2[c];
+		}
+		_x2 = _x1;
+		_x1 = value;
+		_y2 = _y1;
+		_y1 = output;
+		return output;
+	}
+
+private:
+	void computeCoefficients(float deltaTime, float cutoff)
+	{
+		_deltaTime = deltaTime;
+		_cutoff = cutoff;
+		// Stay under the Nyquist frequency to remain stable
+		float frequency = min(cutoff * deltaTime, 0.45f);
+		float omega = 2.f * numbers::pi_v<float> * frequency;
+		float alpha = sinf(omega) / numbers::sqrt2_v<float>; // sin(omega) / 2Q with a Q of 1/sqrt(2)
+		float cosOmega = cosf(omega);
+		float a0 = 1.f + alpha;
+		_b0 = (1.f - cosOmega) / 2.f / a0;
+		_b1 = (1.f - cosOmega) / a0;
+		_b2 = _b0;
+		_a1 = -2.f * cosOmega / a0;
+		_a2 = (1.f - alpha) / a0;
+	}
+
+	bool _started = false;
+	float _deltaTime = 0.f;
+	float _cutoff = 0.f;
+	float _b0 = 1.f, _b1 = 0.f, _b2 = 0.f, _a1 = 0.f, _a2 = 0.f;
+	Value _x1{}, _x2{}, _y1{}, _y2{};
+};
+
+// Kalman filter estimating each channel and its rate of change, assuming the rate of change drifts randomly. Only the
+// ratio between the process and measurement noise matters once the filter settles, so it is set from the bandwidth
+// wanted. The rate of change can be used to predict the value a little ahead and make up for the lag.
+template<int CHANNELS>
+class KalmanFilter
+{
+public:
+	typedef array<float, CHANNELS> Value;
+
+	void reset()
+	{
+		_started = false;
+	}
+
+	Value push(const Value &value, float deltaTime, float cutoff, float prediction)
+	{
+		double omega = 2. * numbers::pi * cutoff;
+		if (!_started || deltaTime <= 0.f)
+		{
+			_started = true;
+			_value = value;
+			_rate.fill(0.f);
+			_p00 = MEASUREMENT_NOISE;
+			_p01 = _p10 = 0.;
+			_p11 = MEASUREMENT_NOISE * omega * omega;
+			return _value;
+		}
+		// Predict. The covariance is the same for all channels since they are measured together.
+		double dt = deltaTime;
+		// Spectral density of the process noise giving the wanted bandwidth, knowing a measurement every dt
+		double q = MEASUREMENT_NOISE * dt * omega * omega * omega * omega;
+		double p00 = _p00 + dt * (_p10 + _p01) + dt * dt * _p11 + q * dt * dt * dt / 3.;
+		double p01 = _p01 + dt * _p11 + q * dt * dt / 2.;
+		double p10 = _p10 + dt * _p11 + q * dt * dt / 2.;
+		double p11 = _p11 + q * dt;
+		// Update
+		double k0 = p00 / (p00 + MEASUREMENT_NOISE);
+		double k1 = p10 / (p00 + MEASUREMENT_NOISE);
+		_p00 = (1. - k0) * p00;
+		_p01 = (1. - k0) * p01;
+		_p10 = p10 - k1 * p00;
+		_p11 = p11 - k1 * p01;
+		Value output;
+		for (int c = 0; c < CHANNELS; ++c)
+		{
+			float predicted = _value[c] + deltaTime * _rate[c];
+			float innovation = value[c] - predicted;
+			_value[c] = predicted + float(k0) * innovation;
+			_rate[c] += float(k1) * innovation;
+			output[c] = _value[c] + prediction * _rate[c];
+		}
+		return output;
+	}
+
+private:
+	static constexpr double MEASUREMENT_NOISE = 1.;
+
+	bool _started = false;
+	Value _value{};
+	Value _rate{};
+	double _p00 = 0., _p01 = 0., _p10 = 0., _p11 = 0.;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+
+#include <array>
+#include <chrono>
+#include <vector>
+
+// Deadlines of the buttons of a controller, so that a poll only has to visit the buttons whose time has come instead
+// of all of them. The wheel has levels of 64 slots: a slot of the first level spans a millisecond, and a slot of each
+// next level spans the whole level below it. A timer is filed in the finest level that reaches its deadline and drops
+// down a level each time the wheel turns to the slot it sits in, so turning the wheel never visits a timer more than
+// once per level.
+class TimerWheel
+{
+public:
+	typedef chrono::steady_clock Clock;
+
+	TimerWheel();
+
+	// Number identifying a new timer, without a deadline
+	uint32_t add();
+
+	// Set the deadline of timer, replacing the one it had. It is due right away if deadline has passed.
+	void schedule(uint32_t timer, Clock::time_point deadline);
+	// Remove the deadline of timer. It is no longer due.
+	void cancel(uint32_t timer);
+
+	// Turn the wheel to now. The timers whose deadline has passed stay due until they are scheduled or cancelled.
+	void advance(Clock::time_point now);
+
+	bool isDue(uint32_t timer) const
+	{
+		return _due[timer];
+	}
+
+	bool anyDue() const
+	{
+		return _dueCount > 0;
+	}
+
+	// Earliest deadline of the timers that are not due yet, Clock::time_point::max() when none
+	Clock::time_point nextDeadline() const;
+
+private:
+	static constexpr int SLOT_BITS = 6;
+	static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+	static constexpr int LEVELS = 4; // 64ms, 4s, 4min and 4.7h. Later deadlines wait in the last slot of the last level.
+
+	struct Entry
+	{
+		uint32_t timer;
+		Clock::time_point deadline;
+	};
+
+	uint64_t tickOf(Clock::time_point time) const;
+	// Put entry in the slot that the wheel reaches at or before its deadline
+	void place(const Entry &entry);
+	// Whether entry still holds the deadline of its timer. Rescheduling a timer leaves its old entry behind.
+	bool isCurrent(const Entry &entry) const
+	{
+		return _deadlines[entry.timer] == entry.deadline;
+	}
+	void expire(uint32_t timer);
+	void setDue(uint32_t timer, bool due);
+	static bool isLater(const Entry &left, const Entry &right)
+	{
+		return left.deadline > right.deadline;
+	}
+
+	array<array<vector<Entry>, SLOTS>, LEVELS> _slots;
+	vector<Entry> _soon; // Deadlines within the millisecond the wheel is on
+	// Heap of the deadlines, earliest first. Entries left behind by cancelled and expired timers are dropped when they
+	// reach the top.
+	mutable vector<Entry> _earliest;
+	vector<Clock::time_point> _deadlines; // Clock::time_point::max() when none
+	vector<bool> _due;
+	size_t _pending = 0; // Timers with a deadline
+	size_t _dueCount = 0;
+	Clock::time_point _origin;
+	Clock::time_point _now;
+	uint64_t _tick = 0; // Milliseconds from _origin to _now
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "JoyShockMapper.h"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+// Timestamped events of the input path, streamed to a file in the Chrome trace event format, which Perfetto and
+// chrome://tracing can open. Every thread gathers its events in a buffer of its own and writes it out when it is
+// full, so that the file is only locked once every few hundred events. Nothing is recorded unless a trace is running:
+// callers check enabled() before building anything.
+class Trace
+{
+public:
+	static bool enabled()
+	{
+		return _enabled.load(memory_order_relaxed);
+	}
+
+	// Start writing events to fileName, replacing it. Returns false if it can't be opened.
+	static bool start(const string &fileName);
+	// Write out the events still buffered and close the file
+	static void stop();
+	static string fileName();
+
+	// An event spanning from begin to end
+	static void complete(string_view name, const char *category, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end);
+	// An event at the current time, with an optional detail to show alongside it
+	static void instant(string_view name, const char *category, string_view detail = {});
+
+private:
+	static inline atomic_bool _enabled = false;
+};
@@ -2,205 +2,249 @@
 #include "JSMVariable.hpp"
 #include "InputHelpers.h"
 #include "SettingsManager.h"
+#include "Trace.h"
+
+#include <initializer_list>
+#include <string_view>
 
 void DigitalButton::Context::updateChordStack(bool isPressed, ButtonID id)
 {
 	if (id < ButtonID::SIZE || id >= ButtonID::T1) // Can't chord touch stick _buttons
 	{
-		if (isPressed)
+		if (isPressed ? chordStack.push(id) : chordStack.erase(id))
 		{
-			auto foundChord = find(chordStack.begin(), chordStack.end(), id);
-			if (foundChord == chordStack.end())
-			{
-				// COUT << "Button " << index << " is pressed!\n";
-				chordStack.push_front(id); // Always push at the fromt to make it a stack
-			}
-		}
-		else
-		{
-			auto foundChord = find(chordStack.begin(), chordStack.end(), id);
-			if (foundChord != chordStack.end())
-			{
-				// COUT << "Button " << index << " is released!\n";
-				chordStack.erase(foundChord); // The chord is released
-			}
+			// COUT << "Button " << index << " is " << (isPressed ? "pressed" : "released") << "!\n";
+			++chordStackRevision;
 		}
 	}
 }
 
+bool DigitalButton::Context::hasActiveToggle(ButtonID id) const
+{
+	return activeTogglesQueue.contains(id);
+}
+
+namespace
+{
+// The display name of the press a mapping runs for, as JSMButton::getName, getSimPressName and getDiagPressName make
+// it. It holds the ids rather than the text, so that pressing a button doesn't build a string.
+struct PressName
+{
+	ButtonID first = ButtonID::INVALID; // NONE when the button is pressed alone, INVALID for no name
+	char separator = ',';
+	ButtonID second = ButtonID::INVALID;
+
+	static PressName chord(ButtonID chord, ButtonID id)
+	{
+		return { chord, ',', id };
+	}
+
+	// Pressed together with simBtn. Pressed with itself, it's actually a double press.
+	static PressName sim(ButtonID simBtn, ButtonID id)
+	{
+		return { simBtn, simBtn == id ? ',' : '+', id };
+	}
+
+	static PressName diag(ButtonID diagBtn, ButtonID id)
+	{
+		return { diagBtn, '*', id };
+	}
+};
+} // namespace
+
 struct Sync
 {
-	pocket_fsm::StateIF *nextState = nullptr;
+	BtnState nextState = BtnState::INVALID; // INVALID asks the receiver to release a sim press, and returns its next state
 	chrono::steady_clock::time_point pressTime;
 	const Mapping *activeMapping = nullptr;
-	string nameToRelease;
-	float turboTime;
-	float holdTime;
-	float dblPressWindow;
+	PressName nameToRelease;
+	float turboTime = 0.f;
+	float holdTime = 0.f;
+	float dblPressWindow = 0.f;
 };
 
-// Hidden implementation of the digital button
-// This class holds all the logic related to a single digital button. It does not hold the mapping but only a reference
-// to it. It also contains its various states, flags and data. The concrete state of the state machine hands off the
-// instance to the next state, and so is persistent across states
-struct DigitalButtonImpl : public pocket_fsm::PimplBase, public EventActionIf
+namespace
 {
-private:
-	static bool isSameKey(KeyCode key, const pair<ButtonID, KeyCode> &pair)
+// The nested states of the states in which a mapping is active
+enum class ActiveState : uint8_t
+{
+	StartPress,
+	HoldPress,
+	INVALID
+};
+} // namespace
+
+// Hidden implementation of the digital buttons
+// This struct holds the data of all the buttons of a context, with one array per field indexed by the slot of the
+// button. It does not hold the mappings but only a reference to them. A button's state is a plain enum, and what it
+// does with each event is looked up in the table of reactions below, so changing state allocates nothing. The slot of
+// a destroyed button is given to the next one created.
+struct DigitalButtonTable
+{
+	static constexpr uint32_t NO_SLOT = DigitalButton::NO_SLOT;
+	static constexpr size_t MAX_INSTANT_RELEASES = 8; // Registering up to this many doesn't allocate
+
+	DigitalButtonTable(DigitalButton::Context &context)
+	  : context(context)
 	{
-		return pair.second == key;
-	};
+	}
 
-public:
-	multimap<BtnEvent, Callback> _instantReleaseQueue;
-	unsigned int _turboApplies = 0;
-	unsigned int _turboReleases = 0;
-	DigitalButtonImpl(JSMButton &mapping, shared_ptr<DigitalButton::Context> context)
-	  : _id(mapping._id)
-	  , _context(context)
-	  , _press_times()
-	  , _keyToRelease()
-	  , _mapping(mapping)
-	  , _instantReleaseQueue()
-	{
-	}
-
-	const ButtonID _id; // Always ID first for easy debugging
-	string _nameToRelease;
-	shared_ptr<DigitalButton::Context> _context;
-	chrono::steady_clock::time_point _press_times;
-	optional<Mapping> _keyToRelease; // At key press, remember what to release
-	const JSMButton &_mapping;
-	DigitalButton *_masterPress = nullptr; // Who is this button's master in either sim or diag presses
+	DigitalButton::Context &context;
+
+	vector<ButtonID> id;
+	vector<const JSMButton *> mapping;
+	vector<BtnState> state;
+	vector<ActiveState> active;     // INVALID unless a mapping is active
+	vector<BtnState> nextState;     // Requested by the current reaction, INVALID for none
+	vector<ActiveState> nextActive; // Same for the nested state
+	vector<chrono::steady_clock::time_point> pressTime;
+	vector<optional<Mapping>> keyToRelease; // At key press, remember what to release
+	vector<PressName> nameToRelease;
+	vector<vector<pair<BtnEvent, EventActionIf::Callback>>> instantReleases; // In the order they were registered
+	vector<unsigned int> turboApplies;
+	vector<unsigned int> turboReleases;
+	vector<uint32_t> masterPress; // Who is this button's master in either sim or diag presses
+	vector<GetDeadline> lastInput;
+	vector<unsigned int> chordStackRevision; // Of the chord stack as of the last Pressed or Released event
+	vector<uint32_t> freeSlots;
+
+	uint32_t add(const JSMButton &buttonMapping);
+	void remove(uint32_t b);
+
+	static uint32_t slotOf(const DigitalButton &button)
+	{
+		return button._slot;
+	}
 
-	// Pretty wrapper
-	inline float GetPressDurationMS(chrono::steady_clock::time_point time_now)
+	// Send an event to the current state of b, then schedule the next time it needs one
+	template<typename E>
+	void sendEvent(uint32_t b, E &evt);
+	// Run the reaction of the current state of b to evt, then make the state changes it asked for
+	template<typename E>
+	void react(uint32_t b, E &evt);
+	void changeState(uint32_t b, BtnState next)
 	{
-		return static_cast<float>(chrono::duration_cast<chrono::milliseconds>(time_now - _press_times).count());
+		nextState[b] = next;
+	}
+	void changeActive(uint32_t b, ActiveState next)
+	{
+		nextActive[b] = next;
+	}
+	void applyStateChanges(uint32_t b);
+	void enter(uint32_t b);
+	void enterActive(uint32_t b);
+	void swapState(uint32_t b, uint32_t other);
+	// Ask the current state of b when it next needs an event, given the last input
+	void schedule(uint32_t b);
+
+	// State of the master of b, INVALID if it has none
+	BtnState masterState(uint32_t b) const
+	{
+		return masterPress[b] == NO_SLOT ? BtnState::INVALID : state[masterPress[b]];
 	}
 
-	bool HasActiveToggle(shared_ptr<DigitalButton::Context> _context, const KeyCode &key) const
+	// Pretty wrapper
+	float GetPressDurationMS(uint32_t b, chrono::steady_clock::time_point time_now) const
 	{
-		auto foundToggle = find_if(_context->activeTogglesQueue.cbegin(), _context->activeTogglesQueue.cend(),
-		  [key](auto &pair)
-		  {
-			  return pair.second == key;
-		  });
-		return foundToggle != _context->activeTogglesQueue.cend();
+		return static_cast<float>(chrono::duration_cast<chrono::milliseconds>(time_now - pressTime[b]).count());
 	}
 
-	void ClearKey()
+	// First time at which GetPressDurationMS is more than durationMs
+	chrono::steady_clock::time_point GetTimeAfterMS(uint32_t b, float durationMs) const
 	{
-		_keyToRelease = nullopt;
-		_instantReleaseQueue.clear();
-		_nameToRelease.clear();
-		_turboApplies = 0;
-		_turboReleases = 0;
+		return pressTime[b] + chrono::milliseconds(int64_t(floorf(durationMs)) + 1);
 	}
 
-	bool ReleaseInstant(BtnEvent instantEvent)
+	void ClearKey(uint32_t b)
 	{
-		auto range = _instantReleaseQueue.equal_range(instantEvent);
-		for (auto i = range.first; i != range.second; ++i)
-		{
-			// DEBUG_LOG << "Button " << _id << " releases instant " << instantEvent << '\n';
-			i->second(this);
-		}
-		_instantReleaseQueue.erase(range.first, range.second);
-		return true;
+		keyToRelease[b] = nullopt;
+		instantReleases[b].clear();
+		nameToRelease[b] = {};
+		turboApplies[b] = 0;
+		turboReleases[b] = 0;
 	}
 
-	optional<Mapping> GetPressMapping()
+	void ReleaseInstant(uint32_t b, BtnEvent instantEvent);
+	const optional<Mapping> &GetPressMapping(uint32_t b);
+	// Run the actions of the mapping to release on evt
+	void ProcessEvent(uint32_t b, BtnEvent evt);
+};
+
+namespace
+{
+// The mapping actions of one button, on the stack for as long as a mapping runs
+class ButtonActions : public EventActionIf
+{
+public:
+	ButtonActions(DigitalButtonTable &table, uint32_t b)
+	  : _table(table)
+	  , _context(table.context)
+	  , _b(b)
+	  , _id(table.id[b])
 	{
-		if (!_keyToRelease)
-		{
-			// Look at active chord mappings starting with the latest activates chord
-			for (auto activeChord = _context->chordStack.cbegin(); activeChord != _context->chordStack.cend(); activeChord++)
-			{
-				auto binding = _mapping.chordedValue(*activeChord);
-				if (binding && *activeChord != _id)
-				{
-					_keyToRelease = *binding;
-					_nameToRelease = _mapping.getName(*activeChord);
-					return _keyToRelease;
-				}
-			}
-			// Chord stack should always include NONE which will provide a value in the loop above
-			throw runtime_error("ChordStack should always include ButtonID::NONE, for the chorded variable to return the base value.");
-		}
-		return _keyToRelease;
 	}
 
-	void RegisterInstant(BtnEvent evt, Callback cb) override
+	void RegisterInstant(BtnEvent evt, const Callback &cb) override
 	{
 		if (cb)
 		{
 			// DEBUG_LOG << "Button " << _id << " registers instant " << evt << '\n';
-			_instantReleaseQueue.emplace(evt, cb);
+			_table.instantReleases[_b].emplace_back(evt, cb);
 		}
 	}
 
-	void ApplyGyroAction(KeyCode gyroAction) override
+	void ApplyGyroAction(const shared_ptr<const KeyCode> &gyroAction) override
 	{
-		_context->gyroActionQueue.push_back({ _id, gyroAction });
+		_context.gyroActionQueue.push(_id, gyroAction);
 	}
 
 	void RemoveGyroAction() override
 	{
-		auto gyroAction = find_if(_context->gyroActionQueue.begin(), _context->gyroActionQueue.end(),
-		  [this](auto pair)
-		  {
-			  // On a sim press, release the master button (the one who triggered the press)
-			  return pair.first == (_masterPress ? _masterPress->_id : _id);
-		  });
-		if (gyroAction != _context->gyroActionQueue.end())
+		// On a sim press, release the master button (the one who triggered the press)
+		auto master = _table.masterPress[_b];
+		auto releasedId = master != DigitalButtonTable::NO_SLOT ? _table.id[master] : _id;
+		if (auto key = _context.gyroActionQueue.find(releasedId)) // Held, as erasing the gyro action can release it
 		{
-			KeyCode key(gyroAction->second);
-			ClearAllActiveToggle(key);
-			for (auto currentlyActive = find_if(_context->gyroActionQueue.begin(), _context->gyroActionQueue.end(), bind(isSameKey, key, placeholders::_1));
-			     currentlyActive != _context->gyroActionQueue.end();
-			     currentlyActive = find_if(currentlyActive, _context->gyroActionQueue.end(), bind(isSameKey, key, placeholders::_1)))
-			{
-				// DEBUG_LOG << "Removing active gyro action for " << key.name << endl;
-				currentlyActive = _context->gyroActionQueue.erase(currentlyActive);
-			}
+			ClearAllActiveToggle(*key);
+			// DEBUG_LOG << "Removing active gyro action for " << key->name << endl;
+			_context.gyroActionQueue.erase(*key);
 		}
 	}
 
 	void SetRumble(int smallRumble, int bigRumble) override
 	{
 		DEBUG_LOG << "Rumbling at " << smallRumble << " and " << bigRumble << '\n';
-		_context->_rumble(smallRumble, bigRumble);
+		_context._rumble(smallRumble, bigRumble);
 	}
 
-	void ApplyBtnPress(KeyCode key) override
+	void ApplyBtnPress(const KeyCode &key) override
 	{
-		if (key.code >= X_UP && key.code <= X_START || key.code == PS_HOME || 
+		if (key.code >= X_UP && key.code <= X_START || key.code == PS_HOME ||
 			key.code == PS_PAD_CLICK || key.code == X_LT || key.code == X_RT)
 		{
-			if (_context->_vigemController)
-				_context->_vigemController->setButton(key, true);
+			if (_context._vigemController)
+				_context._vigemController->setButton(key, true);
 		}
 		else if (key.code == VK_NONAME)
 		{
-			if (_context->nn == 0)
-				++_context->nn;
+			if (_context.nn == 0)
+				++_context.nn;
 		}
-		else if (key.code != NO_HOLD_MAPPED && HasActiveToggle(_context, key) == false)
+		else if (key.code != NO_HOLD_MAPPED && HasActiveToggle(key) == false)
 		{
 			pressKey(key, true);
 		}
 		DEBUG_LOG << "Pressing down on key " << key.name << endl;
 	}
 
-	void ApplyBtnRelease(KeyCode key) override
+	void ApplyBtnRelease(const KeyCode &key) override
 	{
 		if (key.code >= X_UP && key.code <= X_START || key.code == PS_HOME ||
 			key.code == PS_PAD_CLICK || key.code == X_LT || key.code == X_RT)
 		{
-			if (_context->_vigemController)
+			if (_context._vigemController)
 			{
-				_context->_vigemController->setButton(key, false);
+				_context._vigemController->setButton(key, false);
 				ClearAllActiveToggle(key);
 			}
 		}
@@ -212,18 +256,13 @@ public:
 		DEBUG_LOG << "Releasing key " << key.name << endl;
 	}
 
-	void ApplyButtonToggle(KeyCode key, EventActionIf::Callback apply, EventActionIf::Callback release) override
+	void ApplyButtonToggle(const KeyCode &key, const EventActionIf::Callback &apply, const EventActionIf::Callback &release) override
 	{
-		auto currentlyActive = find_if(_context->activeTogglesQueue.begin(), _context->activeTogglesQueue.end(),
-		  [this, key](pair<ButtonID, KeyCode> pair)
-		  {
-			  return pair.first == _id && pair.second == key;
-		  });
-		if (currentlyActive == _context->activeTogglesQueue.end())
+		if (!_context.activeTogglesQueue.contains(_id, key))
 		{
 			DEBUG_LOG << "Adding active toggle for " << key.name << '\n';
 			apply(this);
-			_context->activeTogglesQueue.push_front({ _id, key });
+			_context.activeTogglesQueue.push(_id, apply.key);
 		}
 		else
 		{
@@ -231,823 +270,1157 @@ public:
 		}
 	}
 
-	void ClearAllActiveToggle(KeyCode key)
-	{
-		for (auto currentlyActive = find_if(_context->activeTogglesQueue.begin(), _context->activeTogglesQueue.end(), bind(isSameKey, key, placeholders::_1));
-		     currentlyActive != _context->activeTogglesQueue.end();
-		     currentlyActive = find_if(currentlyActive, _context->activeTogglesQueue.end(), bind(isSameKey, key, placeholders::_1)))
-		{
-			DEBUG_LOG << "Removing active toggle for " << key.name << '\n';
-			currentlyActive = _context->activeTogglesQueue.erase(currentlyActive);
-		}
-	}
-
 	void StartCalibration() override
 	{
 		COUT << "Starting continuous calibration\n";
-		_context->rightMainMotion->ResetContinuousCalibration();
-		_context->rightMainMotion->StartContinuousCalibration();
-		if (_context->leftMotion)
+		_context.rightMainMotion->ResetContinuousCalibration();
+		_context.rightMainMotion->StartContinuousCalibration();
+		if (_context.leftMotion)
 		{
 			// Perform calibration on both gyros of a joycon pair regardless of mask
-			_context->leftMotion->ResetContinuousCalibration();
-			_context->leftMotion->StartContinuousCalibration();
+			_context.leftMotion->ResetContinuousCalibration();
+			_context.leftMotion->StartContinuousCalibration();
 		}
 	}
 
 	void FinishCalibration() override
 	{
-		_context->rightMainMotion->PauseContinuousCalibration();
-		if (_context->leftMotion)
+		_context.rightMainMotion->PauseContinuousCalibration();
+		if (_context.leftMotion)
 		{
 			// Perform calibration on both gyros of a joycon pair regardless of mask
-			_context->leftMotion->PauseContinuousCalibration();
+			_context.leftMotion->PauseContinuousCalibration();
 		}
 		COUT << "Gyro calibration set\n";
-		ClearAllActiveToggle(KeyCode("CALIBRATE"));
+		static const KeyCode calibrate("CALIBRATE");
+		ClearAllActiveToggle(calibrate);
 	}
 
+	// Written out only when it is shown
 	const char *getDisplayName() override
 	{
-		return _nameToRelease.c_str();
+		auto &name = _table.nameToRelease[_b];
+		auto out = _displayName.begin();
+		auto append = [this, &out](string_view text)
+		{
+			out = copy_n(text.begin(), min(text.size(), size_t(_displayName.end() - 1 - out)), out);
+		};
+		if (name.first > ButtonID::NONE)
+		{
+			append(buttonName(name.first));
+			append({ &name.separator, 1 });
+		}
+		if (name.first != ButtonID::INVALID)
+		{
+			append(buttonName(name.second));
+		}
+		*out = '\0';
+		return _displayName.data();
+	}
+
+private:
+	// As operator<< writes it
+	static string_view buttonName(ButtonID id)
+	{
+		return id == ButtonID::PLUS ? "+" : id == ButtonID::MINUS ? "-" : magic_enum::enum_name(id);
+	}
+
+	bool HasActiveToggle(const KeyCode &key) const
+	{
+		return _context.activeTogglesQueue.contains(key);
+	}
+
+	void ClearAllActiveToggle(const KeyCode &key)
+	{
+		if (_context.activeTogglesQueue.erase(key) > 0)
+		{
+			DEBUG_LOG << "Removing active toggle for " << key.name << '\n';
+		}
 	}
+
+	DigitalButtonTable &_table;
+	DigitalButton::Context &_context;
+	const uint32_t _b;
+	const ButtonID _id;
+	array<char, 64> _displayName;
 };
+} // namespace
 
-// Forward declare concrete states
-class NoPress;
-class BtnPress;
-class TapPress;
-class WaitSim;
-class SimPressMaster;
-class SimPressSlave;
-class SimRelease;
-class DiagPressSlave;
-class DiagRelease;
-class DblPressStart;
-class DblPressNoPress;
-class DblPressNoPressTap;
-class DblPressNoPressHold;
-class DblPressPress;
-class InstRelease;
-
-// Forward declare concrete nested states
-class ActiveStartPress;
-class ActiveHoldPress;
-
-// Basic state react
-void DigitalButtonState::react(OnEntry &e)
+void DigitalButtonTable::ReleaseInstant(uint32_t b, BtnEvent instantEvent)
+{
+	auto isReleased = [instantEvent](const pair<BtnEvent, EventActionIf::Callback> &instant)
+	{
+		return instant.first == instantEvent;
+	};
+	ButtonActions actions(*this, b);
+	auto &instants = instantReleases[b];
+	for (auto &instant : instants)
+	{
+		if (isReleased(instant))
+		{
+			// DEBUG_LOG << "Button " << id[b] << " releases instant " << instantEvent << '\n';
+			instant.second(&actions);
+		}
+	}
+	instants.erase(remove_if(instants.begin(), instants.end(), isReleased), instants.end());
+}
+
+const optional<Mapping> &DigitalButtonTable::GetPressMapping(uint32_t b)
+{
+	if (!keyToRelease[b])
+	{
+		// Look at active chord mappings starting with the latest activates chord
+		for (auto activeChord = context.chordStack.cbegin(); activeChord != context.chordStack.cend(); activeChord++)
+		{
+			auto binding = mapping[b]->chordedValue(*activeChord);
+			if (binding && *activeChord != id[b])
+			{
+				keyToRelease[b] = *binding;
+				nameToRelease[b] = PressName::chord(*activeChord, id[b]);
+				return keyToRelease[b];
+			}
+		}
+		// Chord stack should always include NONE which will provide a value in the loop above
+		throw runtime_error("ChordStack should always include ButtonID::NONE, for the chorded variable to return the base value.");
+	}
+	return keyToRelease[b];
+}
+
+void DigitalButtonTable::ProcessEvent(uint32_t b, BtnEvent evt)
+{
+	if (keyToRelease[b])
+	{
+		ButtonActions actions(*this, b);
+		keyToRelease[b]->ProcessEvent(evt, actions);
+	}
+}
+
+namespace
+{
+typedef DigitalButtonTable Table;
+
+// Keep deadline if it is the earliest one still ahead of the last event
+void keepEarliest(GetDeadline &e, chrono::steady_clock::time_point deadline)
+{
+	if (deadline > e.in_now && deadline < e.out_deadline)
+	{
+		e.out_deadline = deadline;
+	}
+}
+
+// Reactions every state has unless it says otherwise
+
+void nothing(Table &t, uint32_t b)
 {
-	// Uncomment below to diplay a log each time a button changes state
-	// DEBUG_LOG << "Button " << pimpl()->_id << " is now in state " << _name << '\n';
 }
 
 // Basic Press reaction should be called in every concrete Press reaction
-void DigitalButtonState::react(Pressed &e)
+void basePressed(Table &t, uint32_t b, Pressed &e)
 {
-	pimpl()->_context->updateChordStack(true, pimpl()->_id);
+	t.context.updateChordStack(true, t.id[b]);
 }
 
 // Basic Release reaction should be called in every concrete Release reaction
-void DigitalButtonState::react(Released &e)
+void baseReleased(Table &t, uint32_t b, Released &e)
 {
-	pimpl()->_context->updateChordStack(false, pimpl()->_id);
+	t.context.updateChordStack(false, t.id[b]);
 }
 
-void DigitalButtonState::react(chrono::steady_clock::time_point &e)
+void ignoreSync(Table &t, uint32_t b, Sync &e)
 {
-	// final implementation. All states can be assigned a new press time
-	pimpl()->_press_times = e;
 }
 
-void DigitalButtonState::react(GetDuration &e)
+// States that don't know when they need the next event see every poll
+void everyPoll(Table &t, uint32_t b, GetDeadline &e)
 {
-	// final implementation. All states can be querried it's duration time.
-	e.out_duration = pimpl()->GetPressDurationMS(e.in_now);
+	e.out_deadline = e.in_now;
 }
 
+// Nested states in which a mapping is active
 
-// Append to pocket_fsm macro
-#define DB_CONCRETE_STATE(statename)           \
-	CONCRETE_STATE(statename)                  \
-	virtual BtnState getState() const override \
-	{                                          \
-		return BtnState::statename;            \
-	}
+void activeReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	t.ProcessEvent(b, BtnEvent::OnRelease);
+}
 
-// Base state for all nested states in which a mapping is active
-class ActiveMappingState : public DigitalButtonState
+void startPressEntry(Table &t, uint32_t b)
 {
-public:
-	virtual BtnState getState() const override
+	t.GetPressMapping(b);
+	t.ProcessEvent(b, BtnEvent::OnPress);
+}
+
+void startPressPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+
+	auto elapsed_time = t.GetPressDurationMS(b, e.time_now);
+	if (elapsed_time > MAGIC_INSTANT_DURATION)
 	{
-		return BtnState::INVALID;
+		t.ReleaseInstant(b, BtnEvent::OnPress);
 	}
-
-	REACT(Released)
-	override
+	if (elapsed_time > e.holdTime)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnRelease, *pimpl());
+		t.changeActive(b, ActiveState::HoldPress);
 	}
+}
 
-	REACT(Sync)
-	final
-	{
-		Released rel{ e.pressTime, e.turboTime, e.holdTime };
-		react(rel);
-		// Redirect change of state to the caller of the Sync
-		if (e.nextState == nullptr)
-		{
-			// Release from SimPress
+void startPressReleased(Table &t, uint32_t b, Released &e)
+{
+	activeReleased(t, b, e);
+	t.pressTime[b] = e.time_now; // Start counting tap duration
+	t.changeState(b, BtnState::TapPress);
+}
 
-			e.nextState = _nextState;
-			_nextState = nullptr;
-			changeState<SimRelease>();
-		}
-		else
-		{
-			if (e.activeMapping != nullptr)
-			{
-				// Activate Diagonal
-				// DEBUG_LOG << "Button " << pimpl()->_id << " enables active diagonal as master\n";
-				pimpl()->_masterPress = nullptr;
-				pimpl()->_keyToRelease = *e.activeMapping;
-				pimpl()->_nameToRelease = e.nameToRelease;
-			}
-			else // release diagonal
-			{
-				// DEBUG_LOG << "Button " << pimpl()->_id << " releases active diagonal\n";
-				pimpl()->ClearKey();
-			}
-			pimpl()->_press_times = e.pressTime;
-			delete _nextState;
-			_nextState = e.nextState;
-		}
+void startPressDeadline(Table &t, uint32_t b, GetDeadline &e)
+{
+	if (!e.in_pressed)
+	{
+		// The release is still to be processed
+		e.out_deadline = e.in_now;
+		return;
 	}
-};
-
-// Nested concrete states
+	e.out_deadline = chrono::steady_clock::time_point::max();
+	keepEarliest(e, t.GetTimeAfterMS(b, MAGIC_INSTANT_DURATION));
+	keepEarliest(e, t.GetTimeAfterMS(b, e.in_holdTime));
+}
 
-class ActiveStartPress : public ActiveMappingState
+void holdPressEntry(Table &t, uint32_t b)
 {
-	CONCRETE_STATE(ActiveStartPress)
-	INITIAL_STATE(ActiveStartPress)
+	t.ProcessEvent(b, BtnEvent::OnHold);
+	t.ProcessEvent(b, BtnEvent::OnTurbo);
+	t.turboApplies[b]++;
+}
 
-	REACT(OnEntry)
-	override
+void holdPressPressed(Table &t, uint32_t b, Pressed &e)
+{
+	auto elapsed_time = t.GetPressDurationMS(b, e.time_now);
+	if (elapsed_time > e.holdTime + MAGIC_INSTANT_DURATION)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->GetPressMapping()->ProcessEvent(BtnEvent::OnPress, *pimpl());
+		t.ReleaseInstant(b, BtnEvent::OnHold);
 	}
-
-	REACT(Pressed)
-	override
+	if (floorf((elapsed_time - e.holdTime) / e.turboTime) >= t.turboApplies[b])
+	{
+		t.ProcessEvent(b, BtnEvent::OnTurbo);
+		t.turboApplies[b]++;
+	}
+	if (elapsed_time > e.holdTime + t.turboReleases[b] * e.turboTime + MAGIC_INSTANT_DURATION)
 	{
-		DigitalButtonState::react(e);
+		t.ReleaseInstant(b, BtnEvent::OnTurbo);
+		t.turboReleases[b]++;
+	}
+}
 
-		auto elapsed_time = pimpl()->GetPressDurationMS(e.time_now);
-		if (elapsed_time > MAGIC_INSTANT_DURATION)
-		{
-			pimpl()->ReleaseInstant(BtnEvent::OnPress);
-		}
-		if (elapsed_time > e.holdTime)
-		{
-			changeState<ActiveHoldPress>();
-		}
+void holdPressReleased(Table &t, uint32_t b, Released &e)
+{
+	activeReleased(t, b, e);
+	t.ProcessEvent(b, BtnEvent::OnHoldRelease);
+	if (t.instantReleases[b].empty())
+	{
+		t.changeState(b, BtnState::NoPress);
+		t.ClearKey(b);
+	}
+	else
+	{
+		t.changeState(b, BtnState::InstRelease);
+		t.pressTime[b] = e.time_now; // Start counting tap duration
 	}
+}
 
-	REACT(Released)
-	override
+void holdPressDeadline(Table &t, uint32_t b, GetDeadline &e)
+{
+	auto nextTurbo = t.pressTime[b] + chrono::milliseconds(int64_t(ceilf(e.in_holdTime + t.turboApplies[b] * e.in_turboTime)));
+	if (!e.in_pressed || e.in_turboTime <= 0.f || nextTurbo <= e.in_now)
 	{
-		ActiveMappingState::react(e);
-		pimpl()->_press_times = e.time_now; // Start counting tap duration
-		changeState<TapPress>();
+		// Still to release, or a turbo that rounding held back until the next poll
+		e.out_deadline = e.in_now;
+		return;
 	}
+	e.out_deadline = nextTurbo;
+	keepEarliest(e, t.GetTimeAfterMS(b, e.in_holdTime + MAGIC_INSTANT_DURATION));
+	keepEarliest(e, t.GetTimeAfterMS(b, e.in_holdTime + t.turboReleases[b] * e.in_turboTime + MAGIC_INSTANT_DURATION));
+}
 
+struct ActiveReactions
+{
+	ActiveState state;
+	void (*onEntry)(Table &, uint32_t);
+	void (*pressed)(Table &, uint32_t, Pressed &);
+	void (*released)(Table &, uint32_t, Released &);
+	void (*deadline)(Table &, uint32_t, GetDeadline &);
 };
 
-class ActiveHoldPress : public ActiveMappingState
+constexpr array<ActiveReactions, 2> ACTIVE_REACTIONS{ {
+  { ActiveState::StartPress, startPressEntry, startPressPressed, startPressReleased, startPressDeadline },
+  { ActiveState::HoldPress, holdPressEntry, holdPressPressed, holdPressReleased, holdPressDeadline },
+} };
+
+// The states with an active mapping hand their events to the nested state
+
+void activePressed(Table &t, uint32_t b, Pressed &e)
+{
+	ACTIVE_REACTIONS[size_t(t.active[b])].pressed(t, b, e);
+}
+
+void activeReleasedNested(Table &t, uint32_t b, Released &e)
 {
-	CONCRETE_STATE(ActiveHoldPress)
+	ACTIVE_REACTIONS[size_t(t.active[b])].released(t, b, e);
+}
+
+void activeDeadline(Table &t, uint32_t b, GetDeadline &e)
+{
+	ACTIVE_REACTIONS[size_t(t.active[b])].deadline(t, b, e);
+}
 
-	REACT(OnEntry)
-	override
+void activeSync(Table &t, uint32_t b, Sync &e)
+{
+	Released rel{ e.pressTime, e.turboTime, e.holdTime };
+	activeReleasedNested(t, b, rel);
+	// Redirect change of state to the caller of the Sync
+	if (e.nextState == BtnState::INVALID)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnHold, *pimpl());
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnTurbo, *pimpl());
-		pimpl()->_turboApplies++;
+		// Release from SimPress
+		e.nextState = t.nextState[b];
+		t.changeState(b, BtnState::SimRelease);
 	}
-
-	REACT(Pressed)
-	override
+	else
 	{
-		auto elapsed_time = pimpl()->GetPressDurationMS(e.time_now);
-		if (elapsed_time > e.holdTime + MAGIC_INSTANT_DURATION)
-		{
-			pimpl()->ReleaseInstant(BtnEvent::OnHold);
-		}
-		if (floorf((elapsed_time - e.holdTime) / e.turboTime) >= pimpl()->_turboApplies)
+		if (e.activeMapping != nullptr)
 		{
-			pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnTurbo, *pimpl());
-			pimpl()->_turboApplies++;
+			// Activate Diagonal
+			// DEBUG_LOG << "Button " << t.id[b] << " enables active diagonal as master\n";
+			t.masterPress[b] = Table::NO_SLOT;
+			t.keyToRelease[b] = *e.activeMapping;
+			t.nameToRelease[b] = e.nameToRelease;
 		}
-		if (elapsed_time > e.holdTime + pimpl()->_turboReleases * e.turboTime + MAGIC_INSTANT_DURATION)
+		else // release diagonal
 		{
-			pimpl()->ReleaseInstant(BtnEvent::OnTurbo);
-			pimpl()->_turboReleases++;
+			// DEBUG_LOG << "Button " << t.id[b] << " releases active diagonal\n";
+			t.ClearKey(b);
 		}
+		t.pressTime[b] = e.pressTime;
+		t.changeState(b, e.nextState);
 	}
+}
+
+// Core states
 
-	REACT(Released)
-	override
+// Make b the slave of every button it forms a diagonal with. Returns whether there was any.
+bool pressDiagonals(Table &t, uint32_t b, Pressed &e)
+{
+	size_t counter = 0;
+	optional<MapIterator> diag = nullopt;
+	for (auto btn = t.context._getMatchingDiagBtn(t.id[b], diag); btn;
+	     btn = t.context._getMatchingDiagBtn(t.id[b], diag))
 	{
-		ActiveMappingState::react(e);
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnHoldRelease, *pimpl());
-		if (pimpl()->_instantReleaseQueue.empty())
-		{
-			changeState<NoPress>();
-			pimpl()->ClearKey();
-		}
-		else
-		{
-			changeState<InstRelease>();
-			pimpl()->_press_times = e.time_now; // Start counting tap duration
-		}
+		// DEBUG_LOG << "Button " << t.id[b] << " enables diagonal press with " << btn->_id << " who is in state " << btn->getState() << '\n';
+		t.masterPress[b] = Table::slotOf(*btn);
+		t.nameToRelease[b] = PressName::diag((*diag)->first, t.id[b]);
+		t.keyToRelease[b] = (*diag)->second.value();
+		Sync sync;
+		sync.nameToRelease = t.nameToRelease[b];
+		sync.activeMapping = &*t.keyToRelease[b];
+		sync.pressTime = e.time_now;
+		sync.holdTime = e.holdTime;
+		sync.turboTime = e.turboTime;
+		sync.dblPressWindow = e.dblPressWindow;
+		sync.nextState = BtnState::DiagPressMaster;
+		t.sendEvent(Table::slotOf(*btn), sync);
+		++*diag;
+		counter++;
 	}
-};
+	return counter > 0;
+}
 
-class DiagPressMaster : public pocket_fsm::NestedStateMachine<ActiveMappingState, DigitalButtonState>
+// Nothing happens until the button is pressed
+void noPressDeadline(Table &t, uint32_t b, GetDeadline &e)
 {
-	DB_CONCRETE_STATE(DiagPressMaster)
+	e.out_deadline = e.in_pressed ? e.in_now : chrono::steady_clock::time_point::max();
+}
 
-	REACT(OnEntry)
-	override
+void noPressPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+	t.pressTime[b] = e.time_now;
+	if (t.mapping[b]->hasSimMappings() && t.GetPressDurationMS(b, e.time_now) < SettingsManager::getV<float>(SettingID::SIM_PRESS_WINDOW)->value())
 	{
-		DigitalButtonState::react(e);
-		initialize(new ActiveStartPress(_pimpl));
+		t.changeState(b, BtnState::WaitSim);
 	}
+	else if (t.mapping[b]->getDblPressMap())
+	{
+		// Start counting time between two start presses
+		t.changeState(b, BtnState::DblPressStart);
+	}
+	else if (t.mapping[b]->hasDiagMappings())
+	{
+		t.changeState(b, pressDiagonals(t, b, e) ? BtnState::DiagPressSlave : BtnState::BtnPress);
+	}
+	else
+	{
+		t.changeState(b, BtnState::BtnPress);
+	}
+}
 
-	NESTED_REACT(Pressed)
+void tapPressEntry(Table &t, uint32_t b)
+{
+	t.ProcessEvent(b, BtnEvent::OnTap);
+}
 
-	NESTED_REACT(Released)
+void tapPressExit(Table &t, uint32_t b)
+{
+	t.ProcessEvent(b, BtnEvent::OnTapRelease);
+	t.ClearKey(b);
+}
 
-	NESTED_REACT(Sync)
+void tapPressPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+	t.ReleaseInstant(b, BtnEvent::OnRelease);
+	t.ReleaseInstant(b, BtnEvent::OnTap);
+	t.changeState(b, BtnState::BtnPress);
+}
 
-	void swapPimpl(DigitalButtonState &otherState) override
+void tapPressReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > MAGIC_INSTANT_DURATION)
 	{
-		_currentState->resetPimpl(otherState);
-		DigitalButtonState::swapPimpl(otherState);
+		t.ReleaseInstant(b, BtnEvent::OnRelease);
+		t.ReleaseInstant(b, BtnEvent::OnTap);
 	}
-};
+	if (!t.keyToRelease[b] || t.GetPressDurationMS(b, e.time_now) > t.keyToRelease[b]->getTapDuration())
+	{
+		t.changeState(b, BtnState::NoPress);
+	}
+}
 
-// Core concrete states
+void tapPressDeadline(Table &t, uint32_t b, GetDeadline &e)
+{
+	if (e.in_pressed || !t.keyToRelease[b])
+	{
+		e.out_deadline = e.in_now;
+		return;
+	}
+	e.out_deadline = chrono::steady_clock::time_point::max();
+	keepEarliest(e, t.GetTimeAfterMS(b, MAGIC_INSTANT_DURATION));
+	keepEarliest(e, t.GetTimeAfterMS(b, t.keyToRelease[b]->getTapDuration()));
+}
 
-class NoPress : public DigitalButtonState
+void simPressSlavePressed(Table &t, uint32_t b, Pressed &e)
 {
-	DB_CONCRETE_STATE(NoPress)
-	INITIAL_STATE(NoPress)
+	basePressed(t, b, e);
+	if (t.masterState(b) != BtnState::SimPressMaster)
+	{
+		// The master button has released! change state now!
+		t.changeState(b, BtnState::SimRelease);
+		t.masterPress[b] = Table::NO_SLOT;
+	}
+	// else do nothing
+}
 
-	REACT(Pressed)
-	override
+void simPressSlaveReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.masterState(b) != BtnState::SimPressMaster)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->_press_times = e.time_now;
-		if (pimpl()->_mapping.hasSimMappings() && pimpl()->GetPressDurationMS(e.time_now) < SettingsManager::getV<float>(SettingID::SIM_PRESS_WINDOW)->value())
-		{
-			changeState<WaitSim>();
-		}
-		else if (pimpl()->_mapping.getDblPressMap())
+		// The master button has released! change state now!
+		t.changeState(b, BtnState::SimRelease);
+		t.masterPress[b] = Table::NO_SLOT;
+	}
+	else
+	{
+		// Process at the master's end
+		Sync sync;
+		sync.pressTime = e.time_now;
+		sync.holdTime = e.holdTime;
+		sync.turboTime = e.turboTime;
+		sync.dblPressWindow = e.dblPressWindow;
+		t.sendEvent(t.masterPress[b], sync);
+		t.changeState(b, sync.nextState);
+	}
+}
+
+void waitSimPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+	// Is there a sim mapping on this button where the other button is in WaitSim state too?
+	auto simBtn = t.context._getMatchingSimBtn(t.id[b]);
+	if (simBtn)
+	{
+		t.changeState(b, BtnState::SimPressSlave);
+		t.pressTime[b] = e.time_now;                                         // reset Timer
+		t.keyToRelease[b] = t.mapping[b]->atSimPress(simBtn->_id)->value(); // Make a copy
+		t.nameToRelease[b] = PressName::sim(simBtn->_id, t.id[b]);
+		t.masterPress[b] = Table::slotOf(*simBtn); // Second to press is the slave
+
+		Sync sync;
+		sync.nextState = BtnState::SimPressMaster;
+		sync.pressTime = e.time_now;
+		sync.activeMapping = &*t.keyToRelease[b];
+		sync.nameToRelease = t.nameToRelease[b];
+		sync.dblPressWindow = e.dblPressWindow;
+		t.sendEvent(Table::slotOf(*simBtn), sync);
+	}
+	else if (t.GetPressDurationMS(b, e.time_now) > SettingsManager::getV<float>(SettingID::SIM_PRESS_WINDOW)->value())
+	{
+		// Button is still pressed but Sim delay did expire
+		if (t.mapping[b]->getDblPressMap())
 		{
 			// Start counting time between two start presses
-			changeState<DblPressStart>();
+			t.changeState(b, BtnState::DblPressStart);
 		}
-		else if (pimpl()->_mapping.hasDiagMappings())
+		else if (t.mapping[b]->hasDiagMappings())
 		{
-			size_t counter = 0;
-			optional<MapIterator> diag = nullopt;
-			for (auto btn = pimpl()->_context->_getMatchingDiagBtn(pimpl()->_id, diag); btn;
-				 btn = pimpl()->_context->_getMatchingDiagBtn(pimpl()->_id, diag))
-			{
-				// DEBUG_LOG << "Button " << pimpl()->_id << " enables diagonal press with " << btn->_id << " who is in state " << btn->getCurrentStateName() << '\n';
-				pimpl()->_masterPress = btn;
-				pimpl()->_nameToRelease = pimpl()->_mapping.getDiagPressName((*diag)->first);
-				pimpl()->_keyToRelease = (*diag)->second.value();
-				Sync sync;
-				sync.nameToRelease = pimpl()->_nameToRelease;
-				sync.activeMapping = &*pimpl()->_keyToRelease;
-				sync.pressTime = e.time_now;
-				sync.holdTime = e.holdTime;
-				sync.turboTime = e.turboTime;
-				sync.dblPressWindow = e.dblPressWindow;
-				sync.nextState = new DiagPressMaster();
-				pimpl()->_masterPress->sendEvent(sync);
-				++*diag;
-				counter++;
-			}
-
-			if (counter > 0 )
-				changeState<DiagPressSlave>();
-			else
-				changeState<BtnPress>();
+			t.changeState(b, pressDiagonals(t, b, e) ? BtnState::DiagPressSlave : BtnState::BtnPress);
 		}
-		else
+		else // Handle regular press mapping
 		{
-			changeState<BtnPress>();
+			t.changeState(b, BtnState::BtnPress);
 		}
 	}
-};
+	// Else let time flow, stay in this state, no output.
+}
 
-class BtnPress : public pocket_fsm::NestedStateMachine<ActiveMappingState, DigitalButtonState>
+void waitSimReleased(Table &t, uint32_t b, Released &e)
 {
-	DB_CONCRETE_STATE(BtnPress)
-
-	REACT(OnEntry)
-	override
+	baseReleased(t, b, e);
+	// Button was released before sim delay expired
+	if (t.mapping[b]->getDblPressMap())
 	{
-		DigitalButtonState::react(e);
-		initialize(new ActiveStartPress(_pimpl));
+		// Start counting time between two start presses
+		t.changeState(b, BtnState::DblPressStart);
 	}
+	else
+	{
+		t.changeState(b, BtnState::BtnPress);
+	}
+}
 
-	NESTED_REACT(Pressed);
-	NESTED_REACT(Released);
-	NESTED_REACT(Sync);
-};
+void waitSimSync(Table &t, uint32_t b, Sync &e)
+{
+	t.masterPress[b] = Table::NO_SLOT;
+	t.pressTime[b] = e.pressTime;
+	t.keyToRelease[b] = *e.activeMapping;
+	t.nameToRelease[b] = e.nameToRelease;
+	t.changeState(b, e.nextState);
+}
 
-class TapPress : public DigitalButtonState
+void simReleaseReleased(Table &t, uint32_t b, Released &e)
 {
-	DB_CONCRETE_STATE(TapPress)
+	baseReleased(t, b, e);
+	t.changeState(b, BtnState::NoPress);
+	t.ClearKey(b);
+}
 
-	REACT(OnEntry)
-	override
+void simReleaseSync(Table &t, uint32_t b, Sync &e)
+{
+	if (e.nextState != BtnState::INVALID && e.activeMapping != nullptr)
 	{
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnTap, *pimpl());
+		Released rel{ e.pressTime, e.turboTime, e.holdTime };
+		simReleaseReleased(t, b, rel);
+		// Redirect change of state to the caller of the Sync
+
+		// Activate Diagonal
+		// DEBUG_LOG << "Button " << t.id[b] << " enables active diagonal as master\n";
+		t.masterPress[b] = Table::NO_SLOT;
+		t.keyToRelease[b] = *e.activeMapping;
+		t.nameToRelease[b] = e.nameToRelease;
+		t.pressTime[b] = e.pressTime;
+		t.changeState(b, e.nextState);
 	}
+}
+
+void diagPressSlavePressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
 
-	REACT(Pressed)
-	override
+	if (t.masterState(b) != BtnState::DiagPressMaster)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->ReleaseInstant(BtnEvent::OnRelease);
-		pimpl()->ReleaseInstant(BtnEvent::OnTap);
-		changeState<BtnPress>();
+		// Master has released me!
+		t.masterPress[b] = Table::NO_SLOT;
+		t.ClearKey(b);
+		t.changeState(b, BtnState::NoPress);
 	}
+}
 
-	REACT(Released)
-	override
+void diagPressSlaveReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.masterState(b) == BtnState::DiagPressMaster)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > MAGIC_INSTANT_DURATION)
+		// Inform Diagonal Master of the release
+		// Here we're swapping the current state of the master and slave buttons. This enables the released button
+		// to process taps and instants whereas the other button can process its own binding activation.
+		optional<MapIterator> it;
+		auto me = t.context._getMatchingDiagBtn(t.id[t.masterPress[b]], it);
+		if (me)
 		{
-			pimpl()->ReleaseInstant(BtnEvent::OnRelease);
-			pimpl()->ReleaseInstant(BtnEvent::OnTap);
+			// DEBUG_LOG << t.id[b] << " is performing the swap!\n";
+			t.swapState(t.masterPress[b], Table::slotOf(*me));
 		}
-		if (!pimpl()->_keyToRelease || pimpl()->GetPressDurationMS(e.time_now) > pimpl()->_keyToRelease->getTapDuration())
+		else
 		{
-			changeState<NoPress>();
+			CERR << "I can't find myself as the other diagonal?!?";
 		}
 	}
-
-	REACT(OnExit)
-	override
+	else
 	{
-		pimpl()->_keyToRelease->ProcessEvent(BtnEvent::OnTapRelease, *pimpl());
-		pimpl()->ClearKey();
+		t.masterPress[b] = Table::NO_SLOT;
+		t.ClearKey(b);
+		t.changeState(b, BtnState::NoPress);
 	}
-};
+}
 
-class SimPressMaster : public pocket_fsm::NestedStateMachine<ActiveMappingState, DigitalButtonState>
+void dblPressStartReleased(Table &t, uint32_t b, Released &e)
 {
-	DB_CONCRETE_STATE(SimPressMaster)
-
-	REACT(OnEntry)
-	override
+	activeReleasedNested(t, b, e);
+	if (t.nextState[b] == BtnState::NoPress)
 	{
-		DigitalButtonState::react(e);
-		initialize(new ActiveStartPress(_pimpl));
+		t.changeState(b, BtnState::DblPressNoPress);
 	}
+	else if (t.nextState[b] == BtnState::TapPress)
+	{
+		t.changeState(b, BtnState::DblPressNoPressTap);
+	}
+}
 
-	NESTED_REACT(Pressed)
+void dblPressNoPressPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
+	{
+		t.pressTime[b] = e.time_now; // reset Timer to raise a tap
+		t.changeState(b, BtnState::BtnPress);
+	}
+	else
+	{
+		t.pressTime[b] = e.time_now;
+		t.changeState(b, BtnState::DblPressPress);
+	}
+}
 
-	NESTED_REACT(Released)
+void dblPressNoPressReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > MAGIC_INSTANT_DURATION)
+	{
+		t.ReleaseInstant(b, BtnEvent::OnRelease);
+	}
 
-	NESTED_REACT(Sync)
-};
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
+	{
+		t.changeState(b, BtnState::NoPress);
+	}
+}
 
-class SimPressSlave : public DigitalButtonState
+void dblPressNoPressDeadline(Table &t, uint32_t b, GetDeadline &e)
 {
-	DB_CONCRETE_STATE(SimPressSlave)
+	if (e.in_pressed)
+	{
+		e.out_deadline = e.in_now;
+		return;
+	}
+	e.out_deadline = chrono::steady_clock::time_point::max();
+	keepEarliest(e, t.GetTimeAfterMS(b, MAGIC_INSTANT_DURATION));
+	keepEarliest(e, t.GetTimeAfterMS(b, e.in_dblPressWindow));
+}
 
-	REACT(Pressed)
-	override
+void dblPressNoPressTapPressed(Table &t, uint32_t b, Pressed &e)
+{
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->_masterPress->getState() != BtnState::SimPressMaster)
-		{
-			// The master button has released! change state now!
-			changeState<SimRelease>();
-			pimpl()->_masterPress = nullptr;
-		}
-		// else do nothing
+		t.pressTime[b] = e.time_now; // reset Timer to raise a tap
+		t.changeState(b, BtnState::TapPress);
+	}
+	else
+	{
+		t.keyToRelease[b] = t.mapping[b]->getDblPressMap()->second;
+		t.nameToRelease[b] = PressName::chord(t.id[b], t.id[b]);
+		t.pressTime[b] = e.time_now;
+		t.changeState(b, BtnState::DblPressPress);
 	}
+}
 
-	REACT(Released)
-	override
+void dblPressNoPressTapReleased(Table &t, uint32_t b, Released &e)
+{
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->_masterPress->getState() != BtnState::SimPressMaster)
-		{
-			// The master button has released! change state now!
-			changeState<SimRelease>();
-			pimpl()->_masterPress = nullptr;
-		}
-		else
-		{
-			// Process at the master's end
-			Sync sync;
-			sync.pressTime = e.time_now;
-			sync.holdTime = e.holdTime;
-			sync.turboTime = e.turboTime;
-			sync.dblPressWindow = e.dblPressWindow;
-			_nextState = pimpl()->_masterPress->sendEvent(sync).nextState;
-		}
+		t.pressTime[b] = e.time_now; // reset Timer to raise a tap
+		t.changeState(b, BtnState::TapPress);
 	}
-};
+}
 
-class WaitSim : public DigitalButtonState
+// Until the double press window closes
+void dblPressWindowDeadline(Table &t, uint32_t b, GetDeadline &e)
 {
-	DB_CONCRETE_STATE(WaitSim)
+	e.out_deadline = e.in_pressed ? e.in_now : t.GetTimeAfterMS(b, e.in_dblPressWindow);
+}
 
-	REACT(Pressed)
-	override
+void dblPressNoPressHoldPressed(Table &t, uint32_t b, Pressed &e)
+{
+	basePressed(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
 	{
-		DigitalButtonState::react(e);
-		// Is there a sim mapping on this button where the other button is in WaitSim state too?
-		auto simBtn = pimpl()->_context->_getMatchingSimBtn(pimpl()->_id);
-		if (simBtn)
-		{
-			changeState<SimPressSlave>();
-			pimpl()->_press_times = e.time_now;                                          // reset Timer
-			pimpl()->_keyToRelease = pimpl()->_mapping.atSimPress(simBtn->_id)->value(); // Make a copy
-			pimpl()->_nameToRelease = pimpl()->_mapping.getSimPressName(simBtn->_id);
-			pimpl()->_masterPress = simBtn; // Second to press is the slave
-
-			Sync sync;
-			sync.nextState = new SimPressMaster();
-			sync.pressTime = e.time_now;
-			sync.activeMapping = &*pimpl()->_keyToRelease;
-			sync.nameToRelease = pimpl()->_nameToRelease;
-			sync.dblPressWindow = e.dblPressWindow;
-			simBtn->sendEvent(sync);
-		}
-		else if (pimpl()->GetPressDurationMS(e.time_now) > SettingsManager::getV<float>(SettingID::SIM_PRESS_WINDOW)->value())
-		{
-			// Button is still pressed but Sim delay did expire
-			if (pimpl()->_mapping.getDblPressMap())
-			{
-				// Start counting time between two start presses
-				changeState<DblPressStart>();
-			}
-			else if (pimpl()->_mapping.hasDiagMappings())
-			{
-				size_t counter = 0;
-				optional<MapIterator> diag = nullopt;
-				for (auto btn = pimpl()->_context->_getMatchingDiagBtn(pimpl()->_id, diag); btn;
-				     btn = pimpl()->_context->_getMatchingDiagBtn(pimpl()->_id, diag))
-				{
-					// DEBUG_LOG << "Button " << pimpl()->_id << " enables diagonal press with " << btn->_id << " who is in state " << btn->getCurrentStateName() << '\n';
-					pimpl()->_masterPress = btn;
-					pimpl()->_nameToRelease = pimpl()->_mapping.getDiagPressName((*diag)->first);
-					pimpl()->_keyToRelease = (*diag)->second.value();
-					Sync sync;
-					sync.nameToRelease = pimpl()->_nameToRelease;
-					sync.activeMapping = &*pimpl()->_keyToRelease;
-					sync.pressTime = e.time_now;
-					sync.holdTime = e.holdTime;
-					sync.turboTime = e.turboTime;
-					sync.dblPressWindow = e.dblPressWindow;
-					sync.nextState = new DiagPressMaster();
-					pimpl()->_masterPress->sendEvent(sync);
-					++*diag;
-					counter++;
-				}
-
-				if (counter > 0)
-					changeState<DiagPressSlave>();
-				else
-					changeState<BtnPress>();
-			}
-			else // Handle regular press mapping
-			{
-				changeState<BtnPress>();
-				// _press_times = _timeNow;
-			}
-		}
-		// Else let time flow, stay in this state, no output.
+		t.changeState(b, BtnState::BtnPress);
+		// Don't reset timer to preserve hold press behaviour
+		t.GetPressMapping(b);
+		t.ProcessEvent(b, BtnEvent::OnPress);
 	}
-
-	REACT(Released)
-	override
+	else
 	{
-		DigitalButtonState::react(e);
-		// Button was released before sim delay expired
-		if (pimpl()->_mapping.getDblPressMap())
-		{
-			// Start counting time between two start presses
-			changeState<DblPressStart>();
-		}
-		else
-		{
-			changeState<BtnPress>();
-		}
+		t.changeState(b, BtnState::DblPressPress);
+		t.pressTime[b] = e.time_now;
+		t.keyToRelease[b] = t.mapping[b]->getDblPressMap()->second;
+		t.nameToRelease[b] = PressName::chord(t.id[b], t.id[b]);
 	}
+}
 
-	REACT(Sync)
-	override
+void dblPressNoPressHoldReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > e.dblPressWindow)
 	{
-		pimpl()->_masterPress = nullptr;
-		pimpl()->_press_times = e.pressTime;
-		pimpl()->_keyToRelease = *e.activeMapping;
-		pimpl()->_nameToRelease = e.nameToRelease;
-		_nextState = e.nextState; // changeState <typeof(e.nextState)> () 
+		t.changeState(b, BtnState::BtnPress);
+		// Don't reset timer to preserve hold press behaviour
 	}
-};
+}
+
+void dblPressPressEntry(Table &t, uint32_t b)
+{
+	t.keyToRelease[b] = t.mapping[b]->getDblPressMap()->second;
+	t.nameToRelease[b] = PressName::chord(t.id[b], t.id[b]);
+}
 
-class SimRelease : public DigitalButtonState
+void instReleasePressed(Table &t, uint32_t b, Pressed &e)
 {
-	DB_CONCRETE_STATE(SimRelease)
+	basePressed(t, b, e);
+	t.ReleaseInstant(b, BtnEvent::OnRelease);
+	t.ClearKey(b);
+	t.changeState(b, BtnState::NoPress);
+}
 
-	REACT(Released)
-	override
+void instReleaseReleased(Table &t, uint32_t b, Released &e)
+{
+	baseReleased(t, b, e);
+	if (t.GetPressDurationMS(b, e.time_now) > MAGIC_INSTANT_DURATION)
 	{
-		DigitalButtonState::react(e);
-		changeState<NoPress>();
-		pimpl()->ClearKey();
+		t.ReleaseInstant(b, BtnEvent::OnRelease);
+		t.ClearKey(b);
+		t.changeState(b, BtnState::NoPress);
 	}
+}
 
-	REACT(Sync)
-	final
-	{
-		if (e.nextState != nullptr && e.activeMapping != nullptr)
-		{
-			Released rel{ e.pressTime, e.turboTime, e.holdTime };
-			react(rel);
-			// Redirect change of state to the caller of the Sync
+void instReleaseDeadline(Table &t, uint32_t b, GetDeadline &e)
+{
+	e.out_deadline = e.in_pressed ? e.in_now : t.GetTimeAfterMS(b, MAGIC_INSTANT_DURATION);
+}
 
-			// Activate Diagonal
-			// DEBUG_LOG << "Button " << pimpl()->_id << " enables active diagonal as master\n";
-			pimpl()->_masterPress = nullptr;
-			pimpl()->_keyToRelease = *e.activeMapping;
-			pimpl()->_nameToRelease = e.nameToRelease;
-			pimpl()->_press_times = e.pressTime;
-			delete _nextState;
-			_nextState = e.nextState;
-		}
+constexpr uint32_t states(initializer_list<BtnState> list)
+{
+	uint32_t mask = 0;
+	for (auto state : list)
+	{
+		mask |= 1u << int(state);
 	}
-};
-
+	return mask;
+}
 
+// Where the release of an active mapping leads, and where a Sync can send a state that takes it
+constexpr uint32_t ACTIVE_RELEASES = states({ BtnState::TapPress, BtnState::NoPress, BtnState::InstRelease });
+constexpr uint32_t SYNC_TARGETS = states({ BtnState::SimPressMaster, BtnState::DiagPressMaster });
 
-class DiagPressSlave : public DigitalButtonState
+// What a state does with each event, and the states it can change to. Unlisted reactions are those of every state:
+// Pressed and Released update the chord stack, Sync is ignored and GetDeadline asks for every poll. On entering a
+// state with an active mapping, the nested state starts at StartPress once the state's own entry is done.
+struct StateReactions
 {
-	DB_CONCRETE_STATE(DiagPressSlave)
+	BtnState state;
+	uint32_t nextStates = 0;
+	bool nested = false;
+	void (*onEntry)(Table &, uint32_t) = nothing;
+	void (*onExit)(Table &, uint32_t) = nothing;
+	void (*pressed)(Table &, uint32_t, Pressed &) = basePressed;
+	void (*released)(Table &, uint32_t, Released &) = baseReleased;
+	void (*sync)(Table &, uint32_t, Sync &) = ignoreSync;
+	void (*deadline)(Table &, uint32_t, GetDeadline &) = everyPoll;
+};
 
-	REACT(Pressed)
-	override
+constexpr array<StateReactions, size_t(BtnState::INVALID)> STATE_REACTIONS{ {
+  { .state = BtnState::NoPress,
+    .nextStates = states({ BtnState::WaitSim, BtnState::DblPressStart, BtnState::DiagPressSlave, BtnState::BtnPress }),
+    .pressed = noPressPressed,
+    .deadline = noPressDeadline },
+  { .state = BtnState::BtnPress,
+    .nextStates = ACTIVE_RELEASES | states({ BtnState::SimRelease }) | SYNC_TARGETS,
+    .nested = true,
+    .pressed = activePressed,
+    .released = activeReleasedNested,
+    .sync = activeSync,
+    .deadline = activeDeadline },
+  { .state = BtnState::TapPress,
+    .nextStates = states({ BtnState::BtnPress, BtnState::NoPress }),
+    .onEntry = tapPressEntry,
+    .onExit = tapPressExit,
+    .pressed = tapPressPressed,
+    .released = tapPressReleased,
+    .deadline = tapPressDeadline },
+  { .state = BtnState::WaitSim,
+    .nextStates = states({ BtnState::SimPressSlave, BtnState::DblPressStart, BtnState::DiagPressSlave, BtnState::BtnPress }) | SYNC_TARGETS,
+    .pressed = waitSimPressed,
+    .released = waitSimReleased,
+    .sync = waitSimSync },
+  { .state = BtnState::SimPressMaster,
+    .nextStates = ACTIVE_RELEASES | states({ BtnState::SimRelease }) | SYNC_TARGETS,
+    .nested = true,
+    .pressed = activePressed,
+    .released = activeReleasedNested,
+    .sync = activeSync,
+    .deadline = activeDeadline },
+  { .state = BtnState::SimPressSlave,
+    .nextStates = ACTIVE_RELEASES | states({ BtnState::SimRelease }),
+    .pressed = simPressSlavePressed,
+    .released = simPressSlaveReleased },
+  { .state = BtnState::SimRelease,
+    .nextStates = states({ BtnState::NoPress }) | SYNC_TARGETS,
+    .released = simReleaseReleased,
+    .sync = simReleaseSync },
+  { .state = BtnState::DiagPressMaster,
+    .nextStates = ACTIVE_RELEASES | states({ BtnState::SimRelease }) | SYNC_TARGETS,
+    .nested = true,
+    .pressed = activePressed,
+    .released = activeReleasedNested,
+    .sync = activeSync,
+    .deadline = activeDeadline },
+  { .state = BtnState::DiagPressSlave,
+    .nextStates = states({ BtnState::NoPress }),
+    .pressed = diagPressSlavePressed,
+    .released = diagPressSlaveReleased },
+  { .state = BtnState::DblPressStart,
+    .nextStates = states({ BtnState::DblPressNoPress, BtnState::DblPressNoPressTap, BtnState::InstRelease }),
+    .nested = true,
+    .pressed = activePressed,
+    .released = dblPressStartReleased,
+    .deadline = activeDeadline },
+  { .state = BtnState::DblPressNoPress,
+    .nextStates = states({ BtnState::BtnPress, BtnState::DblPressPress, BtnState::NoPress }),
+    .pressed = dblPressNoPressPressed,
+    .released = dblPressNoPressReleased,
+    .deadline = dblPressNoPressDeadline },
+  { .state = BtnState::DblPressNoPressTap,
+    .nextStates = states({ BtnState::TapPress, BtnState::DblPressPress }),
+    .pressed = dblPressNoPressTapPressed,
+    .released = dblPressNoPressTapReleased,
+    .deadline = dblPressWindowDeadline },
+  { .state = BtnState::DblPressNoPressHold,
+    .nextStates = states({ BtnState::BtnPress, BtnState::DblPressPress }),
+    .pressed = dblPressNoPressHoldPressed,
+    .released = dblPressNoPressHoldReleased,
+    .deadline = dblPressWindowDeadline },
+  { .state = BtnState::DblPressPress,
+    .nextStates = ACTIVE_RELEASES,
+    .nested = true,
+    .onEntry = dblPressPressEntry,
+    .pressed = activePressed,
+    .released = activeReleasedNested,
+    .deadline = activeDeadline },
+  { .state = BtnState::InstRelease,
+    .nextStates = states({ BtnState::NoPress }),
+    .pressed = instReleasePressed,
+    .released = instReleaseReleased,
+    .deadline = instReleaseDeadline },
+} };
+
+constexpr bool inStateOrder()
+{
+	for (size_t i = 0; i < STATE_REACTIONS.size(); ++i)
 	{
-		DigitalButtonState::react(e);
-
-		if (!pimpl()->_masterPress || pimpl()->_masterPress->getState() != BtnState::DiagPressMaster)
+		if (STATE_REACTIONS[i].state != BtnState(i))
 		{
-			// Master has released me!
-			pimpl()->_masterPress = nullptr;
-			pimpl()->ClearKey();
-			changeState<NoPress>();
+			return false;
 		}
 	}
-
-	REACT(Released)
-	override
+	for (size_t i = 0; i < ACTIVE_REACTIONS.size(); ++i)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->_masterPress && pimpl()->_masterPress->getState() == BtnState::DiagPressMaster)
+		if (ACTIVE_REACTIONS[i].state != ActiveState(i))
 		{
-			// Inform Diagonal Master of the release
-			// Here we're swapping the current state of the master and slave buttons. This enables the released button
-			// to process taps and instants whereas the other button can process its own binding activation.
-			optional<MapIterator> it;
-			auto me = pimpl()->_context->_getMatchingDiagBtn(pimpl()->_masterPress->_id, it);
-			if (me)
-			{
-				// DEBUG_LOG << pimpl()->_id << " is performing the swap!\n";
-				pimpl()->_masterPress->swapState(*me);
-				//DEBUG_LOG << pimpl()->_id << " is now in state " << getState() << " with mapping " << pimpl()->_nameToRelease << " set to " << pimpl()->_mapping.value() << '\n';
-				//DEBUG_LOG << pimpl()->_masterPress->_id << " is now in state " << pimpl()->_masterPress->getState() << '\n';
-			}
-			else
-			{
-				CERR << "I can't find myself as the other diagonal?!?";
-			}
-		}
-		else 
-		{
-			pimpl()->_masterPress = nullptr;
-			pimpl()->ClearKey();
-			changeState<NoPress>();
+			return false;
 		}
 	}
-};
+	return true;
+}
+static_assert(inStateOrder(), "The reactions are looked up by state");
+} // namespace
 
-class DblPressStart : public pocket_fsm::NestedStateMachine<ActiveMappingState, DigitalButtonState>
+uint32_t DigitalButtonTable::add(const JSMButton &buttonMapping)
 {
-	DB_CONCRETE_STATE(DblPressStart)
-	REACT(OnEntry)
-	override
+	uint32_t b;
+	if (freeSlots.empty())
 	{
-		DigitalButtonState::react(e);
-		initialize(new ActiveStartPress(_pimpl));
+		// Slots and timers are numbered alike
+		b = context.timers.add();
+		id.resize(b + 1);
+		mapping.resize(b + 1);
+		state.resize(b + 1);
+		active.resize(b + 1);
+		nextState.resize(b + 1);
+		nextActive.resize(b + 1);
+		pressTime.resize(b + 1);
+		keyToRelease.resize(b + 1);
+		nameToRelease.resize(b + 1);
+		instantReleases.resize(b + 1);
+		turboApplies.resize(b + 1);
+		turboReleases.resize(b + 1);
+		masterPress.resize(b + 1);
+		lastInput.resize(b + 1);
+		chordStackRevision.resize(b + 1);
+		instantReleases[b].reserve(MAX_INSTANT_RELEASES);
 	}
-
-	NESTED_REACT(Pressed);
-
-	REACT(Released)
-	override
+	else
 	{
-		sendEvent(e);
-		if (_nextState)
-		{
-			if (_nextState->_name == "NoPress")
-			{
-				delete _nextState;
-				_nextState = nullptr;
-				changeState<DblPressNoPress>(_onTransition);
-			}
-			else if (_nextState->_name == "TapPress")
-			{
-				delete _nextState;
-				_nextState = nullptr;
-				changeState<DblPressNoPressTap>(_onTransition);
-			}
-		}
+		b = freeSlots.back();
+		freeSlots.pop_back();
 	}
-};
+	id[b] = buttonMapping._id;
+	mapping[b] = &buttonMapping;
+	state[b] = BtnState::NoPress;
+	active[b] = ActiveState::INVALID;
+	nextState[b] = BtnState::INVALID;
+	nextActive[b] = ActiveState::INVALID;
+	pressTime[b] = {};
+	ClearKey(b);
+	masterPress[b] = NO_SLOT;
+	lastInput[b] = {};
+	chordStackRevision[b] = 0;
+	enter(b);
+	return b;
+}
 
-class DblPressNoPress : public DigitalButtonState
+void DigitalButtonTable::remove(uint32_t b)
 {
-	DB_CONCRETE_STATE(DblPressNoPress)
+	context.timers.cancel(b);
+	ClearKey(b);
+	mapping[b] = nullptr;
+	state[b] = BtnState::NoPress;
+	active[b] = ActiveState::INVALID;
+	// Its slaves no longer have a master
+	replace(masterPress.begin(), masterPress.end(), b, NO_SLOT);
+	masterPress[b] = NO_SLOT;
+	freeSlots.push_back(b);
+}
 
-	REACT(Pressed)
-	override
+template<typename E>
+void DigitalButtonTable::sendEvent(uint32_t b, E &evt)
+{
+	if constexpr (is_same_v<E, Pressed> || is_same_v<E, Released>)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			pimpl()->_press_times = e.time_now; // reset Timer to raise a tap
-			changeState<BtnPress>();
-		}
-		else
-		{
-			pimpl()->_press_times = e.time_now;
-			changeState<DblPressPress>();
-		}
+		lastInput[b].in_now = evt.time_now;
+		lastInput[b].in_pressed = is_same_v<E, Pressed>;
+		lastInput[b].in_turboTime = evt.turboTime;
+		lastInput[b].in_holdTime = evt.holdTime;
+		lastInput[b].in_dblPressWindow = evt.dblPressWindow;
 	}
-
-	REACT(Released)
-	override
+	react(b, evt);
+	if constexpr (is_same_v<E, Pressed> || is_same_v<E, Released>)
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > MAGIC_INSTANT_DURATION)
-		{
-			pimpl()->ReleaseInstant(BtnEvent::OnRelease);
-		}
-
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			changeState<NoPress>();
-		}
+		chordStackRevision[b] = context.chordStackRevision;
 	}
-};
+	schedule(b);
+}
 
-class DblPressNoPressTap : public DigitalButtonState
+template<typename E>
+void DigitalButtonTable::react(uint32_t b, E &evt)
 {
-	DB_CONCRETE_STATE(DblPressNoPressTap)
-	REACT(Pressed)
-	override
+	auto &reactions = STATE_REACTIONS[size_t(state[b])];
+	if constexpr (is_same_v<E, Pressed>)
 	{
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			pimpl()->_press_times = e.time_now; // reset Timer to raise a tap
-			changeState<TapPress>();
-		}
-		else
-		{
-			pimpl()->_keyToRelease = pimpl()->_mapping.getDblPressMap()->second;
-			pimpl()->_nameToRelease = pimpl()->_mapping.getName(pimpl()->_id);
-			pimpl()->_press_times = e.time_now;
-			changeState<DblPressPress>();
-		}
+		reactions.pressed(*this, b, evt);
+	}
+	else if constexpr (is_same_v<E, Released>)
+	{
+		reactions.released(*this, b, evt);
 	}
+	else
+	{
+		static_assert(is_same_v<E, Sync>, "Only Pressed, Released and Sync change states");
+		reactions.sync(*this, b, evt);
+	}
+	applyStateChanges(b);
+}
 
-	REACT(Released)
-	override
+// The changes of state take effect once the reaction that asked for them is over
+void DigitalButtonTable::applyStateChanges(uint32_t b)
+{
+	if (nextActive[b] != ActiveState::INVALID)
 	{
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			pimpl()->_press_times = e.time_now; // reset Timer to raise a tap
-			changeState<TapPress>();
-		}
+		active[b] = nextActive[b];
+		nextActive[b] = ActiveState::INVALID;
+		enterActive(b);
 	}
-};
+	while (nextState[b] != BtnState::INVALID)
+	{
+		auto &current = STATE_REACTIONS[size_t(state[b])];
+		auto next = nextState[b];
+		nextState[b] = BtnState::INVALID;
+		_ASSERT_EXPR(current.nextStates & (1u << int(next)), L"This change of state is not in the table of reactions");
+		current.onExit(*this, b);
+		state[b] = next;
+		active[b] = ActiveState::INVALID;
+		enter(b);
+	}
+}
 
-class DblPressNoPressHold : public DigitalButtonState
+void DigitalButtonTable::enter(uint32_t b)
 {
-	DB_CONCRETE_STATE(DblPressNoPressHold)
-	REACT(Pressed)
+	// Uncomment below to diplay a log each time a button changes state
+	// DEBUG_LOG << "Button " << id[b] << " is now in state " << state[b] << '\n';
+	if (Trace::enabled())
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			changeState<BtnPress>();
-			// Don't reset timer to preserve hold press behaviour
-			pimpl()->GetPressMapping()->ProcessEvent(BtnEvent::OnPress, *pimpl());
-		}
-		else
-		{
-			changeState<DblPressPress>();
-			pimpl()->_press_times = e.time_now;
-			pimpl()->_keyToRelease = pimpl()->_mapping.getDblPressMap()->second;
-			pimpl()->_nameToRelease = pimpl()->_mapping.getName(pimpl()->_id);
-		}
+		Trace::instant(magic_enum::enum_name(id[b]), "button", magic_enum::enum_name(state[b]));
 	}
+	auto &reactions = STATE_REACTIONS[size_t(state[b])];
+	reactions.onEntry(*this, b);
+	if (reactions.nested)
+	{
+		active[b] = ActiveState::StartPress;
+		enterActive(b);
+	}
+}
 
-	REACT(Released)
-	override
+void DigitalButtonTable::enterActive(uint32_t b)
+{
+	if (Trace::enabled())
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > e.dblPressWindow)
-		{
-			changeState<BtnPress>();
-			// Don't reset timer to preserve hold press behaviour
-		}
+		Trace::instant(magic_enum::enum_name(id[b]), "button", magic_enum::enum_name(active[b]));
 	}
-};
+	ACTIVE_REACTIONS[size_t(active[b])].onEntry(*this, b);
+}
 
-class DblPressPress : public pocket_fsm::NestedStateMachine<ActiveMappingState, DigitalButtonState>
+void DigitalButtonTable::swapState(uint32_t b, uint32_t other)
 {
-	DB_CONCRETE_STATE(DblPressPress)
+	// Swap just the state, but leave the data in their respective button
+	swap(state[b], state[other]);
+	swap(active[b], active[other]);
+	schedule(b);
+	schedule(other);
+}
 
-	REACT(OnEntry)
-	override
+void DigitalButtonTable::schedule(uint32_t b)
+{
+	GetDeadline deadline = lastInput[b];
+	STATE_REACTIONS[size_t(state[b])].deadline(*this, b, deadline);
+	if (deadline.out_deadline == chrono::steady_clock::time_point::max())
+	{
+		context.timers.cancel(b);
+	}
+	else
 	{
-		DigitalButtonState::react(e);
-		pimpl()->_keyToRelease = pimpl()->_mapping.getDblPressMap()->second;
-		pimpl()->_nameToRelease = pimpl()->_mapping.getName(pimpl()->_id);
-		initialize(new ActiveStartPress(_pimpl));
+		context.timers.schedule(b, deadline.out_deadline);
 	}
+}
 
-	NESTED_REACT(Pressed);
-	NESTED_REACT(Released);
-};
+// Top level interface
 
-class InstRelease : public DigitalButtonState
+DigitalButton::DigitalButton(shared_ptr<DigitalButton::Context> _context, JSMButton &mapping)
+  : _id(mapping._id)
+  , _context(_context)
+  , _slot(_context->buttons->add(mapping))
 {
-	DB_CONCRETE_STATE(InstRelease)
+}
 
-	REACT(Pressed)
-	override
+DigitalButton::DigitalButton(DigitalButton &&other) noexcept
+  : _id(other._id)
+  , _context(move(other._context))
+  , _slot(other._slot)
+{
+	other._slot = NO_SLOT;
+}
+
+DigitalButton::~DigitalButton()
+{
+	if (_slot != NO_SLOT)
 	{
-		DigitalButtonState::react(e);
-		pimpl()->ReleaseInstant(BtnEvent::OnRelease);
-		pimpl()->ClearKey();
-		changeState<NoPress>();
+		_context->buttons->remove(_slot);
 	}
+}
+
+Pressed &DigitalButton::sendEvent(Pressed &evt)
+{
+	_context->buttons->sendEvent(_slot, evt);
+	return evt;
+}
+
+Released &DigitalButton::sendEvent(Released &evt)
+{
+	_context->buttons->sendEvent(_slot, evt);
+	return evt;
+}
+
+// All states can be querried it's duration time.
+GetDuration &DigitalButton::sendEvent(GetDuration &evt)
+{
+	evt.out_duration = _context->buttons->GetPressDurationMS(_slot, evt.in_now);
+	return evt;
+}
+
+// All states can be assigned a new press time
+SetPressTime &DigitalButton::sendEvent(SetPressTime &evt)
+{
+	_context->buttons->pressTime[_slot] = evt;
+	_context->buttons->schedule(_slot);
+	return evt;
+}
 
-	REACT(Released)
-	override
+void DigitalButton::sendDueEvent(chrono::steady_clock::time_point now)
+{
+	if (!_context->timers.isDue(_slot))
 	{
-		DigitalButtonState::react(e);
-		if (pimpl()->GetPressDurationMS(e.time_now) > MAGIC_INSTANT_DURATION)
-		{
-			pimpl()->ReleaseInstant(BtnEvent::OnRelease);
-			pimpl()->ClearKey();
-			changeState<NoPress>();
-		}
+		return;
 	}
-};
+	const GetDeadline &last = _context->buttons->lastInput[_slot];
+	if (last.in_pressed)
+	{
+		Pressed evt;
+		evt.time_now = now;
+		evt.turboTime = last.in_turboTime;
+		evt.holdTime = last.in_holdTime;
+		evt.dblPressWindow = last.in_dblPressWindow;
+		sendEvent(evt);
+	}
+	else
+	{
+		Released evt;
+		evt.time_now = now;
+		evt.turboTime = last.in_turboTime;
+		evt.holdTime = last.in_holdTime;
+		evt.dblPressWindow = last.in_dblPressWindow;
+		sendEvent(evt);
+	}
+}
 
-// Top level interface
+bool DigitalButton::isIdle(bool pressed) const
+{
+	auto &buttons = *_context->buttons;
+	return pressed == buttons.lastInput[_slot].in_pressed && buttons.chordStackRevision[_slot] == _context->chordStackRevision && !_context->timers.isDue(_slot);
+}
 
-DigitalButton::DigitalButton(shared_ptr<DigitalButton::Context> _context, JSMButton &mapping)
-  : _id(mapping._id)
+BtnState DigitalButton::getState() const
 {
-	initialize(new NoPress(new DigitalButtonImpl(mapping, _context)));
+	return _context->buttons->state[_slot];
+}
+
+void DigitalButton::swapState(DigitalButton &otherBtn)
+{
+	_context->buttons->swapState(_slot, otherBtn._slot);
 }
 
 DigitalButton::Context::Context(Gamepad::Callback virtualControllerCallback, shared_ptr<MotionIf> mainMotion)
   : rightMainMotion(mainMotion)
+  , buttons(make_unique<DigitalButtonTable>(*this))
 {
-	chordStack.push_front(ButtonID::NONE); // Always hold mapping none at the end to _handle modeshifts and chords
-#ifdef _WIN32
+	// The chord stack always holds mapping none at the end to _handle modeshifts and chords
+	// Room for a few actions per button, so that pressing them doesn't allocate
+	gyroActionQueue.reserve(MAPPING_SIZE);
+	activeTogglesQueue.reserve(MAPPING_SIZE);
 	auto virtual_controller = SettingsManager::getV<ControllerScheme>(SettingID::VIRTUAL_CONTROLLER);
 	if (virtual_controller->value() != ControllerScheme::NONE)
 	{
@@ -1062,5 +1435,10 @@ DigitalButton::Context::Context(Gamepad::Callback virtualControllerCallback, sha
 			CERR << error << '\n';
 		}
 	}
-#endif
+}
+
+DigitalButton::Context::~Context()
+{
+	// The gamepad can notify under callback_lock until it is gone, so it goes first
+	_vigemController.reset();
 }
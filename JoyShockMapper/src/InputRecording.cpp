@@ -0,0 +1,999 @@
+#include "InputRecording.h"
+#include "Gamepad.h"
+
+#include <algorithm>
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+
+using namespace InputRecording;
+
+namespace
+{
+
+constexpr uint32_t paddedSize(uint32_t size)
+{
+	return (size + 7) & ~uint32_t(7);
+}
+
+// Poll handed to the mapping by the recorder
+struct CurrentPoll
+{
+	int handle = -1;
+	chrono::steady_clock::time_point time;
+	JOY_SHOCK_STATE state;
+	IMU_STATE imuState;
+	int numImuSamples = 0;
+	array<IMU_SAMPLE, MAX_IMU_SAMPLES> imuSamples;
+};
+
+class JslRecorderImpl : public JslRecorder
+{
+	shared_ptr<JslWrapper> _device;
+	ofstream _file;
+	mutex _fileLock;
+	unordered_map<int, pair<JOY_SHOCK_STATE, IMU_STATE>> _lastStates; // Last recorded of each controller, under _fileLock
+	chrono::steady_clock::time_point _start;
+	void (*_pollCallback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float) = nullptr;
+	void (*_touchCallback)(int, TOUCH_STATE, TOUCH_STATE, float) = nullptr;
+
+	// The backend takes plain function pointers, so there can only be one recorder at a time
+	static inline JslRecorderImpl *_instance = nullptr;
+
+	// The poll being handled by the calling thread. Mapping workers can handle several controllers at once.
+	static inline thread_local CurrentPoll _current;
+
+public:
+	JslRecorderImpl(shared_ptr<JslWrapper> device, const string &fileName)
+	  : _device(device)
+	  , _file(fileName, ios::binary | ios::trunc)
+	  , _start(chrono::steady_clock::now())
+	{
+		if (_file)
+		{
+			FileHeader header;
+			memcpy(header.magic, MAGIC, sizeof(MAGIC));
+			header.version = VERSION;
+			header.headerSize = sizeof(FileHeader);
+			_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		}
+		_instance = this;
+	}
+
+	virtual ~JslRecorderImpl()
+	{
+		if (_instance == this)
+		{
+			_instance = nullptr;
+		}
+	}
+
+	bool isOpen() const
+	{
+		return _file.good();
+	}
+
+	void RecordCommand(const string &line) override
+	{
+		write(RecordType::COMMAND, chrono::steady_clock::now(), line.data(), uint32_t(line.size()));
+	}
+
+	shared_ptr<JslWrapper> GetDevice() override
+	{
+		return _device;
+	}
+
+	int ConnectDevices() override
+	{
+		return _device->ConnectDevices();
+	}
+
+	int GetDeviceCount() override
+	{
+		return _device->GetDeviceCount();
+	}
+
+	int GetConnectedDeviceHandles(int *deviceHandleArray, int size) override
+	{
+		int count = _device->GetConnectedDeviceHandles(deviceHandleArray, size);
+		auto now = chrono::steady_clock::now();
+		for (int i = 0; i < count; ++i)
+		{
+			int handle = deviceHandleArray[i];
+			if (handle == -1)
+				continue;
+
+			DeviceRecord record{};
+			record.handle = handle;
+			record.controllerType = _device->GetControllerType(handle);
+			record.splitType = _device->GetControllerSplitType(handle);
+			record.colour = _device->GetControllerColour(handle);
+			int sizeX = 0, sizeY = 0;
+			if (_device->GetTouchpadDimension(handle, sizeX, sizeY))
+			{
+				record.touchpadSizeX = sizeX;
+				record.touchpadSizeY = sizeY;
+			}
+			auto guid = _device->GetControllerGUID(handle);
+			strncpy(record.guid, guid.c_str(), sizeof(record.guid) - 1);
+			write(RecordType::DEVICE, now, &record, sizeof(record));
+		}
+		return count;
+	}
+
+	void DisconnectAndDisposeAll() override
+	{
+		_device->DisconnectAndDisposeAll();
+		lock_guard guard(_fileLock);
+		_file.flush();
+	}
+
+	JOY_SHOCK_STATE GetSimpleState(int deviceId) override
+	{
+		return _device->GetSimpleState(deviceId);
+	}
+
+	IMU_STATE GetIMUState(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState : _device->GetIMUState(deviceId);
+	}
+
+	MOTION_STATE GetMotionState(int deviceId) override
+	{
+		return _device->GetMotionState(deviceId);
+	}
+
+	TOUCH_STATE GetTouchState(int deviceId, bool previous = false) override
+	{
+		return _device->GetTouchState(deviceId, previous);
+	}
+
+	bool GetTouchpadDimension(int deviceId, int &sizeX, int &sizeY) override
+	{
+		return _device->GetTouchpadDimension(deviceId, sizeX, sizeY);
+	}
+
+	int GetButtons(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.buttons : _device->GetButtons(deviceId);
+	}
+
+	float GetLeftX(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.stickLX : _device->GetLeftX(deviceId);
+	}
+
+	float GetLeftY(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.stickLY : _device->GetLeftY(deviceId);
+	}
+
+	float GetRightX(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.stickRX : _device->GetRightX(deviceId);
+	}
+
+	float GetRightY(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.stickRY : _device->GetRightY(deviceId);
+	}
+
+	float GetLeftTrigger(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.lTrigger : _device->GetLeftTrigger(deviceId);
+	}
+
+	float GetRightTrigger(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.state.rTrigger : _device->GetRightTrigger(deviceId);
+	}
+
+	float GetGyroX(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.gyroX : _device->GetGyroX(deviceId);
+	}
+
+	float GetGyroY(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.gyroY : _device->GetGyroY(deviceId);
+	}
+
+	float GetGyroZ(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.gyroZ : _device->GetGyroZ(deviceId);
+	}
+
+	float GetAccelX(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.accelX : _device->GetAccelX(deviceId);
+	}
+
+	float GetAccelY(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.accelY : _device->GetAccelY(deviceId);
+	}
+
+	float GetAccelZ(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.imuState.accelZ : _device->GetAccelZ(deviceId);
+	}
+
+	int GetTouchId(int deviceId, bool secondTouch = false) override
+	{
+		return _device->GetTouchId(deviceId, secondTouch);
+	}
+
+	bool GetTouchDown(int deviceId, bool secondTouch = false) override
+	{
+		return _device->GetTouchDown(deviceId, secondTouch);
+	}
+
+	float GetTouchX(int deviceId, bool secondTouch = false) override
+	{
+		return _device->GetTouchX(deviceId, secondTouch);
+	}
+
+	float GetTouchY(int deviceId, bool secondTouch = false) override
+	{
+		return _device->GetTouchY(deviceId, secondTouch);
+	}
+
+	float GetStickStep(int deviceId) override
+	{
+		return _device->GetStickStep(deviceId);
+	}
+
+	float GetTriggerStep(int deviceId) override
+	{
+		return _device->GetTriggerStep(deviceId);
+	}
+
+	float GetPollRate(int deviceId) override
+	{
+		return _device->GetPollRate(deviceId);
+	}
+
+	void ResetContinuousCalibration(int deviceId) override
+	{
+		_device->ResetContinuousCalibration(deviceId);
+	}
+
+	void StartContinuousCalibration(int deviceId) override
+	{
+		_device->StartContinuousCalibration(deviceId);
+	}
+
+	void PauseContinuousCalibration(int deviceId) override
+	{
+		_device->PauseContinuousCalibration(deviceId);
+	}
+
+	void GetCalibrationOffset(int deviceId, float &xOffset, float &yOffset, float &zOffset) override
+	{
+		_device->GetCalibrationOffset(deviceId, xOffset, yOffset, zOffset);
+	}
+
+	void SetCalibrationOffset(int deviceId, float xOffset, float yOffset, float zOffset) override
+	{
+		_device->SetCalibrationOffset(deviceId, xOffset, yOffset, zOffset);
+	}
+
+	void SetCallback(void (*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float)) override
+	{
+		_pollCallback = callback;
+		_device->SetCallback(callback ? &JslRecorderImpl::recordPoll : nullptr);
+	}
+
+	void SetTouchCallback(void (*callback)(int, TOUCH_STATE, TOUCH_STATE, float)) override
+	{
+		_touchCallback = callback;
+		_device->SetTouchCallback(callback ? &JslRecorderImpl::recordTouch : nullptr);
+	}
+
+	int GetControllerType(int deviceId) override
+	{
+		return _device->GetControllerType(deviceId);
+	}
+
+	int GetControllerSplitType(int deviceId) override
+	{
+		return _device->GetControllerSplitType(deviceId);
+	}
+
+	int GetControllerColour(int deviceId) override
+	{
+		return _device->GetControllerColour(deviceId);
+	}
+
+	void SetLightColour(int deviceId, int colour) override
+	{
+		_device->SetLightColour(deviceId, colour);
+	}
+
+	void SetRumble(int deviceId, int smallRumble, int bigRumble) override
+	{
+		_device->SetRumble(deviceId, smallRumble, bigRumble);
+	}
+
+	void SetPlayerNumber(int deviceId, int number) override
+	{
+		_device->SetPlayerNumber(deviceId, number);
+	}
+
+	void SetTriggerEffect(int deviceId, const AdaptiveTriggerSetting &_leftTriggerEffect, const AdaptiveTriggerSetting &_rightTriggerEffect) override
+	{
+		_device->SetTriggerEffect(deviceId, _leftTriggerEffect, _rightTriggerEffect);
+	}
+
+	void SetMicLight(int deviceId, unsigned char mode) override
+	{
+		_device->SetMicLight(deviceId, mode);
+	}
+
+	bool GetOutputReportStats(int deviceId, uint64_t &sent, uint64_t &coalesced) override
+	{
+		return _device->GetOutputReportStats(deviceId, sent, coalesced);
+	}
+
+	bool GetIMUTimestamp(int deviceId, uint64_t &timestampUs) override
+	{
+		return _device->GetIMUTimestamp(deviceId, timestampUs);
+	}
+
+	int GetIMUSamples(int deviceId, IMU_SAMPLE *samples, int maxSamples) override
+	{
+		// The samples were already taken from the device to be recorded
+		if (_current.handle != deviceId)
+		{
+			return _device->GetIMUSamples(deviceId, samples, maxSamples);
+		}
+		int count = min(_current.numImuSamples, maxSamples);
+		copy_n(_current.imuSamples.begin(), count, samples);
+		_current.numImuSamples = 0;
+		return count;
+	}
+
+	chrono::steady_clock::time_point GetPollTime(int deviceId) override
+	{
+		return _current.handle == deviceId ? _current.time : _device->GetPollTime(deviceId);
+	}
+
+	std::string GetControllerGUID(int deviceId) override
+	{
+		return _device->GetControllerGUID(deviceId);
+	}
+
+	bool RemoveController(int handle) override
+	{
+		return _device->RemoveController(handle);
+	}
+
+private:
+	static void recordPoll(int handle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE lastState, IMU_STATE imuState, IMU_STATE lastImuState, float deltaTime)
+	{
+		auto recorder = _instance;
+		if (!recorder || !recorder->_pollCallback)
+			return;
+
+		// Some backends, like SDL, hand dummy states to the callback and serve the input through the getters. Record
+		// what the getters return, and serve the mapping the same values while it handles the poll.
+		auto &device = *recorder->_device;
+		_current.time = device.GetPollTime(handle);
+		_current.state.buttons = device.GetButtons(handle);
+		_current.state.lTrigger = device.GetLeftTrigger(handle);
+		_current.state.rTrigger = device.GetRightTrigger(handle);
+		_current.state.stickLX = device.GetLeftX(handle);
+		_current.state.stickLY = device.GetLeftY(handle);
+		_current.state.stickRX = device.GetRightX(handle);
+		_current.state.stickRY = device.GetRightY(handle);
+		_current.imuState = device.GetIMUState(handle);
+		_current.numImuSamples = device.GetIMUSamples(handle, _current.imuSamples.data(), MAX_IMU_SAMPLES);
+		_current.handle = handle;
+
+		PollRecord record{};
+		record.handle = handle;
+		record.deltaTime = deltaTime;
+		record.state = _current.state;
+		record.imuState = _current.imuState;
+		{
+			lock_guard guard(recorder->_fileLock);
+			auto &last = recorder->_lastStates[handle];
+			record.lastState = last.first;
+			record.lastImuState = last.second;
+			last = { record.state, record.imuState };
+		}
+		record.touchState = device.GetTouchState(handle, false);
+		record.lastTouchState = device.GetTouchState(handle, true);
+		uint64_t imuTimestampUs = 0;
+		record.imuTimestampUs = device.GetIMUTimestamp(handle, imuTimestampUs) ? imuTimestampUs : 0;
+		record.numImuSamples = _current.numImuSamples;
+		recorder->write(RecordType::POLL, _current.time, &record, sizeof(record),
+		  _current.imuSamples.data(), uint32_t(_current.numImuSamples * sizeof(IMU_SAMPLE)));
+
+		recorder->_pollCallback(handle, record.state, record.lastState, record.imuState, record.lastImuState, deltaTime);
+		_current.handle = -1;
+	}
+
+	static void recordTouch(int handle, TOUCH_STATE state, TOUCH_STATE prevState, float deltaTime)
+	{
+		auto recorder = _instance;
+		if (!recorder || !recorder->_touchCallback)
+			return;
+
+		TouchRecord record{};
+		record.handle = handle;
+		record.deltaTime = deltaTime;
+		record.state = state;
+		record.prevState = prevState;
+		recorder->write(RecordType::TOUCH, recorder->_device->GetPollTime(handle), &record, sizeof(record));
+
+		recorder->_touchCallback(handle, state, prevState, deltaTime);
+	}
+
+	void write(RecordType type, chrono::steady_clock::time_point time, const void *payload, uint32_t size, const void *extra = nullptr, uint32_t extraSize = 0)
+	{
+		static constexpr char PADDING[8] = {};
+		RecordHeader header;
+		header.type = type;
+		header.size = size + extraSize;
+		header.timeUs = time > _start ? uint64_t(chrono::duration_cast<chrono::microseconds>(time - _start).count()) : 0;
+
+		lock_guard guard(_fileLock);
+		_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		_file.write(static_cast<const char *>(payload), size);
+		if (extraSize > 0)
+		{
+			_file.write(static_cast<const char *>(extra), extraSize);
+		}
+		_file.write(PADDING, paddedSize(header.size) - header.size);
+	}
+};
+
+class JslReplayImpl : public JslReplay
+{
+	vector<uint64_t> _data; // 8 byte aligned, like the records
+	size_t _size = 0;
+	map<int, DeviceRecord> _devices;
+	unordered_map<int, const PollRecord *> _polls; // Last poll replayed for each controller
+	uint64_t _timeUs = 0;
+	chrono::steady_clock::time_point _start;
+	void (*_pollCallback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float) = nullptr;
+	void (*_touchCallback)(int, TOUCH_STATE, TOUCH_STATE, float) = nullptr;
+
+public:
+	bool load(const string &fileName)
+	{
+		ifstream file(fileName, ios::binary | ios::ate);
+		if (!file)
+		{
+			CERR << "Cannot open the recording " << fileName << '\n';
+			return false;
+		}
+		_size = size_t(file.tellg());
+		_data.resize((_size + 7) / 8);
+		file.seekg(0);
+		file.read(reinterpret_cast<char *>(_data.data()), _size);
+
+		auto header = reinterpret_cast<const FileHeader *>(_data.data());
+		if (_size < sizeof(FileHeader) || memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0)
+		{
+			CERR << fileName << " is not a JoyShockMapper recording\n";
+			return false;
+		}
+		if (header->version != VERSION || header->headerSize != sizeof(FileHeader))
+		{
+			CERR << fileName << " was recorded by a different version of JoyShockMapper\n";
+			return false;
+		}
+
+		bool complete = forEachRecord([this](const RecordHeader &record, const char *payload)
+		  {
+			  if (record.type == RecordType::DEVICE && record.size >= sizeof(DeviceRecord))
+			  {
+				  auto device = reinterpret_cast<const DeviceRecord *>(payload);
+				  _devices.emplace(device->handle, *device);
+			  } });
+		if (!complete)
+		{
+			CERR << "The recording " << fileName << " is truncated, only the complete records will be replayed\n";
+		}
+		return true;
+	}
+
+	size_t Replay(function<void(const string &)> processCommand) override
+	{
+		size_t polls = 0;
+		_start = chrono::steady_clock::now();
+		forEachRecord([this, &polls, &processCommand](const RecordHeader &record, const char *payload)
+		  {
+			  _timeUs = record.timeUs;
+			  switch (record.type)
+			  {
+			  case RecordType::POLL:
+			  {
+				  auto poll = reinterpret_cast<const PollRecord *>(payload);
+				  if (record.size < sizeof(PollRecord) || poll->numImuSamples < 0 || poll->numImuSamples > MAX_IMU_SAMPLES ||
+				    record.size < sizeof(PollRecord) + poll->numImuSamples * sizeof(IMU_SAMPLE))
+					  break;
+				  if (_pollCallback && _devices.find(poll->handle) != _devices.end())
+				  {
+					  _polls[poll->handle] = poll;
+					  _pollCallback(poll->handle, poll->state, poll->lastState, poll->imuState, poll->lastImuState, poll->deltaTime);
+					  ++polls;
+				  }
+				  break;
+			  }
+			  case RecordType::TOUCH:
+			  {
+				  auto touch = reinterpret_cast<const TouchRecord *>(payload);
+				  if (record.size >= sizeof(TouchRecord) && _touchCallback && _devices.find(touch->handle) != _devices.end())
+				  {
+					  _touchCallback(touch->handle, touch->state, touch->prevState, touch->deltaTime);
+				  }
+				  break;
+			  }
+			  case RecordType::COMMAND:
+				  processCommand(string(payload, record.size));
+				  break;
+			  default: // Devices were all connected on load
+				  break;
+			  } });
+		return polls;
+	}
+
+	uint64_t GetReplayTimeUs() const override
+	{
+		return _timeUs;
+	}
+
+	int ConnectDevices() override
+	{
+		return int(_devices.size());
+	}
+
+	int GetDeviceCount() override
+	{
+		return int(_devices.size());
+	}
+
+	int GetConnectedDeviceHandles(int *deviceHandleArray, int size) override
+	{
+		int count = 0;
+		for (auto device = _devices.begin(); device != _devices.end() && count < size; ++device)
+		{
+			deviceHandleArray[count++] = device->first;
+		}
+		return count;
+	}
+
+	void DisconnectAndDisposeAll() override
+	{
+		_polls.clear();
+	}
+
+	JOY_SHOCK_STATE GetSimpleState(int deviceId) override
+	{
+		auto poll = getPoll(deviceId);
+		return poll ? poll->state : JOY_SHOCK_STATE{};
+	}
+
+	IMU_STATE GetIMUState(int deviceId) override
+	{
+		auto poll = getPoll(deviceId);
+		return poll ? poll->imuState : IMU_STATE{};
+	}
+
+	MOTION_STATE GetMotionState(int deviceId) override
+	{
+		return MOTION_STATE{};
+	}
+
+	TOUCH_STATE GetTouchState(int deviceId, bool previous = false) override
+	{
+		auto poll = getPoll(deviceId);
+		return !poll ? TOUCH_STATE{} : previous ? poll->lastTouchState : poll->touchState;
+	}
+
+	bool GetTouchpadDimension(int deviceId, int &sizeX, int &sizeY) override
+	{
+		auto device = _devices.find(deviceId);
+		if (device == _devices.end() || device->second.touchpadSizeX == 0)
+		{
+			return false;
+		}
+		sizeX = device->second.touchpadSizeX;
+		sizeY = device->second.touchpadSizeY;
+		return true;
+	}
+
+	int GetButtons(int deviceId) override
+	{
+		return GetSimpleState(deviceId).buttons;
+	}
+
+	float GetLeftX(int deviceId) override
+	{
+		return GetSimpleState(deviceId).stickLX;
+	}
+
+	float GetLeftY(int deviceId) override
+	{
+		return GetSimpleState(deviceId).stickLY;
+	}
+
+	float GetRightX(int deviceId) override
+	{
+		return GetSimpleState(deviceId).stickRX;
+	}
+
+	float GetRightY(int deviceId) override
+	{
+		return GetSimpleState(deviceId).stickRY;
+	}
+
+	float GetLeftTrigger(int deviceId) override
+	{
+		return GetSimpleState(deviceId).lTrigger;
+	}
+
+	float GetRightTrigger(int deviceId) override
+	{
+		return GetSimpleState(deviceId).rTrigger;
+	}
+
+	float GetGyroX(int deviceId) override
+	{
+		return GetIMUState(deviceId).gyroX;
+	}
+
+	float GetGyroY(int deviceId) override
+	{
+		return GetIMUState(deviceId).gyroY;
+	}
+
+	float GetGyroZ(int deviceId) override
+	{
+		return GetIMUState(deviceId).gyroZ;
+	}
+
+	float GetAccelX(int deviceId) override
+	{
+		return GetIMUState(deviceId).accelX;
+	}
+
+	float GetAccelY(int deviceId) override
+	{
+		return GetIMUState(deviceId).accelY;
+	}
+
+	float GetAccelZ(int deviceId) override
+	{
+		return GetIMUState(deviceId).accelZ;
+	}
+
+	int GetTouchId(int deviceId, bool secondTouch = false) override
+	{
+		auto touch = GetTouchState(deviceId);
+		return secondTouch ? touch.t1Id : touch.t0Id;
+	}
+
+	bool GetTouchDown(int deviceId, bool secondTouch = false) override
+	{
+		auto touch = GetTouchState(deviceId);
+		return secondTouch ? touch.t1Down : touch.t0Down;
+	}
+
+	float GetTouchX(int deviceId, bool secondTouch = false) override
+	{
+		auto touch = GetTouchState(deviceId);
+		return secondTouch ? touch.t1X : touch.t0X;
+	}
+
+	float GetTouchY(int deviceId, bool secondTouch = false) override
+	{
+		auto touch = GetTouchState(deviceId);
+		return secondTouch ? touch.t1Y : touch.t0Y;
+	}
+
+	float GetStickStep(int deviceId) override
+	{
+		return float();
+	}
+
+	float GetTriggerStep(int deviceId) override
+	{
+		return float();
+	}
+
+	float GetPollRate(int deviceId) override
+	{
+		return float();
+	}
+
+	void ResetContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void StartContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void PauseContinuousCalibration(int deviceId) override
+	{
+	}
+
+	void GetCalibrationOffset(int deviceId, float &xOffset, float &yOffset, float &zOffset) override
+	{
+		xOffset = yOffset = zOffset = 0.f;
+	}
+
+	void SetCalibrationOffset(int deviceId, float xOffset, float yOffset, float zOffset) override
+	{
+	}
+
+	void SetCallback(void (*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float)) override
+	{
+		_pollCallback = callback;
+	}
+
+	void SetTouchCallback(void (*callback)(int, TOUCH_STATE, TOUCH_STATE, float)) override
+	{
+		_touchCallback = callback;
+	}
+
+	int GetControllerType(int deviceId) override
+	{
+		auto device = _devices.find(deviceId);
+		return device != _devices.end() ? device->second.controllerType : 0;
+	}
+
+	int GetControllerSplitType(int deviceId) override
+	{
+		auto device = _devices.find(deviceId);
+		return device != _devices.end() ? device->second.splitType : 0;
+	}
+
+	int GetControllerColour(int deviceId) override
+	{
+		auto device = _devices.find(deviceId);
+		return device != _devices.end() ? device->second.colour : 0;
+	}
+
+	void SetLightColour(int deviceId, int colour) override
+	{
+	}
+
+	void SetRumble(int deviceId, int smallRumble, int bigRumble) override
+	{
+	}
+
+	void SetPlayerNumber(int deviceId, int number) override
+	{
+	}
+
+	bool GetIMUTimestamp(int deviceId, uint64_t &timestampUs) override
+	{
+		auto poll = getPoll(deviceId);
+		if (poll && poll->imuTimestampUs != 0)
+		{
+			timestampUs = poll->imuTimestampUs;
+			return true;
+		}
+		return false;
+	}
+
+	int GetIMUSamples(int deviceId, IMU_SAMPLE *samples, int maxSamples) override
+	{
+		auto poll = getPoll(deviceId);
+		if (!poll)
+		{
+			return 0;
+		}
+		int count = min(poll->numImuSamples, maxSamples);
+		copy_n(reinterpret_cast<const IMU_SAMPLE *>(poll + 1), count, samples);
+		return count;
+	}
+
+	chrono::steady_clock::time_point GetPollTime(int deviceId) override
+	{
+		return _start + chrono::microseconds(_timeUs);
+	}
+
+	std::string GetControllerGUID(int deviceId) override
+	{
+		auto device = _devices.find(deviceId);
+		return device != _devices.end() ? string(device->second.guid, strnlen(device->second.guid, sizeof(device->second.guid))) : "";
+	}
+
+	bool RemoveController(int handle) override
+	{
+		_polls.erase(handle);
+		return _devices.erase(handle) > 0;
+	}
+
+private:
+	const PollRecord *getPoll(int deviceId) const
+	{
+		auto poll = _polls.find(deviceId);
+		return poll != _polls.end() ? poll->second : nullptr;
+	}
+
+	// Call function with each complete record in order. Returns false if the file ends in the middle of a record.
+	template<typename F>
+	bool forEachRecord(F function) const
+	{
+		auto data = reinterpret_cast<const char *>(_data.data());
+		size_t offset = sizeof(FileHeader);
+		while (offset + sizeof(RecordHeader) <= _size)
+		{
+			auto record = reinterpret_cast<const RecordHeader *>(data + offset);
+			size_t end = offset + sizeof(RecordHeader) + record->size;
+			if (end > _size)
+			{
+				return false;
+			}
+			function(*record, data + offset + sizeof(RecordHeader));
+			offset += sizeof(RecordHeader) + paddedSize(record->size);
+		}
+		return offset >= _size;
+	}
+};
+
+// Virtual controller that writes what the mapping sends it to the replay output
+class CapturedGamepad : public Gamepad
+{
+	ReplayOutputLog &_log;
+	ControllerScheme _scheme;
+
+public:
+	CapturedGamepad(ReplayOutputLog &log, ControllerScheme scheme)
+	  : _log(log)
+	  , _scheme(scheme)
+	{
+	}
+
+	bool isInitialized(string *errorMsg = nullptr) const override
+	{
+		return true;
+	}
+
+	void setButton(KeyCode btn, bool pressed) override
+	{
+		if (auto out = _log.event())
+			*out << "PAD_BUTTON " << btn.name << (pressed ? " DOWN\n" : " UP\n");
+	}
+
+	void setLeftStick(float x, float y) override
+	{
+		setStick(x, y, true);
+	}
+
+	void setRightStick(float x, float y) override
+	{
+		setStick(x, y, false);
+	}
+
+	void setStick(float x, float y, bool isLeft) override
+	{
+		if (auto out = _log.event())
+			*out << (isLeft ? "PAD_LEFT_STICK " : "PAD_RIGHT_STICK ") << x << ' ' << y << '\n';
+	}
+
+	void setLeftTrigger(float value) override
+	{
+		if (auto out = _log.event())
+			*out << "PAD_LEFT_TRIGGER " << value << '\n';
+	}
+
+	void setRightTrigger(float value) override
+	{
+		if (auto out = _log.event())
+			*out << "PAD_RIGHT_TRIGGER " << value << '\n';
+	}
+
+	void setGyro(float accelX, float accelY, float accelZ, float gyroX, float gyroY, float gyroZ) override
+	{
+		if (auto out = _log.event())
+			*out << "PAD_MOTION " << accelX << ' ' << accelY << ' ' << accelZ << ' ' << gyroX << ' ' << gyroY << ' ' << gyroZ << '\n';
+	}
+
+	void setTouchState(optional<FloatXY> press1, optional<FloatXY> press2) override
+	{
+		if (auto out = _log.event())
+		{
+			*out << "PAD_TOUCH";
+			for (auto &press : { press1, press2 })
+			{
+				if (press)
+					*out << ' ' << press->x() << ' ' << press->y();
+				else
+					*out << " UP";
+			}
+			*out << '\n';
+		}
+	}
+
+	void update() override
+	{
+		if (auto out = _log.event())
+			*out << "PAD_UPDATE\n";
+	}
+
+	ControllerScheme getType() const override
+	{
+		return _scheme;
+	}
+};
+
+} // namespace
+
+JslRecorder *JslRecorder::getNew(shared_ptr<JslWrapper> device, const string &fileName)
+{
+	auto recorder = new JslRecorderImpl(device, fileName);
+	if (!recorder->isOpen())
+	{
+		delete recorder;
+		return nullptr;
+	}
+	return recorder;
+}
+
+JslReplay *JslReplay::getNew(const string &fileName)
+{
+	auto replay = new JslReplayImpl();
+	if (!replay->load(fileName))
+	{
+		delete replay;
+		return nullptr;
+	}
+	return replay;
+}
+
+ReplayOutputLog::ReplayOutputLog(const JslReplay &replay, ostream *out)
+  : _replay(replay)
+  , _out(out)
+{
+	if (_out)
+	{
+		_out->precision(9);
+	}
+}
+
+ostream *ReplayOutputLog::event()
+{
+	if (_out)
+	{
+		*_out << _replay.GetReplayTimeUs() << ' ';
+	}
+	return _out;
+}
+
+void ReplayOutputLog::pressMouse(uint16_t code, bool isPressed)
+{
+	if (auto out = event())
+		*out << "MOUSE " << code << (isPressed ? " DOWN\n" : " UP\n");
+}
+
+void ReplayOutputLog::pressKey(const KeyCode &key, bool pressed)
+{
+	if (auto out = event())
+		*out << "KEY " << key.name << (pressed ? " DOWN\n" : " UP\n");
+}
+
+void ReplayOutputLog::moveMouse(float x, float y)
+{
+	if (auto out = event())
+		*out << "MOVE " << x << ' ' << y << '\n';
+}
+
+void ReplayOutputLog::setMouseNorm(float x, float y)
+{
+	if (auto out = event())
+		*out << "MOUSE_NORM " << x << ' ' << y << '\n';
+}
+
+Gamepad *ReplayOutputLog::newGamepad(ControllerScheme scheme)
+{
+	return new CapturedGamepad(*this, scheme);
+}
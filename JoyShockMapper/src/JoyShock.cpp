@@ -143,6 +143,23 @@ void JoyShock::onVirtualControllerNotification(uint8_t largeMotor, uint8_t small
 }
 
 float JoyShock::getSetting(SettingID index)
+{
+	refreshResolvedSettings();
+	size_t slot = size_t(index);
+	if (slot < ResolvedSettings::SIZE && _resolved.hasFloat[slot])
+	{
+		return _resolved.floats[slot];
+	}
+	float value = resolveSetting(index);
+	if (slot < ResolvedSettings::SIZE)
+	{
+		_resolved.floats[slot] = value;
+		_resolved.hasFloat[slot] = true;
+	}
+	return value;
+}
+
+float JoyShock::resolveSetting(SettingID index)
 {
 	// Look at active chord mappings starting with the latest activates chord
 	for (auto activeChord = _context->chordStack.begin(); activeChord != _context->chordStack.end(); activeChord++)
@@ -179,12 +196,25 @@ float JoyShock::getSetting(SettingID index)
 template<>
 FloatXY JoyShock::getSetting<FloatXY>(SettingID index)
 {
+	refreshResolvedSettings();
+	size_t slot = size_t(index);
+	if (slot < ResolvedSettings::SIZE && _resolved.hasFloatXY[slot])
+	{
+		return _resolved.floatXYs[slot];
+	}
 	// Look at active chord mappings starting with the latest activates chord
 	for (auto activeChord = _context->chordStack.begin(); activeChord != _context->chordStack.end(); activeChord++)
 	{
 		optional<FloatXY> opt = getSettingAtChord<FloatXY>(index, *activeChord);
 		if (opt)
+		{
+			if (slot < ResolvedSettings::SIZE)
+			{
+				_resolved.floatXYs[slot] = *opt;
+				_resolved.hasFloatXY[slot] = true;
+			}
 			return *opt;
+		}
 	} // Check next Chord
 
 	stringstream ss;
@@ -343,19 +373,11 @@ DigitalButton *JoyShock::getMatchingDiagBtn(ButtonID index, optional<MapIterator
 
 void JoyShock::resetSmoothSample()
 {
-	_frontSample = 0;
-	for (int i = 0; i < NUM_SAMPLES; i++)
-	{
-		_flickSamples[i] = 0.0;
-	}
+	_flickSmoothing.reset();
 }
 
 float JoyShock::getSmoothedStickRotation(float value, float bottomThreshold, float topThreshold, int maxSamples)
 {
-	// which sample in the circular smoothing buffer do we want to write over?
-	_frontSample--;
-	if (_frontSample < 0)
-		_frontSample = NUM_SAMPLES - 1;
 	// if this input is bigger than the top threshold, it'll all be consumed immediately; 0 gets put into the smoothing buffer. If it's below the bottomThreshold, it'll all be put in the smoothing buffer
 	float length = abs(value);
 	float immediateFactor;
@@ -377,27 +399,15 @@ float JoyShock::getSmoothedStickRotation(float value, float bottomThreshold, flo
 		immediateFactor = 1.0f;
 	}
 	float smoothFactor = 1.0f - immediateFactor;
-	// now we can push the smooth sample (or as much of it as we want smoothed)
-	float frontSample = _flickSamples[_frontSample] = value * smoothFactor;
-	// and now calculate smoothed result
-	float result = frontSample / maxSamples;
-	for (int i = 1; i < maxSamples; i++)
-	{
-		int rotatedIndex = (_frontSample + i) % NUM_SAMPLES;
-		frontSample = _flickSamples[rotatedIndex];
-		result += frontSample / maxSamples;
-	}
+	// now we can push the smooth sample (or as much of it as we want smoothed) and get the smoothed result
+	float result = _flickSmoothing.push({ value * smoothFactor }, maxSamples)[0];
 	// finally, add immediate portion
 	return result + value * immediateFactor;
 }
 
 void JoyShock::getSmoothedGyro(float x, float y, float length, float bottomThreshold, float topThreshold, int maxSamples, float &outX, float &outY)
 {
-	// this is basically the same as we use for smoothing flick-stick rotations, but because this deals in vectors, it's a slightly different function. Not worth abstracting until it'll be used in more ways
-	// which item in the circular smoothing buffer will we write over?
-	_frontGyroSample--;
-	if (_frontGyroSample < 0)
-		_frontGyroSample = MAX_GYRO_SAMPLES - 1;
+	// this is basically the same as we use for smoothing flick-stick rotations, but because this deals in vectors, it's a slightly different function
 	float immediateFactor;
 	if (topThreshold <= bottomThreshold)
 	{
@@ -417,21 +427,72 @@ void JoyShock::getSmoothedGyro(float x, float y, float length, float bottomThres
 		immediateFactor = 1.0f;
 	}
 	float smoothFactor = 1.0f - immediateFactor;
-	// now we can push the smooth sample (or as much of it as we want smoothed)
-	FloatXY frontSample = _gyroSamples[_frontGyroSample] = { x * smoothFactor, y * smoothFactor };
-	// and now calculate smoothed result
-	float xResult = frontSample.x() / maxSamples;
-	float yResult = frontSample.y() / maxSamples;
-	for (int i = 1; i < maxSamples; i++)
-	{
-		int rotatedIndex = (_frontGyroSample + i) % MAX_GYRO_SAMPLES;
-		frontSample = _gyroSamples[rotatedIndex];
-		xResult += frontSample.x() / maxSamples;
-		yResult += frontSample.y() / maxSamples;
-	}
+	// now we can push the smooth sample (or as much of it as we want smoothed) and get the smoothed result.
+	// Both kernels are kept up to date so that switching between them doesn't jerk the output.
+	array<float, 2> smoothSample{ x * smoothFactor, y * smoothFactor };
+	auto boxResult = _gyroSmoothing.push(smoothSample, maxSamples);
+	auto exponentialResult = _gyroExponentialSmoothing.push(smoothSample, maxSamples);
+	auto result = getSetting<SmoothingKernel>(SettingID::GYRO_SMOOTH_KERNEL) == SmoothingKernel::EXPONENTIAL ? exponentialResult : boxResult;
 	// finally, add immediate portion
-	outX = xResult + x * immediateFactor;
-	outY = yResult + y * immediateFactor;
+	outX = result[0] + x * immediateFactor;
+	outY = result[1] + y * immediateFactor;
+}
+
+void JoyShock::getFilteredGyro(GyroFilter filter, float x, float y, float deltaTime, float &outX, float &outY)
+{
+	if (filter != _gyroFilter)
+	{
+		// Don't carry over the state of a filter from the last time it was used
+		_gyroOneEuro.reset();
+		_gyroLowPass.reset();
+		_gyroKalman.reset();
+		_gyroFilter = filter;
+	}
+	array<float, 2> sample{ x, y };
+	float cutoff = getSetting(SettingID::GYRO_FILTER_CUTOFF);
+	switch (filter)
+	{
+	case GyroFilter::ONE_EURO:
+		sample = _gyroOneEuro.push(sample, deltaTime, cutoff, getSetting(SettingID::GYRO_FILTER_BETA));
+		break;
+	case GyroFilter::LOW_PASS:
+		sample = _gyroLowPass.push(sample, deltaTime, cutoff);
+		break;
+	case GyroFilter::KALMAN:
+		sample = _gyroKalman.push(sample, deltaTime, cutoff, getSetting(SettingID::GYRO_FILTER_PREDICTION));
+		break;
+	default:
+		break;
+	}
+	outX = sample[0];
+	outY = sample[1];
+}
+
+float JoyShock::getSensorDeltaTime(uint64_t timestampUs, float fallbackDeltaTime)
+{
+	if (_lastSensorTimestampUs == 0 || timestampUs < _lastSensorTimestampUs)
+	{
+		// First report, or the device clock was reset
+		_lastSensorTimestampUs = timestampUs;
+		return fallbackDeltaTime;
+	}
+	uint64_t interval = timestampUs - _lastSensorTimestampUs;
+	if (interval == 0)
+	{
+		++_duplicateReports;
+		return 0.f;
+	}
+	if (_sensorPeriodUs == 0 || interval < _sensorPeriodUs)
+	{
+		_sensorPeriodUs = interval;
+	}
+	else if (interval > _sensorPeriodUs + _sensorPeriodUs / 2)
+	{
+		// Round to the nearest number of missed reports
+		_droppedReports += (interval + _sensorPeriodUs / 2) / _sensorPeriodUs - 1;
+	}
+	_lastSensorTimestampUs = timestampUs;
+	return float(interval) / 1000000.f;
 }
 
 void JoyShock::handleButtonChange(ButtonID id, bool pressed, int touchpadID)
@@ -446,7 +507,13 @@ void JoyShock::handleButtonChange(ButtonID id, bool pressed, int touchpadID)
 		CERR << "Button " << id << " with tocuchpadId " << touchpadID << " could not be found\n";
 		return;
 	}
-	else if ((!_context->nn && pressed) || (_context->nn > 0 && (id >= ButtonID::UP || id <= ButtonID::DOWN || id == ButtonID::S || id == ButtonID::E) && nnm.find(_context->nn) != nnm.end() && nnm.find(_context->nn)->second == id))
+	pressed = (!_context->nn && pressed) || (_context->nn > 0 && (id >= ButtonID::UP || id <= ButtonID::DOWN || id == ButtonID::S || id == ButtonID::E) && nnm.find(_context->nn) != nnm.end() && nnm.find(_context->nn)->second == id);
+	if (button->isIdle(pressed))
+	{
+		// Nothing to update until the input changes or a deadline of the button passes
+		return;
+	}
+	else if (pressed)
 	{
 		Pressed evt;
 		evt.time_now = _timeNow;
@@ -466,6 +533,59 @@ void JoyShock::handleButtonChange(ButtonID id, bool pressed, int touchpadID)
 	}
 }
 
+void JoyShock::setButtonMask(int buttons)
+{
+	// A due deadline or a new chord can change the state of a button whose input didn't change. So can the nn mode,
+	// which overrides the input.
+	auto revision = _context->chordStackRevision;
+	bool visitAll = _context->timers.anyDue() || revision != _buttonsChordStackRevision || _context->nn != _buttonsNn;
+	_changedButtons = visitAll ? ~0 : buttons ^ _buttonMask;
+	_buttonMask = buttons;
+	_buttonsChordStackRevision = revision;
+	_buttonsNn = _context->nn;
+}
+
+void JoyShock::handleButtons(initializer_list<pair<ButtonID, int>> buttons)
+{
+	for (auto [id, offset] : buttons)
+	{
+		// A trigger or a button handled since setButtonMask can have changed the chord stack or the nn mode. The
+		// revision seen by setButtonMask is kept, so that the next poll also visits the buttons handled before.
+		if (_context->chordStackRevision != _buttonsChordStackRevision || _context->nn != _buttonsNn)
+		{
+			_changedButtons = ~0;
+		}
+		if (_changedButtons & (1 << offset))
+		{
+			handleButtonChange(id, _buttonMask & (1 << offset));
+		}
+	}
+}
+
+void JoyShock::handleDueButtons(chrono::steady_clock::time_point now)
+{
+	_context->timers.advance(now);
+	if (!_context->timers.anyDue())
+	{
+		return;
+	}
+	for (auto &button : _buttons)
+	{
+		button.sendDueEvent(now);
+	}
+	for (auto &button : _gridButtons)
+	{
+		button.sendDueEvent(now);
+	}
+	for (auto &touchpad : _touchpads)
+	{
+		for (auto &[id, button] : touchpad.buttons)
+		{
+			button.sendDueEvent(now);
+		}
+	}
+}
+
 float JoyShock::getTriggerEffectStartPos()
 {
 	float threshold = getSetting(SettingID::TRIGGER_THRESHOLD);
@@ -762,7 +882,7 @@ bool JoyShock::isPressed(ButtonID btn)
 	// Use chord stack to know if a mapping is pressed, because the state from the callback
 	// only holds half the information when it comes to a joycon pair.
 	// Also, NONE is always part of the stack (for chord handling) but NONE is never pressed.
-	return btn != ButtonID::NONE && find(_context->chordStack.begin(), _context->chordStack.end(), btn) != _context->chordStack.end();
+	return btn != ButtonID::NONE && _context->chordStack.contains(btn);
 }
 
 // return true if it hits the outer deadzone
@@ -899,7 +1019,7 @@ float JoyShock::handleFlickStick(float stickX, float stickY, Stick &stick, float
 					stickAngle = 0.0f;
 				}
 
-				stick.started_flick = chrono::steady_clock::now();
+				stick.started_flick = _timeNow;
 				stick.delta_flick = stickAngle;
 				stick.flick_percent_done = 0.0f;
 				resetSmoothSample();
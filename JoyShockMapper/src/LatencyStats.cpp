@@ -0,0 +1,179 @@
+#include "LatencyStats.h"
+
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+// Log-linear buckets: exact below 16ns, then 8 per power of two, so that a bucket is never more than 12.5% wide
+constexpr int SUB_BUCKET_BITS = 3;
+constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+constexpr int MAX_EXPONENT = 40; // About 18 minutes. Anything longer goes to the last bucket.
+constexpr int BUCKETS = 2 * SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS;
+constexpr size_t STAGES = size_t(Stage::COUNT);
+
+int bucketOf(uint64_t ns)
+{
+	ns = min(ns, (uint64_t(1) << (MAX_EXPONENT + 1)) - 1);
+	if (ns < 2 * SUB_BUCKETS)
+	{
+		return int(ns);
+	}
+	int exponent = bit_width(ns) - 1;
+	int sub = int(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+	return 2 * SUB_BUCKETS + (exponent - SUB_BUCKET_BITS - 1) * SUB_BUCKETS + sub;
+}
+
+// Middle of the values counted in bucket
+uint64_t valueOf(int bucket)
+{
+	if (bucket < 2 * SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	int exponent = (bucket - 2 * SUB_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS + 1;
+	int sub = (bucket - 2 * SUB_BUCKETS) % SUB_BUCKETS;
+	uint64_t width = uint64_t(1) << (exponent - SUB_BUCKET_BITS);
+	return (SUB_BUCKETS + sub) * width + width / 2;
+}
+
+// Only written by the thread that owns it
+struct ThreadHistograms
+{
+	array<array<atomic<uint64_t>, BUCKETS>, STAGES> buckets;
+	array<atomic<int64_t>, STAGES> max;
+};
+
+mutex registryLock;
+// Kept after their thread ends, so that what it recorded still counts
+vector<shared_ptr<ThreadHistograms>> registry;
+
+ThreadHistograms &threadHistograms()
+{
+	thread_local shared_ptr<ThreadHistograms> histograms = []
+	{
+		auto created = make_shared<ThreadHistograms>();
+		lock_guard guard(registryLock);
+		registry.push_back(created);
+		return created;
+	}();
+	return *histograms;
+}
+
+float toMicroseconds(chrono::nanoseconds duration)
+{
+	return chrono::duration<float, micro>(duration).count();
+}
+} // namespace
+
+void LatencyStats::record(Stage stage, chrono::nanoseconds duration)
+{
+	auto &histograms = threadHistograms();
+	auto ns = std::max<int64_t>(duration.count(), 0);
+	histograms.buckets[size_t(stage)][bucketOf(ns)].fetch_add(1, memory_order_relaxed);
+	auto &max = histograms.max[size_t(stage)];
+	if (ns > max.load(memory_order_relaxed))
+	{
+		max.store(ns, memory_order_relaxed);
+	}
+}
+
+LatencyStats::Summaries LatencyStats::summarize()
+{
+	Summaries summaries;
+	lock_guard guard(registryLock);
+	for (size_t stage = 0; stage < STAGES; ++stage)
+	{
+		array<uint64_t, BUCKETS> counts{};
+		auto &summary = summaries[stage];
+		for (auto &histograms : registry)
+		{
+			for (int bucket = 0; bucket < BUCKETS; ++bucket)
+			{
+				counts[bucket] += histograms->buckets[stage][bucket].load(memory_order_relaxed);
+			}
+			summary.max = std::max(summary.max, chrono::nanoseconds(histograms->max[stage].load(memory_order_relaxed)));
+		}
+		for (auto count : counts)
+		{
+			summary.count += count;
+		}
+		// Value below which lies the given fraction of the samples. It can't be more than the largest one.
+		auto percentile = [&](double fraction)
+		{
+			auto rank = uint64_t(ceil(fraction * summary.count));
+			uint64_t seen = 0;
+			for (int bucket = 0; bucket < BUCKETS; ++bucket)
+			{
+				seen += counts[bucket];
+				if (seen >= rank)
+				{
+					return std::min(chrono::nanoseconds(valueOf(bucket)), summary.max);
+				}
+			}
+			return summary.max;
+		};
+		if (summary.count > 0)
+		{
+			summary.p50 = percentile(0.5);
+			summary.p99 = percentile(0.99);
+		}
+	}
+	return summaries;
+}
+
+void LatencyStats::reset()
+{
+	lock_guard guard(registryLock);
+	for (auto &histograms : registry)
+	{
+		for (size_t stage = 0; stage < STAGES; ++stage)
+		{
+			for (auto &bucket : histograms->buckets[stage])
+			{
+				bucket.store(0, memory_order_relaxed);
+			}
+			histograms->max[stage].store(0, memory_order_relaxed);
+		}
+	}
+}
+
+void LatencyStats::print(ostream &out, const Summaries &summaries)
+{
+	out << left << setw(14) << "Stage" << right << setw(10) << "Count" << setw(12) << "p50 (us)" << setw(12) << "p99 (us)" << setw(12) << "max (us)" << '\n';
+	out << fixed << setprecision(1);
+	for (size_t stage = 0; stage < STAGES; ++stage)
+	{
+		auto &summary = summaries[stage];
+		out << left << setw(14) << magic_enum::enum_name(Stage(stage)) << right << setw(10) << summary.count
+		    << setw(12) << toMicroseconds(summary.p50) << setw(12) << toMicroseconds(summary.p99) << setw(12) << toMicroseconds(summary.max) << '\n';
+	}
+	out << defaultfloat;
+}
+
+bool LatencyStats::append(const string &fileName, const Summaries &summaries)
+{
+	ofstream file(fileName, ios::app);
+	if (!file)
+	{
+		return false;
+	}
+	if (file.tellp() == 0)
+	{
+		file << "time,stage,count,p50_us,p99_us,max_us\n";
+	}
+	auto time = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+	file << fixed << setprecision(1);
+	for (size_t stage = 0; stage < STAGES; ++stage)
+	{
+		auto &summary = summaries[stage];
+		file << time << ',' << magic_enum::enum_name(Stage(stage)) << ',' << summary.count << ',' << toMicroseconds(summary.p50)
+		     << ',' << toMicroseconds(summary.p99) << ',' << toMicroseconds(summary.max) << '\n';
+	}
+	return bool(file);
+}
@@ -8,7 +8,8 @@ function<bool(string_view)> Mapping::_isCommandValid = function<bool(string_view
 
 ostream &operator<<(ostream &out, const Mapping &mapping)
 {
-	return out << (mapping._command.empty() ? mapping._description : mapping._command);
+	auto &compiled = mapping.compiled();
+	return out << (compiled.command.empty() ? compiled.description : compiled.command);
 }
 
 istream &operator>>(istream &in, Mapping &mapping)
@@ -20,7 +21,7 @@ istream &operator>>(istream &in, Mapping &mapping)
 	smatch results;
 	int count = 0;
 
-	mapping._command = valueName;
+	mapping.edit().command = valueName;
 	static constexpr string_view rgx = R"(\s*([!\^-]?)((\".*?\")|\w*[0-9A-Z]|\W)([\\\/+'_]?)\s*(.*))";
 	while (regex_match(valueName, results, regex(rgx.data())) && !results[0].str().empty())
 	{
@@ -99,11 +100,69 @@ Mapping::Mapping(string_view mapping)
 	}
 }
 
+void EventActionIf::Callback::operator()(EventActionIf *button) const
+{
+	switch (type)
+	{
+	case Type::BtnPress:
+		button->ApplyBtnPress(*key);
+		break;
+	case Type::BtnRelease:
+		button->ApplyBtnRelease(*key);
+		break;
+	case Type::GyroAction:
+		button->ApplyGyroAction(key);
+		break;
+	case Type::RemoveGyroAction:
+		button->RemoveGyroAction();
+		break;
+	case Type::Rumble:
+		button->SetRumble(smallRumble, bigRumble);
+		break;
+	case Type::StartCalibration:
+		button->StartCalibration();
+		break;
+	case Type::FinishCalibration:
+		button->FinishCalibration();
+		break;
+	case Type::Command:
+		WriteToConsole(key->name);
+		break;
+	case Type::None:
+		break;
+	}
+}
+
+const Mapping::Compiled &Mapping::compiled() const
+{
+	static const Compiled noInput;
+	return _compiled ? *_compiled : noInput;
+}
+
+Mapping::Compiled &Mapping::edit()
+{
+	if (!_compiled || _compiled.use_count() > 1)
+	{
+		_compiled = make_shared<Compiled>(compiled());
+	}
+	return *_compiled;
+}
+
+void Mapping::clear()
+{
+	auto &compiled = edit();
+	compiled.steps.clear();
+	compiled.eventStart.fill(0);
+	compiled.description.clear();
+	compiled.tapDurationMs = MAGIC_TAP_DURATION;
+	compiled.hasViGEmBtn = false;
+}
+
 void Mapping::ProcessEvent(BtnEvent evt, EventActionIf &button) const
 {
 	// COUT << button._id << " processes event " << evt << '\n';
-	auto entry = _eventMapping.find(evt);
-	if (entry != _eventMapping.end() && entry->second) // Skip over empty entries
+	auto &compiled = this->compiled();
+	if (evt < BtnEvent::INVALID && compiled.numSteps(evt) > 0) // Skip over empty entries
 	{
 		switch (evt)
 		{
@@ -125,42 +184,61 @@ void Mapping::ProcessEvent(BtnEvent evt, EventActionIf &button) const
 			break;
 		}
 
-		if (entry->second)
+		// DEBUG_LOG << button.getDisplayName() << " processes event " << evt << '\n';
+		auto end = compiled.steps.begin() + compiled.eventStart[size_t(evt) + 1];
+		for (auto step = compiled.steps.begin() + compiled.eventStart[size_t(evt)]; step != end; ++step)
 		{
-			// DEBUG_LOG << button.getDisplayName() << " processes event " << evt << '\n';
-			entry->second(&button);
+			switch (step->kind)
+			{
+			case Step::Kind::Run:
+				step->action(&button);
+				break;
+			case Step::Kind::Toggle:
+				button.ApplyButtonToggle(*step->action.key, step->action, step->release);
+				break;
+			case Step::Kind::Instant:
+				button.RegisterInstant(step->instantEvent, step->action);
+				break;
+			}
 		}
 	}
 }
 
-void Mapping::InsertEventMapping(BtnEvent evt, EventActionIf::Callback action)
+void Mapping::InsertEventMapping(BtnEvent evt, const Step &step)
 {
-	if (action)
+	if (step.action)
 	{
-		auto existingActions = _eventMapping.find(evt);
-		_eventMapping[evt] = existingActions == _eventMapping.end() ? action :
-		                                                              bind(&RunBothActions, placeholders::_1, existingActions->second, action); // Chain with already existing mapping, if any
+		// Run after the steps already bound to evt, if any
+		auto &compiled = edit();
+		compiled.steps.insert(compiled.steps.begin() + compiled.eventStart[size_t(evt) + 1], step);
+		for (size_t later = size_t(evt) + 1; later <= NUM_EVENTS; ++later)
+		{
+			++compiled.eventStart[later];
+		}
 	}
 }
 
 bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMod)
 {
-	EventActionIf::Callback apply, apply2, release;
+	typedef EventActionIf::Callback::Type Type;
+	EventActionIf::Callback apply, release;
 	if (key.code == 0)
 	{
 		return false;
 	}
+	auto &compiled = edit();
+	apply.key = release.key = make_shared<const KeyCode>(key);
 	if (key.code == CALIBRATE)
 	{
-		apply = bind(&EventActionIf::StartCalibration, placeholders::_1);
-		release = bind(&EventActionIf::FinishCalibration, placeholders::_1);
-		_tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
+		apply.type = Type::StartCalibration;
+		release.type = Type::FinishCalibration;
+		compiled.tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
 	}
 	else if (key.code >= GYRO_INV_X && key.code <= GYRO_TRACKBALL)
 	{
-		apply = bind(&EventActionIf::ApplyGyroAction, placeholders::_1, key);
-		release = bind(&EventActionIf::RemoveGyroAction, placeholders::_1);
-		_tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
+		apply.type = Type::GyroAction;
+		release.type = Type::RemoveGyroAction;
+		compiled.tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
 	}
 	else if (key.code == COMMAND_ACTION)
 	{
@@ -170,8 +248,8 @@ bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMo
 			COUT << "Error: \"" << key.name << "\" is not a valid command\n";
 			return false;
 		}
-		apply = bind(&WriteToConsole, key.name);
-		release = EventActionIf::Callback();
+		apply.type = Type::Command;
+		release.type = Type::None;
 	}
 	else if (key.code == RUMBLE)
 	{
@@ -181,15 +259,17 @@ bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMo
 			array<uint8_t, 2> bytes;
 		} rumble;
 		rumble.raw = stoi(key.name.substr(1, 4), nullptr, 16);
-		apply = bind(&EventActionIf::SetRumble, placeholders::_1, rumble.bytes[0] << 8, rumble.bytes[1] << 8);
-		release = bind(&EventActionIf::SetRumble, placeholders::_1, 0, 0);
-		_tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
+		apply.type = Type::Rumble;
+		apply.smallRumble = rumble.bytes[0] << 8;
+		apply.bigRumble = rumble.bytes[1] << 8;
+		release.type = Type::Rumble; // Stop rumbling
+		compiled.tapDurationMs = MAGIC_EXTENDED_TAP_DURATION; // Unused in regular press
 	}
 	else //
 	{
-		_hasViGEmBtn |= isControllerKey(key.code); // Set flag if vigem button
-		apply = bind(&EventActionIf::ApplyBtnPress, placeholders::_1, key);
-		release = bind(&EventActionIf::ApplyBtnRelease, placeholders::_1, key);
+		compiled.hasViGEmBtn |= isControllerKey(key.code); // Set flag if vigem button
+		apply.type = Type::BtnPress;
+		release.type = Type::BtnRelease;
 	}
 
 	BtnEvent applyEvt, releaseEvt;
@@ -220,20 +300,22 @@ bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMo
 		return false;
 	}
 
+	Step applyStep{ Step::Kind::Run, BtnEvent::INVALID, apply };
+	Step instantStep; // Registered right after applyStep runs
+	Step releaseStep{ Step::Kind::Run, BtnEvent::INVALID, release };
 	switch (actMod)
 	{
 	case ActionModifier::Toggle:
-		apply = bind(&EventActionIf::ApplyButtonToggle, placeholders::_1, key, apply, release);
-		release = nullptr;
+		applyStep = { Step::Kind::Toggle, BtnEvent::INVALID, apply, release };
+		releaseStep.action = {};
 		break;
 	case ActionModifier::Instant:
-		apply2 = bind(&EventActionIf::RegisterInstant, placeholders::_1, applyEvt, release);
-		apply = bind(&Mapping::RunBothActions, placeholders::_1, apply, apply2);
-		release = nullptr;
+		instantStep = { Step::Kind::Instant, applyEvt, release };
+		releaseStep.action = {};
 		break;
 	case ActionModifier::Release:
-		apply = release;
-		release = nullptr;
+		applyStep.action = release;
+		releaseStep.action = {};
 		break;
 	case ActionModifier::INVALID:
 		return false;
@@ -245,21 +327,28 @@ bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMo
 	{
 		if (actMod == ActionModifier::None) // Regular turbo holds key down and pulses up during the instant window
 		{
-			apply2 = bind(&EventActionIf::RegisterInstant, placeholders::_1, applyEvt, apply);// send key down on instant
-			apply = bind(&Mapping::RunBothActions, placeholders::_1, release, apply2); // send key up and register key down
+			applyStep.action = release;                                  // send key up
+			instantStep = { Step::Kind::Instant, applyEvt, apply }; // and register key down on instant
 		}
 		// else handled already in instant case above
 	}
 
-	InsertEventMapping(applyEvt, apply);
-	InsertEventMapping(releaseEvt, release);
+	InsertEventMapping(applyEvt, applyStep);
+	InsertEventMapping(applyEvt, instantStep);
+	InsertEventMapping(releaseEvt, releaseStep);
+
+	size_t numEvents = 0;
+	for (size_t evt = 0; evt < NUM_EVENTS; ++evt)
+	{
+		numEvents += compiled.numSteps(BtnEvent(evt)) > 0;
+	}
 
 	stringstream ss;
 	// Update Description
-	if (_description.compare("no input") != 0)
+	if (compiled.description.compare("no input") != 0)
 	{
-		ss << _description;
-		if (_eventMapping.size() > 2 && _eventMapping.find(BtnEvent::OnPress) != _eventMapping.end())
+		ss << compiled.description;
+		if (numEvents > 2 && compiled.numSteps(BtnEvent::OnPress) > 0)
 		{
 			ss << " on Start Press";
 		}
@@ -270,12 +359,12 @@ bool Mapping::AddMapping(KeyCode key, EventModifier evtMod, ActionModifier actMo
 		ss << actMod << " ";
 	}
 	ss << key.name;
-	if (_eventMapping.size() > 3 || evtMod != Mapping::EventModifier::StartPress)
+	if (numEvents > 3 || evtMod != Mapping::EventModifier::StartPress)
 	{
 		ss << " on " << evtMod;
 	}
 	// else don't display event modifier when using default binding on single key
-	_description = ss.str();
+	compiled.description = ss.str();
 	return true;
 }
 
@@ -286,9 +375,9 @@ bool Mapping::AppendToCommand(KeyCode key, EventModifier evtMod, ActionModifier
 		return false;
 	}
 	stringstream ss;
-	if (!_command.empty())
+	if (!command().empty())
 	{
-		ss << _command << " ";
+		ss << command() << " ";
 	}
 
 	if (actMod != ActionModifier::None)
@@ -305,14 +394,6 @@ bool Mapping::AppendToCommand(KeyCode key, EventModifier evtMod, ActionModifier
 		    evtMod == EventModifier::TapPress      ? '\'' :
 		 /* evtMod == EventModifier::HoldPress    */ '_'); 
 	}
-	_command = ss.str();
+	edit().command = ss.str();
 	return true;
 }
-
-void Mapping::RunBothActions(EventActionIf *btn, EventActionIf::Callback action1, EventActionIf::Callback action2)
-{
-	if (action1)
-		action1(btn);
-	if (action2)
-		action2(btn);
-}
@@ -0,0 +1,242 @@
+#include "OutputQueue.h"
+#include "InputHelpers.h"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Sends the output of all the queues to the OS, oldest first
+class OutputThread
+{
+public:
+	static OutputThread &get()
+	{
+		// Never destroyed: the thread may still be running when the program exits
+		static OutputThread *instance = new OutputThread();
+		return *instance;
+	}
+
+	void add(OutputQueue *queue)
+	{
+		lock_guard guard(_lock);
+		_queues.push_back(queue);
+	}
+
+	void remove(OutputQueue *queue)
+	{
+		lock_guard guard(_lock);
+		drain();
+		_queues.erase(find(_queues.begin(), _queues.end(), queue));
+	}
+
+	void wake()
+	{
+		call_once(_started, [this]
+		  {
+			  _running = true;
+			  thread(&OutputThread::run, this).detach();
+		  });
+		_signal.fetch_add(1, memory_order_release);
+		_signal.notify_one();
+	}
+
+	// Send what the queues hold from the calling thread, so that output bypassing them can't overtake it
+	void fence()
+	{
+		if (!_running.load(memory_order_acquire) || _sending)
+		{
+			return; // Nothing was ever queued, or this is the output being sent
+		}
+		lock_guard guard(_lock);
+		drain();
+	}
+
+private:
+	OutputThread() = default;
+
+	void run()
+	{
+		while (true)
+		{
+			auto seen = _signal.load(memory_order_acquire);
+			{
+				lock_guard guard(_lock);
+				drain();
+			}
+			_signal.wait(seen, memory_order_acquire);
+		}
+	}
+
+	// Send everything published so far as a single report
+	void drain()
+	{
+		OutputFrame outputFrame;
+		while (true)
+		{
+			OutputQueue *oldest = nullptr;
+			const OutputEvent *event = nullptr;
+			for (auto queue : _queues)
+			{
+				auto front = queue->front();
+				if (front && (!event || front->queuedTime < event->queuedTime))
+				{
+					oldest = queue;
+					event = front;
+				}
+			}
+			if (!oldest)
+			{
+				return;
+			}
+			_sending = true;
+			send(*event);
+			_sending = false;
+			auto latency = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - event->queuedTime).count();
+			oldest->_events.fetch_add(1, memory_order_relaxed);
+			oldest->_totalLatencyNs.fetch_add(latency, memory_order_relaxed);
+			if (latency > oldest->_maxLatencyNs.load(memory_order_relaxed))
+			{
+				oldest->_maxLatencyNs.store(latency, memory_order_relaxed);
+			}
+			oldest->pop();
+		}
+	}
+
+	static void send(const OutputEvent &event)
+	{
+		KeyCode key;
+		key.code = event.code;
+		switch (event.type)
+		{
+		case OutputEvent::Type::KEY:
+			pressKey(key, event.pressed);
+			break;
+		case OutputEvent::Type::MOUSE_BUTTON:
+			pressMouse(key, event.pressed);
+			break;
+		case OutputEvent::Type::MOVE:
+			moveMouse(event.x, event.y);
+			break;
+		case OutputEvent::Type::MOVE_ABSOLUTE:
+			setMouseNorm(event.x, event.y);
+			break;
+		}
+	}
+
+	mutex _lock; // Guards the list of queues and serialises the draining
+	vector<OutputQueue *> _queues;
+	atomic<uint32_t> _signal = 0;
+	once_flag _started;
+	atomic_bool _running = false;
+	static inline thread_local bool _sending = false; // The thread is sending a queued event
+};
+
+OutputQueue::Session::Session(OutputQueue &queue, bool enabled)
+  : _queue((enabled || _required > 0) && !_active ? &queue : nullptr)
+{
+	if (_queue)
+	{
+		_active = _queue;
+	}
+}
+
+OutputQueue::Session::~Session()
+{
+	if (_queue)
+	{
+		_active = nullptr;
+		_queue->publish();
+	}
+}
+
+OutputQueue::OutputQueue()
+{
+	OutputThread::get().add(this);
+}
+
+OutputQueue::~OutputQueue()
+{
+	OutputThread::get().remove(this);
+}
+
+bool OutputQueue::push(OutputEvent event)
+{
+	if (!_active)
+	{
+		// Output from outside a mapping callback, like commands, goes out right away but after what is queued
+		OutputThread::get().fence();
+		return false;
+	}
+	event.queuedTime = chrono::steady_clock::now();
+	_active->pushEvent(event);
+	return true;
+}
+
+void OutputQueue::pushEvent(const OutputEvent &event)
+{
+	if (_writeIndex - _head.load(memory_order_acquire) == CAPACITY)
+	{
+		// Let the output thread send what is there and wait for it to make room
+		++_stalls;
+		publish();
+		while (_writeIndex - _head.load(memory_order_acquire) == CAPACITY)
+		{
+			this_thread::yield();
+		}
+	}
+	_ring[_writeIndex % CAPACITY] = event;
+	++_writeIndex;
+}
+
+void OutputQueue::publish()
+{
+	if (_tail.load(memory_order_relaxed) == _writeIndex)
+	{
+		return;
+	}
+	_tail.store(_writeIndex, memory_order_release);
+	auto depth = _writeIndex - _head.load(memory_order_relaxed);
+	if (depth > _maxDepth.load(memory_order_relaxed))
+	{
+		_maxDepth.store(depth, memory_order_relaxed);
+	}
+	OutputThread::get().wake();
+}
+
+const OutputEvent *OutputQueue::front() const
+{
+	auto head = _head.load(memory_order_relaxed);
+	if (head == _tail.load(memory_order_acquire))
+	{
+		return nullptr;
+	}
+	return &_ring[head % CAPACITY];
+}
+
+void OutputQueue::pop()
+{
+	_head.store(_head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+OutputQueue::Metrics OutputQueue::metrics() const
+{
+	Metrics metrics;
+	auto head = _head.load(memory_order_acquire);
+	metrics.depth = _tail.load(memory_order_acquire) - head;
+	metrics.maxDepth = _maxDepth.load(memory_order_relaxed);
+	metrics.events = _events.load(memory_order_relaxed);
+	metrics.stalls = _stalls.load(memory_order_relaxed);
+	metrics.totalLatency = chrono::nanoseconds(_totalLatencyNs.load(memory_order_relaxed));
+	metrics.maxLatency = chrono::nanoseconds(_maxLatencyNs.load(memory_order_relaxed));
+	return metrics;
+}
+
+void OutputQueue::resetMetrics()
+{
+	_maxDepth = 0;
+	_events = 0;
+	_stalls = 0;
+	_totalLatencyNs = 0;
+	_maxLatencyNs = 0;
+}
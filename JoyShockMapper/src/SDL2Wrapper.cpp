@@ -3,8 +3,12 @@
 #include "JSMVariable.hpp"
  #include "TriggerEffectGenerator.h"
 #include "SettingsManager.h"
+#include "InputHelpers.h"
+#include "OutputQueue.h"
+#include "LatencyStats.h"
 #include "SDL.h"
 #include <map>
+#include <unordered_map>
 #include <mutex>
 #include <atomic>
 #define INCLUDE_MATH_DEFINES
@@ -13,6 +17,11 @@
 #include <memory>
 #include <iostream>
 #include <cstring>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+#include <type_traits>
 
 typedef struct
 {
@@ -39,11 +48,181 @@ typedef struct
 	Uint8 ucLedBlue;                  /* 46 */
 } DS5EffectsState_t;
 
+// Single writer sequence lock. Readers never block the writer: they retry when they overlap with a store.
+template<typename T>
+class SeqLock
+{
+public:
+	void store(const T &value)
+	{
+		auto seq = _seq.load(memory_order_relaxed);
+		_seq.store(seq + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		_value = value;
+		_seq.store(seq + 2, memory_order_release);
+	}
+
+	// Copy a consistent value into out
+	void load(T &out) const
+	{
+		unsigned int seq;
+		do
+		{
+			seq = _seq.load(memory_order_acquire);
+			out = _value;
+			atomic_thread_fence(memory_order_acquire);
+		} while ((seq & 1) != 0 || seq != _seq.load(memory_order_relaxed));
+	}
+
+	// Return the result of field applied to a consistent copy of the value
+	template<typename F>
+	invoke_result_t<F, const T &> read(F field) const
+	{
+		invoke_result_t<F, const T &> result;
+		unsigned int seq;
+		do
+		{
+			seq = _seq.load(memory_order_acquire);
+			result = field(_value);
+			atomic_thread_fence(memory_order_acquire);
+		} while ((seq & 1) != 0 || seq != _seq.load(memory_order_relaxed));
+		return result;
+	}
+
+private:
+	atomic<unsigned int> _seq = 0;
+	T _value;
+};
+
+// Input state of a controller, as captured by the polling thread
+struct ControllerSnapshot
+{
+	int buttons = 0;
+	array<float, SDL_CONTROLLER_AXIS_MAX> axes = {}; // Indexed by SDL_GameControllerAxis
+	IMU_STATE imu = {};
+	Uint64 imuTimestampUs = 0; // Sensor timestamp of imu, or 0 if the device provides none
+	TOUCH_STATE touch = {};
+	array<IMU_SAMPLE, MAX_IMU_SAMPLES> imuSamples; // Sensor reports received since the previous snapshot
+	int numImuSamples = 0;
+};
+
+// Snapshot of the device whose callbacks a thread runs
+struct CallbackSnapshot
+{
+	int handle = -1; // -1 when the thread runs none
+	ControllerSnapshot snapshot;
+};
+
+typedef array<uint8_t, 11> TriggerEffectBytes;
+
+// Effects whose bytes are the parameters themselves. Other modes, including ON which never reaches the controller, are
+// sent as no effect.
+constexpr TriggerEffectBytes encodeFixedTriggerEffect(AdaptiveTriggerMode mode, uint16_t start, uint16_t end, uint16_t force)
+{
+	switch (mode)
+	{
+	case AdaptiveTriggerMode::RESISTANCE_RAW:
+		return { uint8_t(mode), uint8_t(start), uint8_t(force) };
+	case AdaptiveTriggerMode::SEGMENT:
+		return { uint8_t(mode), uint8_t(start), uint8_t(end), uint8_t(force) };
+	default:
+		return { uint8_t(AdaptiveTriggerMode::OFF) };
+	}
+}
+
+constexpr TriggerEffectBytes NO_TRIGGER_EFFECT = encodeFixedTriggerEffect(AdaptiveTriggerMode::OFF, 0, 0, 0);
+
+// Bytes of the trigger effects encoded so far, so that a setting only goes through the generator the first time it is
+// seen. The effects of the analog triggers keep coming back to the same settings as the triggers move.
+class TriggerEffectCache
+{
+public:
+	static TriggerEffectBytes get(const AdaptiveTriggerSetting &effect)
+	{
+		switch (effect.mode)
+		{
+		case AdaptiveTriggerMode::RESISTANCE:
+		case AdaptiveTriggerMode::BOW:
+		case AdaptiveTriggerMode::GALLOPING:
+		case AdaptiveTriggerMode::SEMI_AUTOMATIC:
+		case AdaptiveTriggerMode::AUTOMATIC:
+		case AdaptiveTriggerMode::MACHINE:
+			break;
+		default:
+			// Cheaper than a lookup
+			return encodeFixedTriggerEffect(effect.mode, effect.start, effect.end, effect.force);
+		}
+		Key key{ uint16_t(effect.mode), effect.start, effect.end, effect.force, effect.frequency, effect.forceExtra, effect.frequencyExtra };
+		lock_guard guard(_lock);
+		auto found = _bytes.find(key);
+		if (found != _bytes.end())
+		{
+			return found->second;
+		}
+		if (_bytes.size() >= MAX_ENTRIES)
+		{
+			_bytes.clear();
+		}
+		return _bytes.emplace(key, encode(effect)).first->second;
+	}
+
+private:
+	typedef array<uint16_t, 7> Key;
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &key) const
+		{
+			size_t hash = 0;
+			for (auto field : key)
+			{
+				hash = hash * 31 + field;
+			}
+			return hash;
+		}
+	};
+
+	static TriggerEffectBytes encode(const AdaptiveTriggerSetting &effect)
+	{
+		using namespace ExtendInput::DataTools::DualSense;
+		TriggerEffectBytes bytes{ uint8_t(effect.mode) }; // What is left when the parameters are out of range
+		switch (effect.mode)
+		{
+		case AdaptiveTriggerMode::RESISTANCE:
+			TriggerEffectGenerator::Resistance(bytes.data(), 0, effect.start, effect.force);
+			break;
+		case AdaptiveTriggerMode::BOW:
+			TriggerEffectGenerator::Bow(bytes.data(), 0, effect.start, effect.end, effect.force, effect.forceExtra);
+			break;
+		case AdaptiveTriggerMode::GALLOPING:
+			TriggerEffectGenerator::Galloping(bytes.data(), 0, effect.start, effect.end, effect.force, effect.forceExtra, effect.frequency);
+			break;
+		case AdaptiveTriggerMode::SEMI_AUTOMATIC:
+			TriggerEffectGenerator::SemiAutomaticGun(bytes.data(), 0, effect.start, effect.end, effect.force);
+			break;
+		case AdaptiveTriggerMode::AUTOMATIC:
+			TriggerEffectGenerator::AutomaticGun(bytes.data(), 0, effect.start, effect.force, effect.frequency);
+			break;
+		case AdaptiveTriggerMode::MACHINE:
+			TriggerEffectGenerator::Machine(bytes.data(), 0, effect.start, effect.end, effect.force, effect.forceExtra, effect.frequency, effect.frequencyExtra);
+			break;
+		default:
+			break;
+		}
+		return bytes;
+	}
+
+	static constexpr size_t MAX_ENTRIES = 1024; // The trigger positions can make a lot of them, start over past that
+	static inline mutex _lock;
+	static inline unordered_map<Key, TriggerEffectBytes, KeyHash> _bytes;
+};
+
 struct ControllerDevice
 {
 	ControllerDevice(int id)
 	  : _has_accel(false)
 	  , _has_gyro(false)
+	  , _lastCallback(chrono::steady_clock::now())
 	{
 		_prevTouchState.t0Down = false;
 		_prevTouchState.t1Down = false;
@@ -61,6 +240,7 @@ struct ControllerDevice
 				}
 				else
 				{
+					_instanceId = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(_sdlController));
 					_has_gyro = SDL_GameControllerHasSensor(_sdlController, SDL_SENSOR_GYRO);
 					_has_accel = SDL_GameControllerHasSensor(_sdlController, SDL_SENSOR_ACCEL);
 
@@ -139,9 +319,12 @@ struct ControllerDevice
 		_micLight = 0;
 		memset(&_leftTriggerEffect, 0, sizeof(_leftTriggerEffect));
 		memset(&_rightTriggerEffect, 0, sizeof(_rightTriggerEffect));
+		_leftTriggerBytes = NO_TRIGGER_EFFECT;
+		_rightTriggerBytes = NO_TRIGGER_EFFECT;
 		_big_rumble = 0;
 		_small_rumble = 0;
 		SendEffect();
+		SendRumble(0.f);
 		SDL_GameControllerClose(_sdlController);
 	}
 
@@ -150,47 +333,246 @@ struct ControllerDevice
 		return _sdlController != nullptr;
 	}
 
+	// Returns the time in ms elapsed since the previous report was processed, and mark the latest one as processed.
+	// The hardware timestamp of the sensor report is used when available, otherwise the time of the previous callback.
+	float ConsumeReport(chrono::steady_clock::time_point now)
+	{
+		float deltaMs;
+		if (_reportTimestampUs != 0 && _lastTimestampUs != 0 && _reportTimestampUs > _lastTimestampUs)
+		{
+			deltaMs = float(_reportTimestampUs - _lastTimestampUs) / 1000.f;
+		}
+		else
+		{
+			deltaMs = chrono::duration<float, milli>(now - _lastCallback).count();
+		}
+		_lastTimestampUs = _reportTimestampUs;
+		_lastCallback = now;
+		_hasReport = false;
+		return deltaMs;
+	}
+
+	// Buffer the content of a sensor event. Gyro and accelerometer are reported separately but share the same timestamp.
+	void PushSensorData(int sensor, const float *data, uint64_t timestampUs)
+	{
+		static constexpr float toDegPerSec = float(180. / M_PI);
+		static constexpr float toGs = 1.f / 9.8f;
+		if (sensor == SDL_SENSOR_ACCEL)
+		{
+			_lastAccel = { data[0] * toGs, data[1] * toGs, data[2] * toGs };
+			if (_imuSampleCount > 0)
+			{
+				IMU_SAMPLE &latest = _imuSamples[(_imuSampleFront + _imuSampleCount - 1) % MAX_IMU_SAMPLES];
+				if (latest.timestampUs == timestampUs)
+				{
+					latest.imu.accelX = _lastAccel[0];
+					latest.imu.accelY = _lastAccel[1];
+					latest.imu.accelZ = _lastAccel[2];
+				}
+			}
+		}
+		else if (sensor == SDL_SENSOR_GYRO)
+		{
+			if (_imuSampleCount == MAX_IMU_SAMPLES)
+			{
+				// Overwrite the oldest sample
+				_imuSampleFront = (_imuSampleFront + 1) % MAX_IMU_SAMPLES;
+				--_imuSampleCount;
+			}
+			IMU_SAMPLE &sample = _imuSamples[(_imuSampleFront + _imuSampleCount) % MAX_IMU_SAMPLES];
+			++_imuSampleCount;
+			sample.imu.gyroX = data[0] * toDegPerSec;
+			sample.imu.gyroY = data[1] * toDegPerSec;
+			sample.imu.gyroZ = data[2] * toDegPerSec;
+			sample.imu.accelX = _lastAccel[0];
+			sample.imu.accelY = _lastAccel[1];
+			sample.imu.accelZ = _lastAccel[2];
+			sample.timestampUs = timestampUs;
+		}
+	}
+
+	int PopSensorData(IMU_SAMPLE *samples, int maxSamples)
+	{
+		int count = min(_imuSampleCount, maxSamples);
+		for (int i = 0; i < count; ++i)
+		{
+			samples[i] = _imuSamples[(_imuSampleFront + _imuSampleCount - count + i) % MAX_IMU_SAMPLES];
+		}
+		_imuSampleFront = 0;
+		_imuSampleCount = 0;
+		return count;
+	}
+
+	// Capture the current state of the controller for the mapping callbacks. Only the polling thread calls this.
+	void Publish()
+	{
+		ControllerSnapshot &snapshot = _nextSnapshot;
+		snapshot.buttons = ReadButtons();
+		for (int axis = 0; axis < SDL_CONTROLLER_AXIS_MAX; ++axis)
+		{
+			snapshot.axes[axis] = SDL_GameControllerGetAxis(_sdlController, SDL_GameControllerAxis(axis)) / (float)SDL_JOYSTICK_AXIS_MAX;
+		}
+		memset(&snapshot.imu, 0, sizeof(snapshot.imu));
+		if (_has_gyro)
+		{
+			array<float, 3> gyro;
+			SDL_GameControllerGetSensorDataWithTimestamp(_sdlController, SDL_SENSOR_GYRO, &snapshot.imuTimestampUs, &gyro[0], 3);
+			static constexpr float toDegPerSec = float(180. / M_PI);
+			snapshot.imu.gyroX = gyro[0] * toDegPerSec;
+			snapshot.imu.gyroY = gyro[1] * toDegPerSec;
+			snapshot.imu.gyroZ = gyro[2] * toDegPerSec;
+		}
+		if (_has_accel)
+		{
+			array<float, 3> accel;
+			SDL_GameControllerGetSensorData(_sdlController, SDL_SENSOR_ACCEL, &accel[0], 3);
+			static constexpr float toGs = 1.f / 9.8f;
+			snapshot.imu.accelX = accel[0] * toGs;
+			snapshot.imu.accelY = accel[1] * toGs;
+			snapshot.imu.accelZ = accel[2] * toGs;
+		}
+		uint8_t state0 = 0, state1 = 0;
+		memset(&snapshot.touch, 0, sizeof(snapshot.touch));
+		if (SDL_GameControllerGetTouchpadFinger(_sdlController, 0, 0, &state0, &snapshot.touch.t0X, &snapshot.touch.t0Y, nullptr) == 0 &&
+		  SDL_GameControllerGetTouchpadFinger(_sdlController, 0, 1, &state1, &snapshot.touch.t1X, &snapshot.touch.t1Y, nullptr) == 0)
+		{
+			snapshot.touch.t0Down = state0 == SDL_PRESSED;
+			snapshot.touch.t1Down = state1 == SDL_PRESSED;
+		}
+		snapshot.numImuSamples = PopSensorData(snapshot.imuSamples.data(), MAX_IMU_SAMPLES);
+		_snapshot.store(snapshot);
+	}
+
 private:
-	void LoadTriggerEffect(uint8_t *rgucTriggerEffect, const AdaptiveTriggerSetting *trigger_effect)
+	int ReadButtons()
 	{
-		using namespace ExtendInput::DataTools::DualSense;
-		//ExtendInput::DataTools::DualSense::TriggerEffectGenerator::Bow(rgucTriggerEffect, 0, 0, 5, 3, 8);
-		//ExtendInput::DataTools::DualSense::TriggerEffectGenerator::Galloping(rgucTriggerEffect, 0, 0, 9, 3, 5, 3);
-		rgucTriggerEffect[0] = (uint8_t)trigger_effect->mode;
-		switch (trigger_effect->mode)
+		static const map<int, int> sdl2jsl = {
+			{ SDL_CONTROLLER_BUTTON_A, JSOFFSET_S },
+			{ SDL_CONTROLLER_BUTTON_B, JSOFFSET_E },
+			{ SDL_CONTROLLER_BUTTON_X, JSOFFSET_W },
+			{ SDL_CONTROLLER_BUTTON_Y, JSOFFSET_N },
+			{ SDL_CONTROLLER_BUTTON_BACK, JSOFFSET_MINUS },
+			{ SDL_CONTROLLER_BUTTON_GUIDE, JSOFFSET_HOME },
+			{ SDL_CONTROLLER_BUTTON_START, JSOFFSET_PLUS },
+			{ SDL_CONTROLLER_BUTTON_LEFTSTICK, JSOFFSET_LCLICK },
+			{ SDL_CONTROLLER_BUTTON_RIGHTSTICK, JSOFFSET_RCLICK },
+			{ SDL_CONTROLLER_BUTTON_LEFTSHOULDER, JSOFFSET_L },
+			{ SDL_CONTROLLER_BUTTON_RIGHTSHOULDER, JSOFFSET_R },
+			{ SDL_CONTROLLER_BUTTON_DPAD_UP, JSOFFSET_UP },
+			{ SDL_CONTROLLER_BUTTON_DPAD_DOWN, JSOFFSET_DOWN },
+			{ SDL_CONTROLLER_BUTTON_DPAD_LEFT, JSOFFSET_LEFT },
+			{ SDL_CONTROLLER_BUTTON_DPAD_RIGHT, JSOFFSET_RIGHT }
+		};
+
+		int buttons = 0;
+		for (auto pair : sdl2jsl)
 		{
-        case AdaptiveTriggerMode::RESISTANCE_RAW:
-			TriggerEffectGenerator::SimpleResistance(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->force);
-			break;
-		case AdaptiveTriggerMode::SEGMENT:
-			rgucTriggerEffect[1] = trigger_effect->start;
-			rgucTriggerEffect[2] = trigger_effect->end;
-			rgucTriggerEffect[3] = trigger_effect->force;
-			break;
-		case AdaptiveTriggerMode::RESISTANCE:
-			TriggerEffectGenerator::Resistance(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->force);
-			break;
-		case AdaptiveTriggerMode::BOW:
-			TriggerEffectGenerator::Bow(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->end, trigger_effect->force, trigger_effect->forceExtra);
-			break;
-		case AdaptiveTriggerMode::GALLOPING:
-			TriggerEffectGenerator::Galloping(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->end, trigger_effect->force, trigger_effect->forceExtra, trigger_effect->frequency);
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_GameControllerButton(pair.first)) > 0 ? 1 << pair.second : 0;
+
+		}
+		switch (_ctrlr_type)
+		{
+		case JS_TYPE_JOYCON_LEFT:
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_SR : 0;
 			break;
-	    case AdaptiveTriggerMode::SEMI_AUTOMATIC:
-			TriggerEffectGenerator::SemiAutomaticGun(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->end, trigger_effect->force);
+		case JS_TYPE_JOYCON_RIGHT:
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_SR : 0;
 			break;
-		case AdaptiveTriggerMode::AUTOMATIC:
-			TriggerEffectGenerator::AutomaticGun(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->force, trigger_effect->frequency);
+		case JS_TYPE_DS:
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_MIC : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SR : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNR : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_FNL : 0;
+			// Intentional fall through to the next case
+		case JS_TYPE_DS4:
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_TOUCHPAD) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_SR : 0;
 			break;
-		case AdaptiveTriggerMode::MACHINE:
-			TriggerEffectGenerator::Machine(rgucTriggerEffect, 0, trigger_effect->start, trigger_effect->end, trigger_effect->force, trigger_effect->forceExtra, trigger_effect->frequency, trigger_effect->frequencyExtra);
+		case JS_TYPE_PRO_CONTROLLER:
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SR : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNR : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_FNL : 0;
 			break;
 		default:
-			rgucTriggerEffect[0] = 0x05; // no effect
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNL : 0;
+			buttons |= SDL_GameControllerGetButton(_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_FNR : 0;
+			break;
 		}
+		return buttons;
 	}
 
 public:
+	// Send the rumble when it changes. While it lasts, it is sent again every RUMBLE_REFRESH for a little longer than
+	// that, so that it still stops on its own if the mapping stops.
+	void SendRumble(float tickTime)
+	{
+		if (_ctrlr_type == JS_TYPE_DS)
+		{
+			// It goes with the effect packet, where it lasts until the next one
+			if (_small_rumble != _sentSmallRumble || _big_rumble != _sentBigRumble)
+			{
+				_sentSmallRumble = _small_rumble;
+				_sentBigRumble = _big_rumble;
+				ScheduleEffect(RUMBLE_CHANGE);
+			}
+			return;
+		}
+		auto now = chrono::steady_clock::now();
+		bool active = _small_rumble != 0 || _big_rumble != 0;
+		if (_small_rumble != _sentSmallRumble || _big_rumble != _sentBigRumble || (active && now - _rumbleSentTime >= RUMBLE_REFRESH))
+		{
+			Uint32 duration = active ? Uint32(RUMBLE_REFRESH.count() + tickTime + 5) : 0;
+			SDL_GameControllerRumble(_sdlController, _big_rumble, _small_rumble, duration);
+			_sentSmallRumble = _small_rumble;
+			_sentBigRumble = _big_rumble;
+			_rumbleSentTime = now;
+		}
+	}
+
+	// Record a change to send with the next effect packet of a DualSense
+	void ScheduleEffect(uint8_t change)
+	{
+		if (_ctrlr_type == JS_TYPE_DS)
+		{
+			_pendingEffects |= change;
+			++_pendingChanges;
+		}
+	}
+
+	// Send the changes scheduled so far in a single effect packet, at most packetRate times a second so that the
+	// output doesn't hold back the input reports. Rumble and trigger changes go out as soon as the budget allows.
+	// A light change alone waits a few more periods for one to go out with.
+	void FlushEffects(chrono::steady_clock::time_point now, float packetRate)
+	{
+		if (_pendingEffects == 0)
+		{
+			return;
+		}
+		chrono::duration<float> period{ packetRate > 0.f ? 1.f / packetRate : 0.f };
+		if (_pendingEffects == LIGHT_CHANGE)
+		{
+			period *= LIGHT_DELAY_PERIODS;
+		}
+		if (now - _effectSentTime < period)
+		{
+			return;
+		}
+		SendEffect();
+		_effectSentTime = now;
+		++_effectPacketsSent;
+		_effectChangesCoalesced += _pendingChanges - 1;
+		_pendingEffects = 0;
+		_pendingChanges = 0;
+	}
+
 	void SendEffect()
 	{
 		if (_ctrlr_type == JS_TYPE_DS)
@@ -200,8 +582,8 @@ public:
 
 			// Add adaptive trigger data
 			effectPacket.ucEnableBits1 |= 0x08 | 0x04; // Enable left and right trigger effect respectively
-			LoadTriggerEffect(effectPacket.rgucLeftTriggerEffect, &_leftTriggerEffect);
-			LoadTriggerEffect(effectPacket.rgucRightTriggerEffect, &_rightTriggerEffect);
+			memcpy(effectPacket.rgucLeftTriggerEffect, _leftTriggerBytes.data(), _leftTriggerBytes.size());
+			memcpy(effectPacket.rgucRightTriggerEffect, _rightTriggerBytes.data(), _rightTriggerBytes.size());
 
 			// Add current rumbling data
 			effectPacket.ucEnableBits1 |= 0x01 | 0x02;
@@ -212,6 +594,15 @@ public:
 			effectPacket.ucEnableBits2 |= 0x01;      /* Enable microphone light */
 			effectPacket.ucMicLightMode = _micLight; /* Bitmask, 0x00 = off, 0x01 = solid, 0x02 = pulse */
 
+			// Add current light bar colour
+			if (_lightColour >= 0)
+			{
+				effectPacket.ucEnableBits2 |= 0x04; /* Enable LED color */
+				effectPacket.ucLedRed = (_lightColour >> 16) & 0xFF;
+				effectPacket.ucLedGreen = (_lightColour >> 8) & 0xFF;
+				effectPacket.ucLedBlue = _lightColour & 0xFF;
+			}
+
 			// Send to controller
 			SDL_GameControllerSendEffect(_sdlController, &effectPacket, sizeof(effectPacket));
 		}
@@ -225,9 +616,45 @@ public:
 	uint16_t _big_rumble = 0;
 	AdaptiveTriggerSetting _leftTriggerEffect;
 	AdaptiveTriggerSetting _rightTriggerEffect;
+	TriggerEffectBytes _leftTriggerBytes = NO_TRIGGER_EFFECT; // Encoded when the effect changes
+	TriggerEffectBytes _rightTriggerBytes = NO_TRIGGER_EFFECT;
 	uint8_t _micLight = 0;
+	// Output last sent to the controller, so that a value set again every tick doesn't take the bandwidth of the
+	// input reports
+	uint16_t _sentSmallRumble = 0;
+	uint16_t _sentBigRumble = 0;
+	chrono::steady_clock::time_point _rumbleSentTime;
+	int _lightColour = -1;
+	int _playerNumber = -1;
+	static constexpr chrono::milliseconds RUMBLE_REFRESH{ 250 };
+	// Effect packet scheduling of a DualSense
+	enum EffectChange : uint8_t
+	{
+		RUMBLE_CHANGE = 1,
+		TRIGGER_CHANGE = 2,
+		LIGHT_CHANGE = 4, // Light bar and mic light
+	};
+	static constexpr float LIGHT_DELAY_PERIODS = 4.f;
+	uint8_t _pendingEffects = 0; // EffectChange bits not sent yet
+	uint64_t _pendingChanges = 0;
+	chrono::steady_clock::time_point _effectSentTime;
+	uint64_t _effectPacketsSent = 0;
+	uint64_t _effectChangesCoalesced = 0; // Changes that went out with another one in the same packet
 	SDL_GameController *_sdlController = nullptr;
 	TOUCH_STATE _prevTouchState;
+	SDL_JoystickID _instanceId = -1;
+	bool _hasReport = false;         // An event from this controller arrived since the last callback
+	uint64_t _reportTimestampUs = 0; // Sensor timestamp of the latest report, or 0 if the device provides none
+	uint64_t _lastTimestampUs = 0;   // Sensor timestamp of the last report processed
+	uint64_t _eventTimestampUs = 0;  // Time at which the last gyro event was processed, for devices without sensor timestamps
+	array<IMU_SAMPLE, MAX_IMU_SAMPLES> _imuSamples; // Ring buffer of sensor reports not yet processed
+	int _imuSampleFront = 0;
+	int _imuSampleCount = 0;
+	array<float, 3> _lastAccel = { 0.f, 0.f, 0.f };
+	chrono::steady_clock::time_point _lastCallback;
+	SeqLock<ControllerSnapshot> _snapshot; // Published state read by the mapping callbacks
+	mutex _effectLock;                     // Guards the rumble, lights, trigger effect and mic light when mapping runs in parallel
+	ControllerSnapshot _nextSnapshot;      // Scratch space of Publish()
 };
 
 struct SdlInstance : public JslWrapper
@@ -250,6 +677,15 @@ public:
 
 	virtual ~SdlInstance()
 	{
+		{
+			lock_guard guard(_jobLock);
+			_stopWorkers = true;
+		}
+		_jobStart.notify_all();
+		for (auto &worker : _workers)
+		{
+			worker.join();
+		}
 		SDL_Quit();
 	}
 
@@ -258,39 +694,317 @@ public:
 		while (keep_polling)
 		{
 			auto tick_time = SettingsManager::get<float>(SettingID::TICK_TIME)->value();
+			if (SettingsManager::getV<Switch>(SettingID::EVENT_POLLING)->value() == Switch::ON)
+			{
+				pollEvents(tick_time);
+				continue;
+			}
 			SDL_Delay(Uint32(tick_time));
 
+			{
+				lock_guard guard(controller_lock);
+				StageTimer readTimer(Stage::DEVICE_READ);
+				SDL_GameControllerUpdate();
+				SDL_Event evt;
+				while (SDL_PeepEvents(&evt, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT) > 0)
+				{
+					processEvent(evt);
+				}
+				for (auto iter = _controllerMap.begin(); iter != _controllerMap.end(); ++iter)
+				{
+					iter->second->Publish();
+					_pendingCallbacks.push_back({ iter->first, iter->second, tick_time });
+				}
+			}
+			dispatchCallbacks();
+		}
+
+		return 1;
+	}
+
+	// Wake up as soon as any controller sends a report, and run the callbacks once for each controller that did.
+	// Controllers that don't push any event are still processed every TICK_TIME.
+	void pollEvents(float tick_time)
+	{
+		SDL_Event evt;
+		bool hasEvent = SDL_WaitEventTimeout(&evt, int(ceilf(tick_time))) == 1;
+
+		{
 			lock_guard guard(controller_lock);
-			SDL_GameControllerUpdate();
+			StageTimer readTimer(Stage::DEVICE_READ);
+			for (; hasEvent; hasEvent = SDL_PollEvent(&evt) == 1)
+			{
+				processEvent(evt);
+			}
+			auto now = chrono::steady_clock::now();
 			for (auto iter = _controllerMap.begin(); iter != _controllerMap.end(); ++iter)
 			{
-				if (g_callback)
+				auto &device = iter->second;
+				if (device->_hasReport || chrono::duration<float, milli>(now - device->_lastCallback).count() >= tick_time)
+				{
+					device->Publish();
+					_pendingCallbacks.push_back({ iter->first, device, device->ConsumeReport(now) });
+				}
+			}
+		}
+		dispatchCallbacks();
+	}
+
+	// Run the callbacks of the controllers published by the last poll. controller_lock is not held here: the callbacks
+	// only read the published snapshots, so connecting or querying devices doesn't stall the input.
+	void dispatchCallbacks()
+	{
+		lock_guard guard(callback_lock);
+		// All the controllers of a poll share one report per virtual device
+		OutputFrame outputFrame;
+		if (_pendingCallbacks.size() > 1 && SettingsManager::getV<Switch>(SettingID::PARALLEL_MAPPING)->value() == Switch::ON)
+		{
+			dispatchParallel();
+		}
+		else
+		{
+			for (auto &pending : _pendingCallbacks)
+			{
+				processController(pending.handle, *pending.device, pending.deltaTime);
+			}
+		}
+		// Devices disconnected in the meantime are released here
+		_pendingCallbacks.clear();
+	}
+
+	// Share the callbacks between the polling thread and the worker threads, and wait for all of them to return.
+	// Merged Joy-Cons share a context whose lock serialises their callbacks. The keyboard and mouse output of each
+	// callback goes through the queue of its controller, so the output thread sends it as soon as the callback returns.
+	void dispatchParallel()
+	{
+		size_t numJobs = _pendingCallbacks.size();
+		size_t maxWorkers = max(thread::hardware_concurrency(), 2u) - 1;
+		while (_workers.size() < min(numJobs - 1, maxWorkers))
+		{
+			_workers.emplace_back(&SdlInstance::workerLoop, this);
+		}
+		unsigned int generation;
+		{
+			lock_guard guard(_jobLock);
+			generation = ++_jobGeneration;
+			_numJobs = numJobs;
+			_jobsLeft = numJobs;
+			_nextJob = uint64_t(generation) << 32;
+		}
+		_jobStart.notify_all();
+		runJobs(generation);
+		{
+			unique_lock lock(_jobLock);
+			_jobDone.wait(lock, [this] { return _jobsLeft == 0; });
+		}
+	}
+
+	// Run the jobs of the dispatch of this generation until none are left to claim
+	void runJobs(unsigned int generation)
+	{
+		while (true)
+		{
+			uint64_t next = _nextJob.load();
+			size_t job;
+			do
+			{
+				if (uint32_t(next >> 32) != generation)
 				{
-					JOY_SHOCK_STATE dummy1;
-					IMU_STATE dummy2;
-					memset(&dummy1, 0, sizeof(dummy1));
-					memset(&dummy2, 0, sizeof(dummy2));
-					g_callback(iter->first, dummy1, dummy1, dummy2, dummy2, tick_time);
+					return; // A worker late for its dispatch doesn't touch the next one
 				}
-				if (g_touch_callback)
+				job = size_t(uint32_t(next));
+				if (job >= _numJobs)
 				{
-					TOUCH_STATE touch = GetTouchState(iter->first, false);
-					g_touch_callback(iter->first, touch, iter->second->_prevTouchState, tick_time);
-					iter->second->_prevTouchState = touch;
+					return;
 				}
-				// Perform rumble
-				SDL_GameControllerRumble(iter->second->_sdlController, iter->second->_big_rumble, iter->second->_small_rumble, Uint32(tick_time + 5));
+			} while (!_nextJob.compare_exchange_weak(next, next + 1));
+			auto &pending = _pendingCallbacks[job];
+			OutputQueue::Required outputQueue;
+			processController(pending.handle, *pending.device, pending.deltaTime);
+			if (--_jobsLeft == 0)
+			{
+				lock_guard guard(_jobLock);
+				_jobDone.notify_all();
 			}
 		}
+	}
 
-		return 1;
+	void workerLoop()
+	{
+		unsigned int generation = 0;
+		while (true)
+		{
+			{
+				unique_lock lock(_jobLock);
+				_jobStart.wait(lock, [&] { return _stopWorkers || _jobGeneration != generation; });
+				if (_stopWorkers)
+				{
+					return;
+				}
+				generation = _jobGeneration;
+			}
+			runJobs(generation);
+		}
 	}
 
-	map<int, ControllerDevice *> _controllerMap;
+	// Flag the controller the event comes from as having a new report to process
+	void processEvent(const SDL_Event &evt)
+	{
+		ControllerDevice *device = nullptr;
+		switch (evt.type)
+		{
+		case SDL_CONTROLLERSENSORUPDATE:
+			device = findDevice(evt.csensor.which);
+			if (device)
+			{
+				uint64_t timestampUs = evt.csensor.timestamp_us;
+				if (timestampUs != 0)
+				{
+					device->_reportTimestampUs = timestampUs;
+				}
+				else
+				{
+					// Fall back on the time the event is processed: the event time is in milliseconds, which several
+					// reports can share. The accelerometer is merged into the gyro sample of the same report.
+					if (evt.csensor.sensor == SDL_SENSOR_GYRO)
+					{
+						device->_eventTimestampUs = max(performanceCounterUs(), device->_eventTimestampUs + 1);
+					}
+					timestampUs = device->_eventTimestampUs;
+				}
+				device->PushSensorData(evt.csensor.sensor, evt.csensor.data, timestampUs);
+			}
+			break;
+		case SDL_CONTROLLERAXISMOTION:
+			device = findDevice(evt.caxis.which);
+			break;
+		case SDL_CONTROLLERBUTTONDOWN:
+		case SDL_CONTROLLERBUTTONUP:
+			device = findDevice(evt.cbutton.which);
+			break;
+		case SDL_CONTROLLERTOUCHPADDOWN:
+		case SDL_CONTROLLERTOUCHPADMOTION:
+		case SDL_CONTROLLERTOUCHPADUP:
+			device = findDevice(evt.ctouchpad.which);
+			break;
+		default:
+			break;
+		}
+		if (device)
+		{
+			device->_hasReport = true;
+		}
+	}
+
+	static uint64_t performanceCounterUs()
+	{
+		static const uint64_t frequency = SDL_GetPerformanceFrequency();
+		uint64_t counter = SDL_GetPerformanceCounter();
+		return counter / frequency * 1000000 + counter % frequency * 1000000 / frequency;
+	}
+
+	ControllerDevice *findDevice(SDL_JoystickID instanceId)
+	{
+		for (auto iter = _controllerMap.begin(); iter != _controllerMap.end(); ++iter)
+		{
+			if (iter->second->_instanceId == instanceId)
+			{
+				return iter->second.get();
+			}
+		}
+		return nullptr;
+	}
+
+	// Access to a connected device without controller_lock. The atomic shared_ptr is not lock free, but its lock is only
+	// held while the pointer is copied. The device stays alive as long as the returned pointer is held.
+	shared_ptr<ControllerDevice> getDevice(int deviceId)
+	{
+		auto devices = _devices.load();
+		auto it = devices->find(deviceId);
+		return it != devices->end() ? it->second : nullptr;
+	}
+
+	// Within the callbacks of a device, the getters all read the snapshot taken for them, so that they see the same report
+	template<typename F>
+	invoke_result_t<F, const ControllerSnapshot &> readSnapshot(int deviceId, F field)
+	{
+		if (_callbackSnapshot.handle == deviceId)
+		{
+			return field(_callbackSnapshot.snapshot);
+		}
+		auto device = getDevice(deviceId);
+		return device ? device->_snapshot.read(field) : invoke_result_t<F, const ControllerSnapshot &>{};
+	}
+
+	// Make the changes to _controllerMap visible to getDevice(). Call with controller_lock held.
+	void publishDevices()
+	{
+		_devices.store(make_shared<const DeviceMap>(_controllerMap));
+	}
+
+	// Run the mapping callbacks on a controller. deltaTime is the time in ms since its last report.
+	void processController(int handle, ControllerDevice &device, float deltaTime)
+	{
+		auto begin = Trace::enabled() ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+		// The polling thread can publish the next report while the callbacks run
+		device._snapshot.load(_callbackSnapshot.snapshot);
+		_callbackSnapshot.handle = handle;
+		if (g_callback)
+		{
+			JOY_SHOCK_STATE dummy1;
+			IMU_STATE dummy2;
+			memset(&dummy1, 0, sizeof(dummy1));
+			memset(&dummy2, 0, sizeof(dummy2));
+			g_callback(handle, dummy1, dummy1, dummy2, dummy2, deltaTime);
+		}
+		if (g_touch_callback)
+		{
+			TOUCH_STATE touch = _callbackSnapshot.snapshot.touch;
+			g_touch_callback(handle, touch, device._prevTouchState, deltaTime);
+			device._prevTouchState = touch;
+		}
+		_callbackSnapshot.handle = -1;
+		// Perform rumble
+		auto tick_time = SettingsManager::get<float>(SettingID::TICK_TIME)->value();
+		auto output_report_rate = SettingsManager::getV<float>(SettingID::OUTPUT_REPORT_RATE)->value();
+		lock_guard guard(device._effectLock);
+		device.SendRumble(tick_time);
+		device.FlushEffects(chrono::steady_clock::now(), output_report_rate);
+		if (Trace::enabled() && begin != chrono::steady_clock::time_point())
+		{
+			Trace::complete("Device " + to_string(handle), "report", begin, chrono::steady_clock::now());
+		}
+	}
+
+	static inline thread_local CallbackSnapshot _callbackSnapshot;
+
+	struct PendingCallback
+	{
+		int handle;
+		shared_ptr<ControllerDevice> device;
+		float deltaTime;
+	};
+
+	typedef map<int, shared_ptr<ControllerDevice>> DeviceMap;
+	DeviceMap _controllerMap; // Guarded by controller_lock
+	atomic<shared_ptr<const DeviceMap>> _devices = make_shared<const DeviceMap>(); // Read only copy of _controllerMap
+	vector<PendingCallback> _pendingCallbacks; // Only used by the polling thread
 	void (*g_callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float) = nullptr;
 	void (*g_touch_callback)(int, TOUCH_STATE, TOUCH_STATE, float) = nullptr;
 	atomic_bool keep_polling = false;
-	mutex controller_lock;
+	mutex controller_lock; // Guards the SDL device list and event queue
+	mutex callback_lock;   // Held while the callbacks run
+
+	// Parallel mapping workers
+	vector<thread> _workers;
+	mutex _jobLock;
+	condition_variable _jobStart;
+	condition_variable _jobDone;
+	unsigned int _jobGeneration = 0;
+	bool _stopWorkers = false;
+	atomic<size_t> _numJobs = 0;
+	atomic<uint64_t> _nextJob = 0; // Generation of the dispatch in the high half, next job to claim in the low half
+	atomic<size_t> _jobsLeft = 0;
 
 	int ConnectDevices() override
 	{
@@ -319,15 +1033,10 @@ public:
 	int GetConnectedDeviceHandles(int *deviceHandleArray, int size) override
 	{
 		lock_guard guard(controller_lock);
-		auto iter = _controllerMap.begin();
-		while (iter != _controllerMap.end())
-		{
-			delete iter->second;
-			iter = _controllerMap.erase(iter);
-		}
+		_controllerMap.clear();
 		for (int i = 0; i < size; i++)
 		{
-			ControllerDevice *device = new ControllerDevice(i);
+			auto device = make_shared<ControllerDevice>(i);
 			if (device->isValid())
 			{
 				deviceHandleArray[i] = i + 1;
@@ -336,24 +1045,22 @@ public:
 			else
 			{
                 deviceHandleArray[i] = -1;
-				delete device;
 			}
 		}
+		publishDevices();
 		return int(_controllerMap.size());
 	}
 
 	void DisconnectAndDisposeAll() override
 	{
+		// Wait for the callbacks in flight to return before the caller disposes of its own controller data
+		lock_guard callbackGuard(callback_lock);
 		lock_guard guard(controller_lock);
 		keep_polling = false;
 		g_callback = nullptr;
 		g_touch_callback = nullptr;
-		auto iter = _controllerMap.begin();
-		while (iter != _controllerMap.end())
-		{
-			delete iter->second;
-			iter = _controllerMap.erase(iter);
-		}
+		_controllerMap.clear();
+		publishDevices();
 		SDL_Delay(200);
 	}
 
@@ -364,27 +1071,7 @@ public:
 
 	IMU_STATE GetIMUState(int deviceId) override
 	{
-		IMU_STATE imuState;
-		memset(&imuState, 0, sizeof(imuState));
-		if (_controllerMap[deviceId]->_has_gyro)
-		{
-			array<float, 3> gyro;
-			SDL_GameControllerGetSensorData(_controllerMap[deviceId]->_sdlController, SDL_SENSOR_GYRO, &gyro[0], 3);
-			static constexpr float toDegPerSec = float(180. / M_PI);
-			imuState.gyroX = gyro[0] * toDegPerSec;
-			imuState.gyroY = gyro[1] * toDegPerSec;
-			imuState.gyroZ = gyro[2] * toDegPerSec;
-		}
-		if (_controllerMap[deviceId]->_has_accel)
-		{
-			array<float, 3> accel;
-			SDL_GameControllerGetSensorData(_controllerMap[deviceId]->_sdlController, SDL_SENSOR_ACCEL, &accel[0], 3);
-			static constexpr float toGs = 1.f / 9.8f;
-			imuState.accelX = accel[0] * toGs;
-			imuState.accelY = accel[1] * toGs;
-			imuState.accelZ = accel[2] * toGs;
-		}
-		return imuState;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu; });
 	}
 
 	MOTION_STATE GetMotionState(int deviceId) override
@@ -394,25 +1081,16 @@ public:
 
 	TOUCH_STATE GetTouchState(int deviceId, bool previous) override
 	{
-		uint8_t state0 = 0, state1 = 0;
-		TOUCH_STATE state;
-		memset(&state, 0, sizeof(TOUCH_STATE));
-		if( SDL_GameControllerGetTouchpadFinger(_controllerMap[deviceId]->_sdlController, 0, 0, &state0, &state.t0X, &state.t0Y, nullptr) == 0 && 
-			SDL_GameControllerGetTouchpadFinger(_controllerMap[deviceId]->_sdlController, 0, 1, &state1, &state.t1X, &state.t1Y, nullptr) == 0 )
-		{
-			state.t0Down = state0 == SDL_PRESSED;
-			state.t1Down = state1 == SDL_PRESSED;
-		}
-		return state;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.touch; });
 	}
 
 	bool GetTouchpadDimension(int deviceId, int &sizeX, int &sizeY) override
 	{
 		// I am assuming a single touchpad (or all _touchpads are the same dimension)?
-		auto *jc = _controllerMap[deviceId];
+		auto jc = getDevice(deviceId);
 		if (jc != nullptr)
 		{
-			switch (_controllerMap[deviceId]->_ctrlr_type)
+			switch (jc->_ctrlr_type)
 			{
 			case JS_TYPE_DS4:
 			case JS_TYPE_DS:
@@ -432,142 +1110,67 @@ public:
 
 	int GetButtons(int deviceId) override
 	{
-		static const map<int, int> sdl2jsl = {
-			{ SDL_CONTROLLER_BUTTON_A, JSOFFSET_S },
-			{ SDL_CONTROLLER_BUTTON_B, JSOFFSET_E },
-			{ SDL_CONTROLLER_BUTTON_X, JSOFFSET_W },
-			{ SDL_CONTROLLER_BUTTON_Y, JSOFFSET_N },
-			{ SDL_CONTROLLER_BUTTON_BACK, JSOFFSET_MINUS },
-			{ SDL_CONTROLLER_BUTTON_GUIDE, JSOFFSET_HOME },
-			{ SDL_CONTROLLER_BUTTON_START, JSOFFSET_PLUS },
-			{ SDL_CONTROLLER_BUTTON_LEFTSTICK, JSOFFSET_LCLICK },
-			{ SDL_CONTROLLER_BUTTON_RIGHTSTICK, JSOFFSET_RCLICK },
-			{ SDL_CONTROLLER_BUTTON_LEFTSHOULDER, JSOFFSET_L },
-			{ SDL_CONTROLLER_BUTTON_RIGHTSHOULDER, JSOFFSET_R },
-			{ SDL_CONTROLLER_BUTTON_DPAD_UP, JSOFFSET_UP },
-			{ SDL_CONTROLLER_BUTTON_DPAD_DOWN, JSOFFSET_DOWN },
-			{ SDL_CONTROLLER_BUTTON_DPAD_LEFT, JSOFFSET_LEFT },
-			{ SDL_CONTROLLER_BUTTON_DPAD_RIGHT, JSOFFSET_RIGHT }
-		};
-
-		int buttons = 0;
-		for (auto pair : sdl2jsl)
-		{
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_GameControllerButton(pair.first)) > 0 ? 1 << pair.second : 0;
-
-		}
-		switch (_controllerMap[deviceId]->_ctrlr_type)
-		{
-		case JS_TYPE_JOYCON_LEFT:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_SR : 0;
-			break;
-		case JS_TYPE_JOYCON_RIGHT:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_SR : 0;
-			break;
-		case JS_TYPE_DS:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_MIC : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SR : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNR : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_FNL : 0;
-			// Intentional fall through to the next case
-		case JS_TYPE_DS4:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_TOUCHPAD) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_SR : 0;
-			break;
-		case JS_TYPE_PRO_CONTROLLER:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_SR : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE2) > 0 ? 1 << JSOFFSET_SL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNR : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE4) > 0 ? 1 << JSOFFSET_FNL : 0;
-			break;
-		default:
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_MISC1) > 0 ? 1 << JSOFFSET_CAPTURE : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE3) > 0 ? 1 << JSOFFSET_FNL : 0;
-			buttons |= SDL_GameControllerGetButton(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_BUTTON_PADDLE1) > 0 ? 1 << JSOFFSET_FNR : 0;
-			break;
-		}
-		return buttons;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.buttons; });
 	}
 
 	float GetLeftX(int deviceId) override
 	{
-		return SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_LEFTX) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_LEFTX]; });
 	}
 
 	float GetLeftY(int deviceId) override
 	{
-		return -SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_LEFTY) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return -readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_LEFTY]; });
 	}
 
 	float GetRightX(int deviceId) override
 	{
-		return SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_RIGHTX) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_RIGHTX]; });
 	}
 
 	float GetRightY(int deviceId) override
 	{
-		return -SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_RIGHTY) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return -readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_RIGHTY]; });
 	}
 
 	float GetLeftTrigger(int deviceId) override
 	{
-		return SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_TRIGGERLEFT) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_TRIGGERLEFT]; });
 	}
 
 	float GetRightTrigger(int deviceId) override
 	{
-		return SDL_GameControllerGetAxis(_controllerMap[deviceId]->_sdlController, SDL_CONTROLLER_AXIS_TRIGGERRIGHT) / (float)SDL_JOYSTICK_AXIS_MAX;
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.axes[SDL_CONTROLLER_AXIS_TRIGGERRIGHT]; });
 	}
 
 	float GetGyroX(int deviceId) override
 	{
-		if (_controllerMap[deviceId]->_has_gyro)
-		{
-			float rawGyro[3];
-			SDL_GameControllerGetSensorData(_controllerMap[deviceId]->_sdlController, SDL_SENSOR_GYRO, rawGyro, 3);
-		}
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.gyroX; });
 	}
 
 	float GetGyroY(int deviceId) override
 	{
-		if (_controllerMap[deviceId]->_has_gyro)
-		{
-			float rawGyro[3];
-			SDL_GameControllerGetSensorData(_controllerMap[deviceId]->_sdlController, SDL_SENSOR_GYRO, rawGyro, 3);
-		}
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.gyroY; });
 	}
 
 	float GetGyroZ(int deviceId) override
 	{
-		if (_controllerMap[deviceId]->_has_gyro)
-		{
-			float rawGyro[3];
-			SDL_GameControllerGetSensorData(_controllerMap[deviceId]->_sdlController, SDL_SENSOR_GYRO, rawGyro, 3);
-		}
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.gyroZ; });
 	}
 
 	float GetAccelX(int deviceId) override
 	{
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.accelX; });
 	}
 
 	float GetAccelY(int deviceId) override
 	{
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.accelY; });
 	}
 
 	float GetAccelZ(int deviceId) override
 	{
-		return float();
+		return readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imu.accelZ; });
 	}
 
 	int GetTouchId(int deviceId, bool secondTouch = false) override
@@ -577,32 +1180,20 @@ public:
 
 	bool GetTouchDown(int deviceId, bool secondTouch)
 	{
-		uint8_t touchState = 0;
-		if (SDL_GameControllerGetTouchpadFinger(_controllerMap[deviceId]->_sdlController, 0, secondTouch ? 1 : 0, &touchState, nullptr, nullptr, nullptr) == 0)
-		{
-			return touchState == SDL_PRESSED;
-		}
-		return false;
+		TOUCH_STATE touch = GetTouchState(deviceId, false);
+		return secondTouch ? touch.t1Down : touch.t0Down;
 	}
 
 	float GetTouchX(int deviceId, bool secondTouch = false) override
 	{
-		float x = 0;
-		if (SDL_GameControllerGetTouchpadFinger(_controllerMap[deviceId]->_sdlController, 0, secondTouch ? 1 : 0, nullptr, nullptr, &x, nullptr) == 0)
-		{
-			return x;
-		}
-		return x;
+		TOUCH_STATE touch = GetTouchState(deviceId, false);
+		return secondTouch ? touch.t1X : touch.t0X;
 	}
 
 	float GetTouchY(int deviceId, bool secondTouch = false) override
 	{
-		float y = 0;
-		if (SDL_GameControllerGetTouchpadFinger(_controllerMap[deviceId]->_sdlController, 0, secondTouch ? 1 : 0, nullptr, nullptr, &y, nullptr) == 0)
-		{
-			return y;
-		}
-		return y;
+		TOUCH_STATE touch = GetTouchState(deviceId, false);
+		return secondTouch ? touch.t1Y : touch.t0Y;
 	}
 
 	float GetStickStep(int deviceId) override
@@ -642,24 +1233,26 @@ public:
 
 	void SetCallback(void (*callback)(int, JOY_SHOCK_STATE, JOY_SHOCK_STATE, IMU_STATE, IMU_STATE, float)) override
 	{
-		lock_guard guard(controller_lock);
+		lock_guard guard(callback_lock);
 		g_callback = callback;
 	}
 
 	void SetTouchCallback(void (*callback)(int, TOUCH_STATE, TOUCH_STATE, float)) override
 	{
-		lock_guard guard(controller_lock);
+		lock_guard guard(callback_lock);
 		g_touch_callback = callback;
 	}
 
 	int GetControllerType(int deviceId) override
 	{
-		return _controllerMap[deviceId]->_ctrlr_type;
+		auto device = getDevice(deviceId);
+		return device ? device->_ctrlr_type : 0;
 	}
 
 	int GetControllerSplitType(int deviceId) override
 	{
-		return _controllerMap[deviceId]->_split_type;
+		auto device = getDevice(deviceId);
+		return device ? device->_split_type : JS_SPLIT_TYPE_FULL;
 	}
 
 	int GetControllerColour(int deviceId) override
@@ -669,64 +1262,140 @@ public:
 
 	void SetLightColour(int deviceId, int colour) override
 	{
-		if (SDL_GameControllerHasLED(_controllerMap[deviceId]->_sdlController))
+		auto device = getDevice(deviceId);
+		if (!device)
 		{
+			return;
+		}
+		lock_guard guard(device->_effectLock);
+		if (colour != device->_lightColour && SDL_GameControllerHasLED(device->_sdlController))
+		{
+			device->_lightColour = colour;
+			if (device->_ctrlr_type == JS_TYPE_DS)
+			{
+				device->ScheduleEffect(ControllerDevice::LIGHT_CHANGE);
+				return;
+			}
 			union
 			{
 				uint32_t raw;
 				uint8_t argb[4];
 			} uColour;
 			uColour.raw = colour;
-			SDL_GameControllerSetLED(_controllerMap[deviceId]->_sdlController, uColour.argb[2], uColour.argb[1], uColour.argb[0]);
+			SDL_GameControllerSetLED(device->_sdlController, uColour.argb[2], uColour.argb[1], uColour.argb[0]);
 		}
 	}
 
 	void SetRumble(int deviceId, int smallRumble, int bigRumble) override
 	{
-		// sendRumble command needs to be sent at every poll in SDL, so the next value is set here and the actual call
-		// is done after the callback return
-		_controllerMap[deviceId]->_small_rumble = clamp(smallRumble, 0, int(UINT16_MAX));
-		_controllerMap[deviceId]->_big_rumble = clamp(bigRumble, 0, int(UINT16_MAX));
+		// The next value is set here and sent after the callback returns, if it changed
+		if (auto device = getDevice(deviceId))
+		{
+			lock_guard guard(device->_effectLock);
+			device->_small_rumble = clamp(smallRumble, 0, int(UINT16_MAX));
+			device->_big_rumble = clamp(bigRumble, 0, int(UINT16_MAX));
+		}
 	}
 
 	void SetPlayerNumber(int deviceId, int number) override
 	{
-		SDL_GameControllerSetPlayerIndex(_controllerMap[deviceId]->_sdlController, number);
+		if (auto device = getDevice(deviceId))
+		{
+			lock_guard guard(device->_effectLock);
+			if (number != device->_playerNumber)
+			{
+				device->_playerNumber = number;
+				SDL_GameControllerSetPlayerIndex(device->_sdlController, number);
+			}
+		}
 	}
 
 	void SetTriggerEffect(int deviceId, const AdaptiveTriggerSetting &_leftTriggerEffect, const AdaptiveTriggerSetting &_rightTriggerEffect) override
 	{
-		if (_leftTriggerEffect != _controllerMap[deviceId]->_leftTriggerEffect || _rightTriggerEffect != _controllerMap[deviceId]->_rightTriggerEffect)
+		auto device = getDevice(deviceId);
+		if (!device)
+		{
+			return;
+		}
+		lock_guard guard(device->_effectLock);
+		if (_leftTriggerEffect != device->_leftTriggerEffect || _rightTriggerEffect != device->_rightTriggerEffect)
 		{
 			// Update active trigger effect
-			_controllerMap[deviceId]->_leftTriggerEffect = _leftTriggerEffect;
-			_controllerMap[deviceId]->_rightTriggerEffect = _rightTriggerEffect;
+			if (_leftTriggerEffect != device->_leftTriggerEffect)
+			{
+				device->_leftTriggerEffect = _leftTriggerEffect;
+				device->_leftTriggerBytes = TriggerEffectCache::get(_leftTriggerEffect);
+			}
+			if (_rightTriggerEffect != device->_rightTriggerEffect)
+			{
+				device->_rightTriggerEffect = _rightTriggerEffect;
+				device->_rightTriggerBytes = TriggerEffectCache::get(_rightTriggerEffect);
+			}
 
-			_controllerMap[deviceId]->SendEffect();
+			device->ScheduleEffect(ControllerDevice::TRIGGER_CHANGE);
 		}
 	}
 
 	virtual void SetMicLight(int deviceId, uint8_t mode) override
 	{
-		if (mode != _controllerMap[deviceId]->_micLight)
+		auto device = getDevice(deviceId);
+		if (!device)
 		{
-			_controllerMap[deviceId]->_micLight = mode;
+			return;
+		}
+		lock_guard guard(device->_effectLock);
+		if (mode != device->_micLight)
+		{
+			device->_micLight = mode;
 
-			_controllerMap[deviceId]->SendEffect();
+			device->ScheduleEffect(ControllerDevice::LIGHT_CHANGE);
 		}
 	}
 
-	std::string GetControllerGUID(int deviceId) override
+	bool GetOutputReportStats(int deviceId, uint64_t &sent, uint64_t &coalesced) override
 	{
-		std::lock_guard<std::mutex> lock(controller_lock);
+		auto device = getDevice(deviceId);
+		if (!device || device->_ctrlr_type != JS_TYPE_DS)
+		{
+			return false;
+		}
+		lock_guard guard(device->_effectLock);
+		sent = exchange(device->_effectPacketsSent, 0);
+		coalesced = exchange(device->_effectChangesCoalesced, 0);
+		return true;
+	}
 
-		auto it = _controllerMap.find(deviceId);
-		if (it == _controllerMap.end() || !it->second->_sdlController)
+	// Returns the sensor reports published with the latest snapshot of the device
+	int GetIMUSamples(int deviceId, IMU_SAMPLE *samples, int maxSamples) override
+	{
+		return readSnapshot(deviceId, [samples, maxSamples](const ControllerSnapshot &snapshot)
+		  {
+			  int count = min(snapshot.numImuSamples, maxSamples);
+			  copy_n(snapshot.imuSamples.begin(), count, samples);
+			  return count;
+		  });
+	}
+
+	bool GetIMUTimestamp(int deviceId, uint64_t &timestampUs) override
+	{
+		Uint64 imuTimestampUs = readSnapshot(deviceId, [](const ControllerSnapshot &snapshot) { return snapshot.imuTimestampUs; });
+		if (imuTimestampUs != 0)
+		{
+			timestampUs = imuTimestampUs;
+			return true;
+		}
+		return false;
+	}
+
+	std::string GetControllerGUID(int deviceId) override
+	{
+		auto device = getDevice(deviceId);
+		if (!device || !device->_sdlController)
 		{
 			return "";
 		}
 
-		SDL_Joystick *joystick = SDL_GameControllerGetJoystick(it->second->_sdlController);
+		SDL_Joystick *joystick = SDL_GameControllerGetJoystick(device->_sdlController);
 		if (!joystick)
 		{
 			return "";
@@ -740,11 +1409,10 @@ public:
 
 	bool RemoveController(int handle) override
 	{
-		auto it = _controllerMap.find(handle);
-		if (it != _controllerMap.end())
+		lock_guard guard(controller_lock);
+		if (_controllerMap.erase(handle) > 0)
 		{
-			delete it->second;
-			_controllerMap.erase(it);
+			publishDevices();
 			return true;
 		}
 		return false;
@@ -0,0 +1,173 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel()
+  : _origin(Clock::now())
+  , _now(_origin)
+{
+}
+
+uint32_t TimerWheel::add()
+{
+	_deadlines.push_back(Clock::time_point::max());
+	_due.push_back(false);
+	return uint32_t(_deadlines.size() - 1);
+}
+
+uint64_t TimerWheel::tickOf(Clock::time_point time) const
+{
+	return uint64_t(chrono::duration_cast<chrono::milliseconds>(time - _origin).count());
+}
+
+void TimerWheel::schedule(uint32_t timer, Clock::time_point deadline)
+{
+	if (_deadlines[timer] == deadline)
+	{
+		return;
+	}
+	cancel(timer);
+	if (deadline <= _now)
+	{
+		setDue(timer, true);
+		return;
+	}
+	_deadlines[timer] = deadline;
+	++_pending;
+	place({ timer, deadline });
+	if (_earliest.size() >= 2 * _deadlines.size() + SLOTS)
+	{
+		// Too many entries were left behind: start over from the deadlines
+		_earliest.clear();
+		for (uint32_t other = 0; other < _deadlines.size(); ++other)
+		{
+			if (_deadlines[other] != Clock::time_point::max())
+			{
+				_earliest.push_back({ other, _deadlines[other] });
+			}
+		}
+		make_heap(_earliest.begin(), _earliest.end(), &isLater);
+	}
+	else
+	{
+		_earliest.push_back({ timer, deadline });
+		push_heap(_earliest.begin(), _earliest.end(), &isLater);
+	}
+}
+
+void TimerWheel::cancel(uint32_t timer)
+{
+	if (_deadlines[timer] != Clock::time_point::max())
+	{
+		_deadlines[timer] = Clock::time_point::max();
+		--_pending;
+	}
+	setDue(timer, false);
+}
+
+void TimerWheel::place(const Entry &entry)
+{
+	auto tick = tickOf(entry.deadline);
+	if (tick <= _tick)
+	{
+		_soon.push_back(entry);
+		return;
+	}
+	auto distance = tick - _tick;
+	for (int level = 0; level < LEVELS; ++level)
+	{
+		auto shift = level * SLOT_BITS;
+		if (distance < SLOTS << shift || level == LEVELS - 1)
+		{
+			// Too far for the last level: wait in its farthest slot and be placed again from there
+			auto slotTick = distance < SLOTS << shift ? tick : _tick + (SLOTS << shift) - 1;
+			_slots[level][(slotTick >> shift) & (SLOTS - 1)].push_back(entry);
+			return;
+		}
+	}
+}
+
+void TimerWheel::expire(uint32_t timer)
+{
+	_deadlines[timer] = Clock::time_point::max();
+	--_pending;
+	setDue(timer, true);
+}
+
+void TimerWheel::setDue(uint32_t timer, bool due)
+{
+	if (_due[timer] != due)
+	{
+		_due[timer] = due;
+		due ? ++_dueCount : --_dueCount;
+	}
+}
+
+void TimerWheel::advance(Clock::time_point now)
+{
+	if (now <= _now)
+	{
+		return;
+	}
+	_now = now;
+	auto target = tickOf(now);
+	while (_tick < target && _pending > 0)
+	{
+		++_tick;
+		// Cascade the coarser levels first, so that their timers can drop all the way to this tick's slot
+		for (int level = LEVELS - 1; level > 0; --level)
+		{
+			auto shift = level * SLOT_BITS;
+			if ((_tick & ((uint64_t(1) << shift) - 1)) == 0)
+			{
+				auto entries = move(_slots[level][(_tick >> shift) & (SLOTS - 1)]);
+				_slots[level][(_tick >> shift) & (SLOTS - 1)].clear();
+				for (auto &entry : entries)
+				{
+					if (isCurrent(entry))
+					{
+						place(entry);
+					}
+				}
+			}
+		}
+		auto &slot = _slots[0][_tick & (SLOTS - 1)];
+		_soon.insert(_soon.end(), slot.begin(), slot.end());
+		slot.clear();
+	}
+	// Nothing is left to find on the way
+	_tick = target;
+
+	auto soon = move(_soon);
+	_soon.clear();
+	for (auto &entry : soon)
+	{
+		if (!isCurrent(entry))
+		{
+			continue;
+		}
+		if (entry.deadline <= _now)
+		{
+			expire(entry.timer);
+		}
+		else
+		{
+			_soon.push_back(entry);
+		}
+	}
+}
+
+TimerWheel::Clock::time_point TimerWheel::nextDeadline() const
+{
+	if (_pending == 0)
+	{
+		_earliest.clear();
+		return Clock::time_point::max();
+	}
+	while (!isCurrent(_earliest.front()))
+	{
+		pop_heap(_earliest.begin(), _earliest.end(), &isLater);
+		_earliest.pop_back();
+	}
+	return _earliest.front().deadline;
+}
@@ -0,0 +1,194 @@
+#include "Trace.h"
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+// A thread writes out its events once they take this many bytes
+constexpr size_t FLUSH_SIZE = 64 * 1024;
+
+struct ThreadBuffer
+{
+	mutex lock; // Only contended when the trace starts or stops
+	string events;
+	int tid = 0;
+};
+
+// Timestamps count from here
+const auto origin = chrono::steady_clock::now();
+
+mutex registryLock;
+vector<shared_ptr<ThreadBuffer>> registry;
+
+mutex fileLock;
+ofstream file;
+string traceFileName;
+
+ThreadBuffer &threadBuffer()
+{
+	thread_local shared_ptr<ThreadBuffer> buffer = []
+	{
+		auto created = make_shared<ThreadBuffer>();
+		lock_guard guard(registryLock);
+		registry.push_back(created);
+		created->tid = int(registry.size());
+		return created;
+	}();
+	return *buffer;
+}
+
+void writeOut(const string &events)
+{
+	lock_guard guard(fileLock);
+	if (file.is_open())
+	{
+		file << events;
+	}
+}
+
+// Take the events of every thread, and optionally write them out
+void collect(bool write)
+{
+	vector<shared_ptr<ThreadBuffer>> buffers;
+	{
+		lock_guard guard(registryLock);
+		buffers = registry;
+	}
+	for (auto &buffer : buffers)
+	{
+		string events;
+		{
+			lock_guard guard(buffer->lock);
+			events.swap(buffer->events);
+		}
+		if (write)
+		{
+			writeOut(events);
+		}
+	}
+}
+
+void appendEscaped(string &out, string_view text)
+{
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (uint8_t(c) < 0x20)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+}
+
+void appendMicroseconds(string &out, chrono::steady_clock::duration duration)
+{
+	char number[32];
+	snprintf(number, sizeof(number), "%.3f", chrono::duration<double, micro>(duration).count());
+	out += number;
+}
+
+// Every event is preceded by a comma: the file starts with the process name, so the array never has a leading one.
+// The closing bracket is optional in this format, so a file cut short by a crash still opens.
+void append(string_view name, const char *category, char phase, chrono::steady_clock::time_point time, chrono::steady_clock::duration duration, string_view detail)
+{
+	auto &buffer = threadBuffer();
+	string events;
+	{
+		lock_guard guard(buffer.lock);
+		auto &out = buffer.events;
+		out += ",\n{\"name\":\"";
+		appendEscaped(out, name);
+		out += "\",\"cat\":\"";
+		out += category;
+		out += "\",\"ph\":\"";
+		out += phase;
+		out += "\",\"ts\":";
+		appendMicroseconds(out, time - origin);
+		if (phase == 'X')
+		{
+			out += ",\"dur\":";
+			appendMicroseconds(out, duration);
+		}
+		else
+		{
+			out += ",\"s\":\"t\"";
+		}
+		out += ",\"pid\":1,\"tid\":";
+		out += to_string(buffer.tid);
+		if (!detail.empty())
+		{
+			out += ",\"args\":{\"detail\":\"";
+			appendEscaped(out, detail);
+			out += "\"}";
+		}
+		out += '}';
+		if (out.size() >= FLUSH_SIZE)
+		{
+			events.swap(out);
+		}
+	}
+	if (!events.empty())
+	{
+		writeOut(events);
+	}
+}
+} // namespace
+
+bool Trace::start(const string &fileName)
+{
+	stop();
+	// Drop what was recorded after the last trace stopped
+	collect(false);
+	lock_guard guard(fileLock);
+	file.open(fileName, ios::trunc);
+	if (!file)
+	{
+		return false;
+	}
+	traceFileName = fileName;
+	file << "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"" APPLICATION_NAME "\"}}";
+	_enabled = true;
+	return true;
+}
+
+void Trace::stop()
+{
+	if (!_enabled.exchange(false))
+	{
+		return;
+	}
+	collect(true);
+	lock_guard guard(fileLock);
+	file << "\n]\n";
+	file.close();
+}
+
+string Trace::fileName()
+{
+	lock_guard guard(fileLock);
+	return traceFileName;
+}
+
+void Trace::complete(string_view name, const char *category, chrono::steady_clock::time_point begin, chrono::steady_clock::time_point end)
+{
+	append(name, category, 'X', begin, end - begin, {});
+}
+
+void Trace::instant(string_view name, const char *category, string_view detail)
+{
+	append(name, category, 'i', chrono::steady_clock::now(), {}, detail);
+}
@@ -1,4 +1,25 @@
 #include "Gamepad.h"
+#include "InputHelpers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 size_t Gamepad::_count = 0;
 
@@ -12,60 +33,689 @@ Gamepad::~Gamepad()
 	--_count;
 }
 
+// A device created through uinput. The device is set up with the enable functions before create() is called, and
+// removed when the object is destroyed.
+class UinputDevice
+{
+public:
+	UinputDevice()
+	  : _fd(open("/dev/uinput", O_RDWR | O_NONBLOCK | O_CLOEXEC))
+	{
+		if (_fd < 0)
+		{
+			_error = errno;
+		}
+	}
+
+	~UinputDevice()
+	{
+		if (_fd >= 0)
+		{
+			ioctl(_fd, UI_DEV_DESTROY);
+			close(_fd);
+		}
+	}
+
+	UinputDevice(const UinputDevice &) = delete;
+	UinputDevice &operator=(const UinputDevice &) = delete;
+
+	void enableKey(uint16_t code)
+	{
+		control(UI_SET_EVBIT, EV_KEY);
+		control(UI_SET_KEYBIT, code);
+	}
+
+	void enableAbs(uint16_t code, int32_t minimum, int32_t maximum, int32_t fuzz = 0, int32_t flat = 0, int32_t resolution = 0)
+	{
+		control(UI_SET_EVBIT, EV_ABS);
+		control(UI_SET_ABSBIT, code);
+		uinput_abs_setup setup{};
+		setup.code = code;
+		setup.absinfo.minimum = minimum;
+		setup.absinfo.maximum = maximum;
+		setup.absinfo.fuzz = fuzz;
+		setup.absinfo.flat = flat;
+		setup.absinfo.resolution = resolution;
+		if (_fd >= 0 && ioctl(_fd, UI_ABS_SETUP, &setup) < 0 && _error == 0)
+		{
+			_error = errno;
+		}
+	}
+
+	void enableMisc(uint16_t code)
+	{
+		control(UI_SET_EVBIT, EV_MSC);
+		control(UI_SET_MSCBIT, code);
+	}
+
+	void enableProperty(uint16_t property)
+	{
+		control(UI_SET_PROPBIT, property);
+	}
+
+	// Let the games upload rumble effects. A RumbleListener has to answer them.
+	void enableRumble()
+	{
+		control(UI_SET_EVBIT, EV_FF);
+		control(UI_SET_FFBIT, FF_RUMBLE);
+		_effectsMax = MAX_RUMBLE_EFFECTS;
+	}
+
+	// Returns false and fills errorMsg if the device couldn't be set up or created
+	bool create(const char *name, uint16_t vendor, uint16_t product, uint16_t version, string &errorMsg)
+	{
+		if (_error == 0)
+		{
+			uinput_setup setup{};
+			setup.id.bustype = BUS_USB;
+			setup.id.vendor = vendor;
+			setup.id.product = product;
+			setup.id.version = version;
+			strncpy(setup.name, name, UINPUT_MAX_NAME_SIZE - 1);
+			setup.ff_effects_max = _effectsMax;
+			if (ioctl(_fd, UI_DEV_SETUP, &setup) < 0 || ioctl(_fd, UI_DEV_CREATE) < 0)
+			{
+				_error = errno;
+			}
+		}
+		_created = _error == 0;
+		if (_error != 0)
+		{
+			stringstream ss;
+			ss << "Failed to create the virtual controller " << name << ": " << strerror(_error) << '\n'
+			   << "Make sure you can write to /dev/uinput. The README explains how to give access to it.";
+			errorMsg = ss.str();
+			return false;
+		}
+		return true;
+	}
+
+	int fd() const
+	{
+		return _fd;
+	}
 
-class GamepadImpl : public Gamepad
+	// Queue an event, sent by the next flush()
+	void send(uint16_t type, uint16_t code, int32_t value)
+	{
+		if (!_created)
+			return;
+		input_event event{};
+		event.type = type;
+		event.code = code;
+		event.value = value;
+		_pending.push_back(event);
+	}
+
+	// Write the queued events followed by a SYN_REPORT in a single call, so that they form one report
+	void flush()
+	{
+		if (_pending.empty())
+		{
+			return;
+		}
+		send(EV_SYN, SYN_REPORT, 0);
+		auto size = _pending.size() * sizeof(input_event);
+		if (write(_fd, _pending.data(), size) != ssize_t(size))
+		{
+			CERR << "Failed to update the virtual controller: " << strerror(errno) << '\n';
+		}
+		_pending.clear();
+	}
+
+	static constexpr uint32_t MAX_RUMBLE_EFFECTS = 16;
+
+private:
+	void control(unsigned long request, int value)
+	{
+		if (_fd >= 0 && ioctl(_fd, request, value) < 0 && _error == 0)
+		{
+			_error = errno;
+		}
+	}
+
+	int _fd;
+	int _error = 0;
+	bool _created = false;
+	uint32_t _effectsMax = 0;
+	vector<input_event> _pending;
+};
+
+// Answers the force feedback requests the games send to a uinput device, and reports the rumble of the effects they
+// play. A game uploading an effect is blocked until the upload is answered, so it can't wait for the mapping.
+class RumbleListener
 {
 public:
-	// TODO: Implement this class by interacting with some external virtual controller software
+	// Listen on a thread of its own until the listener is destroyed
+	static void start(shared_ptr<UinputDevice> device, Gamepad::Callback notification, unique_ptr<RumbleListener> &listener)
+	{
+		listener.reset(new RumbleListener(device, notification));
+		listener->_thread = thread(&RumbleListener::run, listener.get());
+	}
 
-	GamepadImpl()
+	// Waits for the thread, so that no notification comes after. The notification takes the lock of the mapping, so
+	// the gamepad must not be destroyed by whoever holds it.
+	~RumbleListener()
 	{
+		_stop = true;
+		uint64_t one = 1;
+		if (write(_wakeFd, &one, sizeof(one)) < 0)
+		{
+			// An eventfd only refuses a write that would overflow its counter
+		}
+		if (_thread.joinable())
+		{
+			_thread.join();
+		}
+		if (_wakeFd >= 0)
+		{
+			close(_wakeFd);
+		}
+	}
 
+private:
+	RumbleListener(shared_ptr<UinputDevice> device, Gamepad::Callback notification)
+	  : _device(device)
+	  , _notification(notification)
+	  , _wakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	{
 	}
 
-	virtual ~GamepadImpl()
+	void run()
 	{
+		pollfd fds[2] = { { _device->fd(), POLLIN, 0 }, { _wakeFd, POLLIN, 0 } };
+		while (!_stop)
+		{
+			int timeoutMs = -1;
+			if (_playing)
+			{
+				auto left = chrono::duration_cast<chrono::milliseconds>(_stopTime - chrono::steady_clock::now()).count();
+				timeoutMs = int(clamp(left, decltype(left)(0), decltype(left)(1000)));
+			}
+			int ready = poll(fds, _wakeFd >= 0 ? 2 : 1, timeoutMs);
+			if (ready < 0 && errno != EINTR)
+			{
+				break;
+			}
+			if (fds[0].revents & POLLIN)
+			{
+				input_event event;
+				while (read(_device->fd(), &event, sizeof(event)) == sizeof(event))
+				{
+					process(event);
+				}
+			}
+			if (_playing && chrono::steady_clock::now() >= _stopTime)
+			{
+				// Effects with a length stop by themselves
+				_playing = false;
+				notify(0, 0);
+			}
+		}
+	}
 
+	void process(const input_event &event)
+	{
+		if (event.type == EV_UINPUT && event.code == UI_FF_UPLOAD)
+		{
+			uinput_ff_upload upload{};
+			upload.request_id = event.value;
+			if (ioctl(_device->fd(), UI_BEGIN_FF_UPLOAD, &upload) < 0)
+				return;
+			if (upload.effect.type == FF_RUMBLE)
+			{
+				_effects[upload.effect.id] = upload.effect;
+				upload.retval = 0;
+			}
+			else
+			{
+				upload.retval = -EINVAL;
+			}
+			ioctl(_device->fd(), UI_END_FF_UPLOAD, &upload);
+		}
+		else if (event.type == EV_UINPUT && event.code == UI_FF_ERASE)
+		{
+			uinput_ff_erase erase{};
+			erase.request_id = event.value;
+			if (ioctl(_device->fd(), UI_BEGIN_FF_ERASE, &erase) < 0)
+				return;
+			_effects.erase(erase.effect_id);
+			erase.retval = 0;
+			ioctl(_device->fd(), UI_END_FF_ERASE, &erase);
+		}
+		else if (event.type == EV_FF)
+		{
+			auto effect = _effects.find(event.code);
+			if (effect == _effects.end())
+				return;
+			if (event.value > 0)
+			{
+				auto &rumble = effect->second.u.rumble;
+				auto length = effect->second.replay.length;
+				// A length of 0 plays until the game stops the effect
+				_playing = length > 0;
+				_stopTime = chrono::steady_clock::now() + chrono::milliseconds(length) * event.value;
+				notify(rumble.strong_magnitude >> 8, rumble.weak_magnitude >> 8);
+			}
+			else
+			{
+				_playing = false;
+				notify(0, 0);
+			}
+		}
+	}
+
+	void notify(uint8_t largeMotor, uint8_t smallMotor)
+	{
+		if (_notification && !_stop)
+		{
+			// uinput has nothing for the player LEDs or the light bar
+			Indicator indicator{};
+			_notification(largeMotor, smallMotor, indicator);
+		}
 	}
 
-    // is not overriding anything? removed override from function
-	virtual bool isInitialized(std::string* errorMsg = nullptr) {
+	shared_ptr<UinputDevice> _device;
+	Gamepad::Callback _notification;
+	int _wakeFd;
+	atomic_bool _stop = false;
+	thread _thread;
+	map<int16_t, ff_effect> _effects;
+	bool _playing = false;
+	chrono::steady_clock::time_point _stopTime;
+};
 
+// Sticks and triggers add up what the mapping sets during a tick, like the ViGEm gamepads on Windows. Buttons keep
+// their state. update() sends the whole state as one report.
+class UinputGamepad : public Gamepad
+{
+public:
+	UinputGamepad(Callback notification)
+	  : _pad(make_shared<UinputDevice>())
+	  , _notification(notification)
+	{
 	}
 
-	virtual void setButton(KeyCode btn, bool pressed) override
+	virtual ~UinputGamepad() = default;
+
+	bool isInitialized(string *errorMsg = nullptr) const override
 	{
+		if (!_errorMsg.empty() && errorMsg != nullptr)
+		{
+			*errorMsg = _errorMsg;
+		}
+		return _errorMsg.empty();
+	}
 
+	void setButton(KeyCode btn, bool pressed) override
+	{
+		switch (btn.code)
+		{
+		case X_UP:
+			_dpadUp = pressed;
+			break;
+		case X_DOWN:
+			_dpadDown = pressed;
+			break;
+		case X_LEFT:
+			_dpadLeft = pressed;
+			break;
+		case X_RIGHT:
+			_dpadRight = pressed;
+			break;
+		case X_LT:
+			isLeftTriggerPressedDigitally = pressed;
+			break;
+		case X_RT:
+			isRightTriggerPressedDigitally = pressed;
+			break;
+		default:
+			if (auto found = buttonMap().find(btn.code); found != buttonMap().end())
+			{
+				_pad->send(EV_KEY, found->second, pressed ? 1 : 0);
+			}
+			break;
+		}
 	}
 
-	virtual void setLeftStick(float x, float y) override
+	void setLeftStick(float x, float y) override
 	{
+		_leftX += x;
+		_leftY += y;
+	}
 
+	void setRightStick(float x, float y) override
+	{
+		_rightX += x;
+		_rightY += y;
 	}
 
-	virtual void setRightStick(float x, float y) override
+	void setStick(float x, float y, bool isLeft) override
 	{
+		isLeft ? setLeftStick(x, y) : setRightStick(x, y);
+	}
 
+	void setLeftTrigger(float val) override
+	{
+		_leftTrigger += val;
 	}
 
-	virtual void setLeftTrigger(float) override
+	void setRightTrigger(float val) override
 	{
+		_rightTrigger += val;
+	}
+
+	void setGyro(float accelX, float accelY, float accelZ, float gyroX, float gyroY, float gyroZ) override
+	{
+	}
+
+	void setTouchState(optional<FloatXY> press1, optional<FloatXY> press2) override
+	{
+	}
+
+	void update() override
+	{
+		if (!isInitialized())
+			return;
+		if (isLeftTriggerPressedDigitally)
+			_leftTrigger = 1.f;
+		if (isRightTriggerPressedDigitally)
+			_rightTrigger = 1.f;
+		// evdev's Y axes point down
+		_pad->send(EV_ABS, ABS_X, stickValue(_leftX));
+		_pad->send(EV_ABS, ABS_Y, stickValue(-_leftY));
+		_pad->send(EV_ABS, ABS_RX, stickValue(_rightX));
+		_pad->send(EV_ABS, ABS_RY, stickValue(-_rightY));
+		_pad->send(EV_ABS, ABS_Z, triggerValue(_leftTrigger));
+		_pad->send(EV_ABS, ABS_RZ, triggerValue(_rightTrigger));
+		_pad->send(EV_ABS, ABS_HAT0X, int(_dpadRight) - int(_dpadLeft));
+		_pad->send(EV_ABS, ABS_HAT0Y, int(_dpadDown) - int(_dpadUp));
+		report();
+		// The kernel drops the values that didn't change, and the report altogether if nothing did
+		_pad->flush();
+		_leftX = _leftY = _rightX = _rightY = 0.f;
+		_leftTrigger = _rightTrigger = 0.f;
+	}
+
+protected:
+	// Set up the buttons and axes common to both layouts, with the sticks ranging from stickMin to stickMax
+	void enableGamepad(int32_t stickMin, int32_t stickMax, int32_t stickFuzz, int32_t stickFlat)
+	{
+		_stickMin = stickMin;
+		_stickMax = stickMax;
+		for (auto &button : buttonMap())
+		{
+			_pad->enableKey(button.second);
+		}
+		for (auto axis : { ABS_X, ABS_Y, ABS_RX, ABS_RY })
+		{
+			_pad->enableAbs(axis, stickMin, stickMax, stickFuzz, stickFlat);
+		}
+		_pad->enableAbs(ABS_Z, 0, UCHAR_MAX);
+		_pad->enableAbs(ABS_RZ, 0, UCHAR_MAX);
+		_pad->enableAbs(ABS_HAT0X, -1, 1);
+		_pad->enableAbs(ABS_HAT0Y, -1, 1);
+		_pad->enableRumble();
+	}
+
+	// Create the gamepad device and start answering its force feedback requests
+	bool createGamepad(const char *name, uint16_t vendor, uint16_t product, uint16_t version)
+	{
+		if (!_pad->create(name, vendor, product, version, _errorMsg))
+			return false;
+		RumbleListener::start(_pad, _notification, _rumble);
+		return true;
+	}
+
+	// Map of the button codes to the evdev keys of the layout
+	virtual const map<WORD, uint16_t> &buttonMap() const = 0;
+
+	// Add the events specific to the layout to the report
+	virtual void report()
+	{
+	}
+
+	int32_t stickValue(float value) const
+	{
+		float normalized = (clamp(value, -1.f, 1.f) + 1.f) / 2.f;
+		return int32_t(roundf(_stickMin + normalized * (float(_stickMax) - _stickMin)));
+	}
+
+	static int32_t triggerValue(float value)
+	{
+		return int32_t(roundf(clamp(value, 0.f, 1.f) * UCHAR_MAX));
+	}
+
+	shared_ptr<UinputDevice> _pad;
+	float _leftTrigger = 0.f;
+	float _rightTrigger = 0.f;
+	bool isLeftTriggerPressedDigitally = false;
+	bool isRightTriggerPressedDigitally = false;
+
+private:
+	Callback _notification = nullptr;
+	unique_ptr<RumbleListener> _rumble;
+	int32_t _stickMin = -1;
+	int32_t _stickMax = 1;
+	float _leftX = 0.f;
+	float _leftY = 0.f;
+	float _rightX = 0.f;
+	float _rightY = 0.f;
+	bool _dpadUp = false;
+	bool _dpadDown = false;
+	bool _dpadLeft = false;
+	bool _dpadRight = false;
+};
+
+// Presents itself like the xpad driver presents a wired Xbox 360 controller
+class XboxGamepad : public UinputGamepad
+{
+public:
+	XboxGamepad(Callback notification)
+	  : UinputGamepad(notification)
+	{
+		enableGamepad(SHRT_MIN, SHRT_MAX, 16, 128);
+		createGamepad("Microsoft X-Box 360 pad", 0x045E, 0x028E, 0x0114);
+	}
+
+	ControllerScheme getType() const override
+	{
+		return ControllerScheme::XBOX;
+	}
 
+protected:
+	const map<WORD, uint16_t> &buttonMap() const override
+	{
+		static const map<WORD, uint16_t> buttons{
+			{ X_A, BTN_SOUTH },
+			{ X_B, BTN_EAST },
+			{ X_X, BTN_NORTH },
+			{ X_Y, BTN_WEST },
+			{ X_LB, BTN_TL },
+			{ X_RB, BTN_TR },
+			{ X_BACK, BTN_SELECT },
+			{ X_START, BTN_START },
+			{ X_GUIDE, BTN_MODE },
+			{ X_LS, BTN_THUMBL },
+			{ X_RS, BTN_THUMBR },
+		};
+		return buttons;
 	}
+};
 
-	virtual void setRightTrigger(float) override
+// Presents itself like the hid-playstation driver presents a DualShock 4: a gamepad, a motion sensor device and a
+// touchpad device
+class Ds4Gamepad : public UinputGamepad
+{
+public:
+	Ds4Gamepad(Callback notification)
+	  : UinputGamepad(notification)
+	  , _motion(make_unique<UinputDevice>())
+	  , _touchpad(make_unique<UinputDevice>())
+	  , _start(chrono::steady_clock::now())
 	{
-	
+		enableGamepad(0, UCHAR_MAX, 0, 0);
+		_pad->enableKey(BTN_TL2);
+		_pad->enableKey(BTN_TR2);
+
+		_motion->enableProperty(INPUT_PROP_ACCELEROMETER);
+		for (auto axis : { ABS_X, ABS_Y, ABS_Z })
+		{
+			_motion->enableAbs(axis, -ACCEL_RANGE, ACCEL_RANGE, 16, 0, ACCEL_RES_PER_G);
+		}
+		for (auto axis : { ABS_RX, ABS_RY, ABS_RZ })
+		{
+			_motion->enableAbs(axis, -GYRO_RANGE, GYRO_RANGE, 16, 0, GYRO_RES_PER_DEG_S);
+		}
+		_motion->enableMisc(MSC_TIMESTAMP);
+
+		_touchpad->enableProperty(INPUT_PROP_POINTER);
+		_touchpad->enableProperty(INPUT_PROP_BUTTONPAD);
+		for (auto key : { BTN_LEFT, BTN_TOUCH, BTN_TOOL_FINGER, BTN_TOOL_DOUBLETAP })
+		{
+			_touchpad->enableKey(key);
+		}
+		_touchpad->enableAbs(ABS_X, 0, TOUCHPAD_WIDTH - 1);
+		_touchpad->enableAbs(ABS_Y, 0, TOUCHPAD_HEIGHT - 1);
+		_touchpad->enableAbs(ABS_MT_SLOT, 0, int32_t(MAX_NO_OF_TOUCH) - 1);
+		_touchpad->enableAbs(ABS_MT_TRACKING_ID, 0, USHRT_MAX);
+		_touchpad->enableAbs(ABS_MT_POSITION_X, 0, TOUCHPAD_WIDTH - 1);
+		_touchpad->enableAbs(ABS_MT_POSITION_Y, 0, TOUCHPAD_HEIGHT - 1);
+
+		static constexpr const char *NAME = "Sony Interactive Entertainment Wireless Controller";
+		if (createGamepad(NAME, VENDOR, PRODUCT, VERSION) &&
+		  _motion->create((string(NAME) + " Motion Sensors").c_str(), VENDOR, PRODUCT, VERSION, _errorMsg))
+		{
+			_touchpad->create((string(NAME) + " Touchpad").c_str(), VENDOR, PRODUCT, VERSION, _errorMsg);
+		}
 	}
 
-	virtual void update() override
+	void setButton(KeyCode btn, bool pressed) override
 	{
+		if (btn.code == PS_PAD_CLICK)
+		{
+			// The click of the touchpad belongs to the touchpad device
+			_touchpad->send(EV_KEY, BTN_LEFT, pressed ? 1 : 0);
+		}
+		else
+		{
+			UinputGamepad::setButton(btn, pressed);
+		}
+	}
 
+	void setGyro(float accelX, float accelY, float accelZ, float gyroX, float gyroY, float gyroZ) override
+	{
+		_motion->send(EV_ABS, ABS_X, int32_t(roundf(accelX * ACCEL_RES_PER_G)));
+		_motion->send(EV_ABS, ABS_Y, int32_t(roundf(accelY * ACCEL_RES_PER_G)));
+		_motion->send(EV_ABS, ABS_Z, int32_t(roundf(accelZ * ACCEL_RES_PER_G)));
+		_motion->send(EV_ABS, ABS_RX, int32_t(roundf(gyroX * GYRO_RES_PER_DEG_S)));
+		_motion->send(EV_ABS, ABS_RY, int32_t(roundf(gyroY * GYRO_RES_PER_DEG_S)));
+		_motion->send(EV_ABS, ABS_RZ, int32_t(roundf(gyroZ * GYRO_RES_PER_DEG_S)));
 	}
+
+	void setTouchState(optional<FloatXY> press1, optional<FloatXY> press2) override
+	{
+		optional<FloatXY> presses[MAX_NO_OF_TOUCH] = { press1, press2 };
+		int fingers = 0;
+		for (int slot = 0; slot < int(MAX_NO_OF_TOUCH); ++slot)
+		{
+			auto &press = presses[slot];
+			if (!press && !_touchId[slot])
+				continue;
+			_touchpad->send(EV_ABS, ABS_MT_SLOT, slot);
+			if (press)
+			{
+				if (!_touchId[slot])
+				{
+					_touchId[slot] = _nextTouchId;
+					_nextTouchId = (_nextTouchId + 1) % USHRT_MAX;
+					_touchpad->send(EV_ABS, ABS_MT_TRACKING_ID, *_touchId[slot]);
+				}
+				auto x = int32_t(clamp(press->x(), 0.f, 1.f) * (TOUCHPAD_WIDTH - 1));
+				auto y = int32_t(clamp(press->y(), 0.f, 1.f) * (TOUCHPAD_HEIGHT - 1));
+				_touchpad->send(EV_ABS, ABS_MT_POSITION_X, x);
+				_touchpad->send(EV_ABS, ABS_MT_POSITION_Y, y);
+				if (fingers++ == 0)
+				{
+					// Single touch emulation follows the first finger
+					_touchpad->send(EV_ABS, ABS_X, x);
+					_touchpad->send(EV_ABS, ABS_Y, y);
+				}
+			}
+			else
+			{
+				_touchpad->send(EV_ABS, ABS_MT_TRACKING_ID, -1);
+				_touchId[slot] = nullopt;
+			}
+		}
+		_touchpad->send(EV_KEY, BTN_TOUCH, fingers > 0);
+		_touchpad->send(EV_KEY, BTN_TOOL_FINGER, fingers == 1);
+		_touchpad->send(EV_KEY, BTN_TOOL_DOUBLETAP, fingers == 2);
+	}
+
+	ControllerScheme getType() const override
+	{
+		return ControllerScheme::DS4;
+	}
+
+protected:
+	const map<WORD, uint16_t> &buttonMap() const override
+	{
+		static const map<WORD, uint16_t> buttons{
+			{ PS_CROSS, BTN_SOUTH },
+			{ PS_CIRCLE, BTN_EAST },
+			{ PS_TRIANGLE, BTN_NORTH },
+			{ PS_SQUARE, BTN_WEST },
+			{ PS_L1, BTN_TL },
+			{ PS_R1, BTN_TR },
+			{ PS_SHARE, BTN_SELECT },
+			{ PS_OPTIONS, BTN_START },
+			{ PS_HOME, BTN_MODE },
+			{ PS_L3, BTN_THUMBL },
+			{ PS_R3, BTN_THUMBR },
+		};
+		return buttons;
+	}
+
+	void report() override
+	{
+		_pad->send(EV_KEY, BTN_TL2, _leftTrigger > 0.f);
+		_pad->send(EV_KEY, BTN_TR2, _rightTrigger > 0.f);
+		auto timestampUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - _start).count();
+		_motion->send(EV_MSC, MSC_TIMESTAMP, int32_t(uint32_t(timestampUs)));
+		_motion->flush();
+		_touchpad->flush();
+	}
+
+private:
+	static constexpr uint16_t VENDOR = 0x054C;
+	static constexpr uint16_t PRODUCT = 0x09CC;
+	static constexpr uint16_t VERSION = 0x8111;
+	// Same units as hid-playstation, so that readers of the real controller can read this one
+	static constexpr int32_t ACCEL_RES_PER_G = 8192;
+	static constexpr int32_t ACCEL_RANGE = 4 * ACCEL_RES_PER_G;
+	static constexpr int32_t GYRO_RES_PER_DEG_S = 1024;
+	static constexpr int32_t GYRO_RANGE = 2048 * GYRO_RES_PER_DEG_S;
+	static constexpr int32_t TOUCHPAD_WIDTH = 1920;
+	static constexpr int32_t TOUCHPAD_HEIGHT = 942;
+
+	unique_ptr<UinputDevice> _motion;
+	unique_ptr<UinputDevice> _touchpad;
+	chrono::steady_clock::time_point _start;
+	optional<int32_t> _touchId[MAX_NO_OF_TOUCH];
+	int32_t _nextTouchId = 0;
 };
 
 Gamepad *Gamepad::getNew(ControllerScheme scheme, Callback notification)
 {
-	// return new GamepadImpl();
+	if (auto capture = OutputCapture::active())
+		return capture->newGamepad(scheme);
+	switch (scheme)
+	{
+	case ControllerScheme::XBOX:
+		return new XboxGamepad(notification);
+	case ControllerScheme::DS4:
+		return new Ds4Gamepad(notification);
+	}
 	return nullptr;
 }
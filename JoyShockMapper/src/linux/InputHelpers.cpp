@@ -1,7 +1,12 @@
 #include "InputHelpers.h"
+#include "LatencyStats.h"
 
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cerrno>
 #include <cmath>
 #include <cstring>
 #include <functional>
@@ -22,6 +27,7 @@
 
 #include <queue>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 
 std::queue<Command> commandQueue;
@@ -74,10 +80,24 @@ static float windowsSensitivityMappings[] = { 0.0, // mouse sensitivity range is
 	3.25,
 	3.5 };
 
+namespace
+{
+thread_local int outputFrameDepth = 0;
+
+// What the virtual devices are used for. Each gets a device of its own unless they are combined.
+enum Role : std::size_t
+{
+	KEYBOARD,
+	MOUSE,   // Relative motion, buttons and wheel
+	POINTER, // Absolute position
+	ROLE_COUNT
+};
+} // namespace
+
 class VirtualInputDevice
 {
-private:
-	constexpr auto windows_key_to_evdev_key(WORD key) noexcept
+public:
+	static constexpr auto windows_key_to_evdev_key(WORD key) noexcept
 	{
 		switch (key)
 		{
@@ -316,37 +336,47 @@ private:
 	}
 
 public:
-	enum class Device
-	{
-		MOUSE,
-		KEYBOARD
-	};
-
-public:
-	VirtualInputDevice(Device device)
+	VirtualInputDevice(const char *name, std::bitset<ROLE_COUNT> roles, std::int32_t pointerMaxX, std::int32_t pointerMaxY)
 	  : device_{ libevdev_new() }
 	{
-		if (device == Device::MOUSE)
-		{
-			libevdev_set_name(device_, APPLICATION_NAME "_MOUSE");
+		libevdev_set_name(device_, name);
 
+		if (roles[MOUSE])
+		{
 			libevdev_enable_event_type(device_, EV_REL);
 			libevdev_enable_event_code(device_, EV_REL, REL_X, nullptr);
 			libevdev_enable_event_code(device_, EV_REL, REL_Y, nullptr);
 			libevdev_enable_event_code(device_, EV_REL, REL_WHEEL, nullptr);
+#ifdef REL_WHEEL_HI_RES
+			// Readers that know high resolution scrolling ignore REL_WHEEL when this one is there
+			libevdev_enable_event_code(device_, EV_REL, REL_WHEEL_HI_RES, nullptr);
+#endif
+		}
 
+		if (roles[POINTER])
+		{
+			// Axes as wide as the screen in pixels, so that a position doesn't get rounded twice
+			input_absinfo x{};
+			x.maximum = pointerMaxX;
+			input_absinfo y{};
+			y.maximum = pointerMaxY;
 			libevdev_enable_event_type(device_, EV_ABS);
-			libevdev_enable_event_code(device_, EV_ABS, ABS_X, nullptr);
-			libevdev_enable_event_code(device_, EV_ABS, ABS_Y, nullptr);
+			libevdev_enable_event_code(device_, EV_ABS, ABS_X, &x);
+			libevdev_enable_event_code(device_, EV_ABS, ABS_Y, &y);
+		}
 
+		if (roles[MOUSE] || roles[POINTER])
+		{
+			// Absolute axes are only taken for a pointer when there are mouse buttons too, like a tablet in a virtual
+			// machine has. The pointer never sends them.
 			libevdev_enable_event_type(device_, EV_KEY);
 			libevdev_enable_event_code(device_, EV_KEY, BTN_LEFT, nullptr);
 			libevdev_enable_event_code(device_, EV_KEY, BTN_MIDDLE, nullptr);
 			libevdev_enable_event_code(device_, EV_KEY, BTN_RIGHT, nullptr);
 		}
-		else
+
+		if (roles[KEYBOARD])
 		{
-			libevdev_set_name(device_, APPLICATION_NAME "_KEYBOARD");
 			libevdev_enable_event_type(device_, EV_KEY);
 			for (std::uint32_t i = 0; i < 250; ++i)
 			{
@@ -359,6 +389,7 @@ public:
 		  &uinput_device_);
 		if (error != 0)
 		{
+			libevdev_free(device_);
 			throw std::runtime_error(
 				std::string("Failed to create virtual device: ") +
 				std::strerror(-error) + std::string("\n"));
@@ -371,137 +402,417 @@ public:
 		libevdev_free(device_);
 	}
 
-public:
-	void press_key(WORD key) noexcept
+	VirtualInputDevice(const VirtualInputDevice &) = delete;
+	VirtualInputDevice &operator=(const VirtualInputDevice &) = delete;
+
+	// Write events, ending with a SYN_REPORT, in a single call
+	void write(const std::vector<input_event> &events) noexcept
 	{
-		auto error =
-		  libevdev_uinput_write_event(uinput_device_, EV_KEY, windows_key_to_evdev_key(key), 1);
-		if (error != 0)
+		const auto size = events.size() * sizeof(input_event);
+		const auto written = ::write(libevdev_uinput_get_fd(uinput_device_), events.data(), size);
+		if (written != ssize_t(size))
 		{
-			std::fprintf(stderr, "Failed to to simulate key press: %s\n", std::strerror(-error));
-			return;
+			std::fprintf(stderr, "Failed to simulate input: %s\n", written < 0 ? std::strerror(errno) : "incomplete write");
 		}
+	}
 
-		error = libevdev_uinput_write_event(uinput_device_, EV_SYN, SYN_REPORT, 0);
-		if (error != 0)
+private:
+	libevdev *device_;
+	libevdev_uinput *uinput_device_{ nullptr };
+};
+
+// get the user's mouse sensitivity multiplier from the user. In Windows it's an int, but who cares?
+// it's well within range for float to represent it exactly also, if this is ported to other
+// platforms, we might want non-integer sensitivities
+float getMouseSpeed()
+{
+	return 1.0;
+}
+
+namespace
+{
+// Guards the devices and how they are laid out. Writing to them only takes it shared.
+std::shared_mutex devicesLock;
+VirtualDevices deviceLayout = VirtualDevices::SEPARATE;
+float mouseReportRate = 0.f;
+// Read when queuing an absolute position, so they don't need the lock
+std::atomic<std::int32_t> pointerMaxX = 1919;
+std::atomic<std::int32_t> pointerMaxY = 1079;
+// The device of each role, the same one for all roles when they are combined. Created with the first output.
+std::array<std::shared_ptr<VirtualInputDevice>, ROLE_COUNT> devices;
+bool devicesFailed = false;
+
+// Motion held back by the report rate, shared by all the threads. It goes out with the next report of the mouse, or
+// from the motion flusher when its time comes.
+std::mutex motionLock; // Taken after devicesLock
+std::condition_variable motionHeld;
+std::int32_t heldX = 0;
+std::int32_t heldY = 0;
+std::int64_t lastMotionReport = 0; // When relative motion was last reported, in nanoseconds of the steady clock
+std::int64_t heldUntil = 0;        // When the held motion is due
+std::thread motionFlusher;         // Started with the first motion held back
+bool motionFlusherStop = false;    // Set for good when the devices are released
+
+// Events of each thread waiting for the end of its outermost OutputFrame, by role
+thread_local std::array<std::vector<input_event>, ROLE_COUNT> pendingEvents;
+// The events of a thread going to one device
+thread_local std::vector<input_event> reportEvents;
+
+// Must be called with devicesLock held exclusively
+void createDevices()
+{
+	try
+	{
+		if (deviceLayout == VirtualDevices::COMBINED)
 		{
-			std::fprintf(stderr, "Failed to to simulate key press: %s\n", std::strerror(-error));
-			return;
+			devices.fill(std::make_shared<VirtualInputDevice>(APPLICATION_NAME "_DEVICE", std::bitset<ROLE_COUNT>().set(), pointerMaxX, pointerMaxY));
+		}
+		else
+		{
+			devices[KEYBOARD] = std::make_shared<VirtualInputDevice>(APPLICATION_NAME "_KEYBOARD", std::bitset<ROLE_COUNT>().set(KEYBOARD), pointerMaxX, pointerMaxY);
+			devices[MOUSE] = std::make_shared<VirtualInputDevice>(APPLICATION_NAME "_MOUSE", std::bitset<ROLE_COUNT>().set(MOUSE), pointerMaxX, pointerMaxY);
+			devices[POINTER] = std::make_shared<VirtualInputDevice>(APPLICATION_NAME "_POINTER", std::bitset<ROLE_COUNT>().set(POINTER), pointerMaxX, pointerMaxY);
 		}
 	}
+	catch (const std::runtime_error &error)
+	{
+		// Don't try again with every output. Changing the layout does.
+		std::fputs(error.what(), stderr);
+		devices.fill(nullptr);
+		devicesFailed = true;
+	}
+}
 
-	void release_key(WORD key) noexcept
+std::int64_t steadyNowNs() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Report the held motion when it is due, unless some other output of the mouse reported it first
+void runMotionFlusher()
+{
+	while (true)
 	{
-		auto error =
-		  libevdev_uinput_write_event(uinput_device_, EV_KEY, windows_key_to_evdev_key(key), 0);
-		if (error != 0)
 		{
-			std::fprintf(stderr, "Failed to to simulate key release: %s\n", std::strerror(-error));
-			return;
+			std::unique_lock guard(motionLock);
+			motionHeld.wait(guard, []
+			  { return motionFlusherStop || heldX != 0 || heldY != 0; });
+			if (motionFlusherStop)
+			{
+				return;
+			}
+			const auto due = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(heldUntil));
+			if (motionHeld.wait_until(guard, due, []
+			      { return motionFlusherStop || (heldX == 0 && heldY == 0); }))
+			{
+				continue;
+			}
 		}
-
-		error = libevdev_uinput_write_event(uinput_device_, EV_SYN, SYN_REPORT, 0);
-		if (error != 0)
+		std::shared_lock devicesGuard(devicesLock);
+		std::lock_guard guard(motionLock);
+		const auto now = steadyNowNs();
+		if ((heldX == 0 && heldY == 0) || now < heldUntil)
 		{
-			std::fprintf(stderr, "Failed to to simulate key release: %s\n", std::strerror(-error));
-			return;
+			continue;
+		}
+		reportEvents.clear();
+		reportEvents.push_back({ .type = EV_REL, .code = REL_X, .value = heldX });
+		reportEvents.push_back({ .type = EV_REL, .code = REL_Y, .value = heldY });
+		reportEvents.push_back({ .type = EV_SYN, .code = SYN_REPORT });
+		heldX = 0;
+		heldY = 0;
+		lastMotionReport = now;
+		if (devices[MOUSE])
+		{
+			devices[MOUSE]->write(reportEvents);
 		}
 	}
+}
 
-	void click_key(WORD key) noexcept
+// Whether the mouse events queued by the calling thread have to wait for the next report of the mouse, in which case
+// they are taken into the held motion. Motion alone is reported at most mouseReportRate times a second and summed in
+// between. Buttons and the wheel go out at once, along with the motion held so far.
+// Must be called with devicesLock held.
+bool holdMotion(std::vector<input_event> &events) noexcept
+{
+	if (events.empty())
 	{
-		press_key(key);
-		release_key(key);
+		return false;
 	}
-
-	void mouse_move_relative(std::int32_t x, std::int32_t y) noexcept
+	const auto now = steadyNowNs();
+	const bool motionOnly = std::all_of(events.begin(), events.end(), [](const input_event &event)
+	  { return event.type == EV_REL && (event.code == REL_X || event.code == REL_Y); });
+	const auto interval = mouseReportRate > 0.f ? std::int64_t(1e9f / mouseReportRate) : 0;
+	std::lock_guard guard(motionLock);
+	if (motionOnly && now - lastMotionReport < interval)
 	{
-		auto error = libevdev_uinput_write_event(uinput_device_, EV_REL, REL_X, x);
-		if (error != 0)
+		for (const auto &event : events)
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			(event.code == REL_X ? heldX : heldY) += event.value;
 		}
-
-		error = libevdev_uinput_write_event(uinput_device_, EV_REL, REL_Y, y);
-		if (error != 0)
+		events.clear();
+		heldUntil = lastMotionReport + interval;
+		if (!motionFlusher.joinable() && !motionFlusherStop)
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			motionFlusher = std::thread(runMotionFlusher);
 		}
+		motionHeld.notify_one();
+		return true;
+	}
+	if (heldX != 0 || heldY != 0)
+	{
+		events.insert(events.begin(), { { .type = EV_REL, .code = REL_X, .value = heldX }, { .type = EV_REL, .code = REL_Y, .value = heldY } });
+		heldX = 0;
+		heldY = 0;
+	}
+	lastMotionReport = now;
+	return false;
+}
 
-		error = libevdev_uinput_write_event(uinput_device_, EV_SYN, SYN_REPORT, 0);
-		if (error != 0)
+// Write the events queued by the calling thread, those of all the roles of a device in a single call
+void flushDevices() noexcept
+{
+	auto &pending = pendingEvents;
+	if (std::all_of(pending.begin(), pending.end(), [](const auto &events)
+	      { return events.empty(); }))
+	{
+		return;
+	}
+	std::shared_lock guard(devicesLock);
+	if (!devices[KEYBOARD] && !devicesFailed)
+	{
+		guard.unlock();
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			std::unique_lock create(devicesLock);
+			if (!devices[KEYBOARD] && !devicesFailed)
+			{
+				createDevices();
+			}
 		}
+		guard.lock();
 	}
-
-	void mouse_move_absolute(std::int32_t x, std::int32_t y) noexcept
+	StageTimer injectionTimer(Stage::INJECTION);
+	holdMotion(pending[MOUSE]);
+	for (std::size_t role = 0; role < ROLE_COUNT; ++role)
 	{
-		auto error = libevdev_uinput_write_event(uinput_device_, EV_ABS, ABS_X, x);
-		if (error != 0)
+		if (pending[role].empty())
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			continue;
 		}
-
-		error = libevdev_uinput_write_event(uinput_device_, EV_ABS, ABS_Y, y);
-		if (error != 0)
+		const auto &device = devices[role];
+		reportEvents.clear();
+		for (auto other = role; other < ROLE_COUNT; ++other)
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			if (devices[other] == device)
+			{
+				reportEvents.insert(reportEvents.end(), pending[other].begin(), pending[other].end());
+				pending[other].clear();
+			}
+		}
+		if (device && !reportEvents.empty())
+		{
+			input_event syn{};
+			syn.type = EV_SYN;
+			syn.code = SYN_REPORT;
+			reportEvents.push_back(syn);
+			device->write(reportEvents);
 		}
+	}
+}
 
-		error = libevdev_uinput_write_event(uinput_device_, EV_SYN, SYN_REPORT, 0);
-		if (error != 0)
+// Output of one role, queued for the calling thread
+class VirtualOutput
+{
+public:
+	explicit VirtualOutput(Role role)
+	  : role_{ role }
+	{
+	}
+
+	void press_key(WORD key) noexcept
+	{
+		queue_event(EV_KEY, VirtualInputDevice::windows_key_to_evdev_key(key), 1);
+		flush_outside_frame();
+	}
+
+	void release_key(WORD key) noexcept
+	{
+		queue_event(EV_KEY, VirtualInputDevice::windows_key_to_evdev_key(key), 0);
+		flush_outside_frame();
+	}
+
+	void click_key(WORD key) noexcept
+	{
+		press_key(key);
+		release_key(key);
+	}
+
+	void mouse_move_relative(std::int32_t x, std::int32_t y) noexcept
+	{
+		queue_event(EV_REL, REL_X, x);
+		queue_event(EV_REL, REL_Y, y);
+		flush_outside_frame();
+	}
+
+	// Move by fractions of a count. What doesn't make a whole count yet is kept for the next move. It is rounded to the
+	// nearest count rather than truncated, so that slow motion isn't held back and doesn't lean towards zero.
+	void mouse_move_relative(float x, float y) noexcept
+	{
+		std::int32_t countX, countY;
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			std::lock_guard guard(residual_lock_);
+			residual_x_ += x;
+			residual_y_ += y;
+			countX = std::int32_t(std::lroundf(residual_x_));
+			countY = std::int32_t(std::lroundf(residual_y_));
+			residual_x_ -= countX;
+			residual_y_ -= countY;
 		}
+		mouse_move_relative(countX, countY);
+	}
+
+	// Move to a position in [0, 1] across the screen
+	void mouse_move_absolute(float x, float y) noexcept
+	{
+		queue_event(EV_ABS, ABS_X, std::int32_t(std::lroundf(std::clamp(x, 0.f, 1.f) * pointerMaxX.load(std::memory_order_relaxed))));
+		queue_event(EV_ABS, ABS_Y, std::int32_t(std::lroundf(std::clamp(y, 0.f, 1.f) * pointerMaxY.load(std::memory_order_relaxed))));
+		flush_outside_frame();
 	}
 
 	void mouse_scroll(std::int32_t amount) noexcept
 	{
-		auto error = libevdev_uinput_write_event(uinput_device_, EV_REL, REL_WHEEL, amount);
-		if (error != 0)
+		queue_event(EV_REL, REL_WHEEL, amount);
+#ifdef REL_WHEEL_HI_RES
+		queue_event(EV_REL, REL_WHEEL_HI_RES, amount * WHEEL_HI_RES_PER_DETENT);
+#endif
+		flush_outside_frame();
+	}
+
+private:
+	// Events sent within an OutputFrame wait for the end of it. Moves along the same axis are summed and the last
+	// absolute position wins, since the reader only sees the state at the next SYN_REPORT anyway. A key that already
+	// changed starts a new report instead, so that a tap doesn't get lost.
+	void queue_event(std::uint16_t type, std::uint16_t code, std::int32_t value) noexcept
+	{
+		auto &events = pendingEvents[role_];
+		if (type == EV_REL && value == 0)
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse scroll: %s\n", std::strerror(-error));
 			return;
 		}
+		for (auto event = events.rbegin(); event != events.rend() && event->type != EV_SYN; ++event)
+		{
+			if (event->type == type && event->code == code)
+			{
+				if (type == EV_REL)
+				{
+					event->value += value;
+					return;
+				}
+				if (type == EV_ABS)
+				{
+					event->value = value;
+					return;
+				}
+				append_event(events, EV_SYN, SYN_REPORT, 0);
+				break;
+			}
+		}
+		append_event(events, type, code, value);
+	}
 
-		error = libevdev_uinput_write_event(uinput_device_, EV_SYN, SYN_REPORT, 0);
-		if (error != 0)
+	void flush_outside_frame() noexcept
+	{
+		if (outputFrameDepth == 0)
 		{
-			std::fprintf(stderr, "Failed to to simulate mouse move: %s\n", std::strerror(-error));
-			return;
+			flushDevices();
 		}
 	}
 
-private:
-	libevdev *device_;
-	libevdev_uinput *uinput_device_{ nullptr };
+	static void append_event(std::vector<input_event> &events, std::uint16_t type, std::uint16_t code, std::int32_t value)
+	{
+		input_event event{};
+		event.type = type;
+		event.code = code;
+		event.value = value;
+		events.push_back(event);
+	}
+
+	Role role_;
+
+	static constexpr std::int32_t WHEEL_HI_RES_PER_DETENT = 120;
+
+	// Fractions of a count not sent yet, shared by the threads moving the mouse
+	std::mutex residual_lock_;
+	float residual_x_ = 0.f;
+	float residual_y_ = 0.f;
 };
 
-// get the user's mouse sensitivity multiplier from the user. In Windows it's an int, but who cares?
-// it's well within range for float to represent it exactly also, if this is ported to other
-// platforms, we might want non-integer sensitivities
-float getMouseSpeed()
+VirtualOutput keyboard{ KEYBOARD };
+VirtualOutput mouse{ MOUSE };
+VirtualOutput pointer{ POINTER };
+} // namespace
+
+void configureVirtualDevices(VirtualDevices layout, float mouseRate, FloatXY pointerResolution)
 {
-	return 1.0;
+	const auto maxX = std::max(std::int32_t(pointerResolution.x()) - 1, 1);
+	const auto maxY = std::max(std::int32_t(pointerResolution.y()) - 1, 1);
+	std::unique_lock guard(devicesLock);
+	mouseReportRate = mouseRate;
+	if (layout == deviceLayout && maxX == pointerMaxX && maxY == pointerMaxY)
+	{
+		return;
+	}
+	deviceLayout = layout;
+	pointerMaxX = maxX;
+	pointerMaxY = maxY;
+	// The next output creates the new devices. The kernel releases what is still held on the old ones.
+	devices.fill(nullptr);
+	devicesFailed = false;
 }
 
-namespace
+void releaseVirtualDevices()
 {
-VirtualInputDevice mouse{ VirtualInputDevice::Device::MOUSE };
-VirtualInputDevice keyboard{ VirtualInputDevice::Device::KEYBOARD };
-} // namespace
+	{
+		std::lock_guard guard(motionLock);
+		motionFlusherStop = true;
+		heldX = 0;
+		heldY = 0;
+	}
+	motionHeld.notify_one();
+	if (motionFlusher.joinable())
+	{
+		motionFlusher.join();
+	}
+	std::unique_lock guard(devicesLock);
+	devices.fill(nullptr);
+	devicesFailed = true; // Nothing is sent anymore
+}
+
+OutputFrame::OutputFrame()
+{
+	++outputFrameDepth;
+}
+
+OutputFrame::~OutputFrame()
+{
+	if (--outputFrameDepth == 0)
+	{
+		flushDevices();
+	}
+}
 
 // send mouse button
-int pressMouse(WORD vkKey, bool isPressed)
+int pressMouse(const KeyCode &vkKey, bool isPressed)
 {
-	if (vkKey == V_WHEEL_UP)
+	if (OutputQueue::push({ OutputEvent::Type::MOUSE_BUTTON, isPressed, vkKey.code }))
+		return 0;
+	if (auto capture = OutputCapture::active())
+	{
+		capture->pressMouse(vkKey.code, isPressed);
+		return 0;
+	}
+	traceButtonOutput("Mouse button", vkKey.code, isPressed);
+	if (vkKey.code == V_WHEEL_UP)
 	{
 		if (isPressed)
 		{
@@ -511,7 +822,7 @@ int pressMouse(WORD vkKey, bool isPressed)
 		return 0;
 	}
 
-	if (vkKey == V_WHEEL_DOWN)
+	if (vkKey.code == V_WHEEL_DOWN)
 	{
 		if (isPressed)
 		{
@@ -523,26 +834,34 @@ int pressMouse(WORD vkKey, bool isPressed)
 
 	if (isPressed)
 	{
-		mouse.press_key(vkKey);
+		mouse.press_key(vkKey.code);
 	}
 	else
 	{
-		mouse.release_key(vkKey);
+		mouse.release_key(vkKey.code);
 	}
 
 	return 0;
 }
 
 // send key press
-int pressKey(KeyCode vkKey, bool pressed)
+int pressKey(const KeyCode &vkKey, bool pressed)
 {
+	if (OutputQueue::push({ OutputEvent::Type::KEY, pressed, vkKey.code }))
+		return 0;
+	if (auto capture = OutputCapture::active())
+	{
+		capture->pressKey(vkKey, pressed);
+		return 0;
+	}
 	if (vkKey.code == 0)
 		return 0;
 	if (vkKey.code <= V_WHEEL_DOWN)
 	{
 		// Highest mouse ID
-		return pressMouse(vkKey.code, pressed);
+		return pressMouse(vkKey, pressed);
 	}
+	traceButtonOutput("Key", vkKey.code, pressed);
 
 	if (pressed)
 	{
@@ -556,27 +875,24 @@ int pressKey(KeyCode vkKey, bool pressed)
 	return 0;
 }
 
-float accumulatedX = 0;
-float accumulatedY = 0;
-
 void moveMouse(float x, float y)
 {
-	accumulatedX += x;
-	accumulatedY += y;
-
-	int applicableX = (int)accumulatedX;
-	int applicableY = (int)accumulatedY;
-
-	accumulatedX -= applicableX;
-	accumulatedY -= applicableY;
-
-	mouse.mouse_move_relative(applicableX, applicableY);
-	// printf("%0.4f %0.4f\n", accumulatedX, accumulatedY);
+	if (OutputQueue::push({ OutputEvent::Type::MOVE, false, 0, x, y }))
+		return;
+	if (auto capture = OutputCapture::active())
+		return capture->moveMouse(x, y);
+	traceMotionOutput("Mouse move", x, y);
+	mouse.mouse_move_relative(x, y);
 }
 
 void setMouseNorm(float x, float y)
 {
-	mouse.mouse_move_absolute(std::roundf(65535.0f * x), std::roundf(65535.0f * y));
+	if (OutputQueue::push({ OutputEvent::Type::MOVE_ABSOLUTE, false, 0, x, y }))
+		return;
+	if (auto capture = OutputCapture::active())
+		return capture->setMouseNorm(x, y);
+	traceMotionOutput("Pointer move", x, y);
+	pointer.mouse_move_absolute(x, y);
 }
 
 bool WriteToConsole(string_view command)
@@ -10,11 +10,17 @@
 #include "AutoConnect.h"
 #include "SettingsManager.h"
 #include "JoyShock.h"
+#include "InputRecording.h"
+#include "LatencyStats.h"
 #include <filesystem>
 #define _USE_MATH_DEFINES
 #include <math.h> // M_PI
 #include <string>
 #include <unordered_set>
+#include <iomanip>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -46,6 +52,7 @@ float last_flick_and_rotation = 0.0;
 unique_ptr<PollingThread> autoLoadThread;
 unique_ptr<JSM::AutoConnect> autoConnectThread;
 unique_ptr<PollingThread> minimizeThread;
+unique_ptr<PollingThread> latencyStatsThread;
 bool devicesCalibrating = false;
 unordered_map<int, shared_ptr<JoyShock>> handle_to_joyshock;
 
@@ -96,8 +103,148 @@ struct TOUCH_POINT
 //	}
 // }
 
+// A replay captures the output of its own thread, so it can't hand it to the output thread
+bool useOutputThread()
+{
+	return SettingsManager::getV<Switch>(SettingID::OUTPUT_THREAD)->value() == Switch::ON && !OutputCapture::active();
+}
+
+// Sleeps until the next button deadline of the controllers, and sends the events of the buttons that are due then.
+// Hold, turbo and double press act on time rather than at the next report of the controller, which can be far away
+// when the input doesn't change. A replay runs on the time of the recording, so it keeps acting on the next report.
+class ButtonDeadlineThread
+{
+public:
+	typedef chrono::steady_clock Clock;
+
+	~ButtonDeadlineThread()
+	{
+		{
+			lock_guard guard(_lock);
+			_stop = true;
+		}
+		_wake.notify_one();
+		if (_thread.joinable())
+		{
+			_thread.join();
+		}
+	}
+
+	// Wake up at the next deadline of jc. Call with its callback_lock held, once its buttons got their events.
+	void watch(const shared_ptr<JoyShock> &jc)
+	{
+		auto deadline = jc->_context->timers.nextDeadline();
+		if (deadline == Clock::time_point::max())
+		{
+			return; // A stale entry of jc only costs a pass that finds nothing due
+		}
+		lock_guard guard(_lock);
+		if (!_thread.joinable())
+		{
+			_thread = thread(&ButtonDeadlineThread::run, this);
+		}
+		auto entry = find_if(_controllers.begin(), _controllers.end(), [&jc](const Watched &watched)
+		  {
+			  return watched.key == jc.get();
+		  });
+		if (entry == _controllers.end())
+		{
+			_controllers.push_back({ jc.get(), jc, deadline });
+		}
+		else
+		{
+			entry->jc = jc;
+			entry->deadline = deadline;
+		}
+		if (deadline < _wakeTime)
+		{
+			_wakeTime = deadline;
+			_wake.notify_one();
+		}
+	}
+
+private:
+	struct Watched
+	{
+		const JoyShock *key;
+		weak_ptr<JoyShock> jc;
+		Clock::time_point deadline;
+	};
+
+	void run()
+	{
+		unique_lock lock(_lock);
+		while (!_stop)
+		{
+			if (_wakeTime == Clock::time_point::max())
+			{
+				_wake.wait(lock);
+			}
+			else
+			{
+				_wake.wait_until(lock, _wakeTime);
+			}
+			auto now = Clock::now();
+			if (_stop || now < _wakeTime)
+			{
+				continue;
+			}
+			// Take the controllers that are due, and wait for the others
+			_wakeTime = Clock::time_point::max();
+			for (auto entry = _controllers.begin(); entry != _controllers.end();)
+			{
+				if (entry->deadline > now)
+				{
+					_wakeTime = min(_wakeTime, entry->deadline);
+					++entry;
+					continue;
+				}
+				if (auto jc = entry->jc.lock())
+				{
+					_due.push_back(move(jc));
+				}
+				entry = _controllers.erase(entry);
+			}
+			lock.unlock();
+			for (auto &jc : _due)
+			{
+				handleDeadlines(jc);
+			}
+			_due.clear(); // Release the controllers outside of the lock
+			lock.lock();
+		}
+	}
+
+	void handleDeadlines(const shared_ptr<JoyShock> &jc)
+	{
+		OutputFrame outputFrame;
+		lock_guard guard(jc->_context->callback_lock);
+		OutputQueue::Session outputSession(jc->_outputQueue, useOutputThread());
+		jc->handleDueButtons(Clock::now());
+		watch(jc);
+	}
+
+	mutex _lock;
+	condition_variable _wake;
+	thread _thread;
+	bool _stop = false;
+	Clock::time_point _wakeTime = Clock::time_point::max();
+	vector<Watched> _controllers;
+	vector<shared_ptr<JoyShock>> _due; // Only used by the thread
+};
+
+ButtonDeadlineThread buttonDeadlines;
+
+void updateVirtualDevices()
+{
+	configureVirtualDevices(SettingsManager::getV<VirtualDevices>(SettingID::VIRTUAL_DEVICES)->value(),
+	  SettingsManager::getV<float>(SettingID::VIRTUAL_MOUSE_RATE)->value(),
+	  SettingsManager::getV<FloatXY>(SettingID::VIRTUAL_POINTER_RESOLUTION)->value());
+}
+
 void touchCallback(int jcHandle, TOUCH_STATE newState, TOUCH_STATE prevState, float delta_time)
 {
+	OutputFrame outputFrame;
 
 	// if (current.t0Down || previous.t0Down)
 	//{
@@ -113,13 +260,15 @@ void touchCallback(int jcHandle, TOUCH_STATE newState, TOUCH_STATE prevState, fl
 	//	  prevState.t1Down ? optional<FloatXY>({ prevState.t1X, prevState.t1Y }) : nullopt);
 	//}
 
-	shared_ptr<JoyShock> js = handle_to_joyshock[jcHandle];
+	auto found = handle_to_joyshock.find(jcHandle);
+	shared_ptr<JoyShock> js = found != handle_to_joyshock.end() ? found->second : nullptr;
 	int tpSizeX, tpSizeY;
 	if (!js || jsl->GetTouchpadDimension(jcHandle, tpSizeX, tpSizeY) == false)
 		return;
 	FloatXY tpSize{ float(tpSizeX), float(tpSizeY) };
 
 	lock_guard guard(js->_context->callback_lock);
+	OutputQueue::Session outputSession(js->_outputQueue, useOutputThread());
 
 	TOUCH_POINT point0(newState.t0Down ? make_optional<FloatXY>(newState.t0X, newState.t0Y) : nullopt,
 	  prevState.t0Down ? make_optional<FloatXY>(prevState.t0X, prevState.t0Y) : nullopt, tpSize);
@@ -137,11 +286,9 @@ void touchCallback(int jcHandle, TOUCH_STATE newState, TOUCH_STATE prevState, fl
 			return id >= ButtonID::T1;
 		};
 
-		for (auto currentlyActive = find_if(js->_context->chordStack.begin(), js->_context->chordStack.end(), IS_TOUCH_BUTTON);
-		     currentlyActive != js->_context->chordStack.end();
-		     currentlyActive = find_if(js->_context->chordStack.begin(), js->_context->chordStack.end(), IS_TOUCH_BUTTON))
+		if (js->_context->chordStack.eraseIf(IS_TOUCH_BUTTON) > 0)
 		{
-			js->_context->chordStack.erase(currentlyActive);
+			++js->_context->chordStackRevision;
 		}
 	}
 	if (mode == TouchpadMode::GRID_AND_STICK)
@@ -353,20 +500,27 @@ void calibrateTriggers(shared_ptr<JoyShock> jc)
 
 void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE lastState, IMU_STATE imuState, IMU_STATE lastImuState, float deltaTime)
 {
+	// Send everything this tick produces together
+	OutputFrame outputFrame;
 
-	shared_ptr<JoyShock> jc = handle_to_joyshock[jcHandle];
-	if (jc == nullptr)
+	// Don't insert into the map: several controllers can be processed in parallel
+	auto found = handle_to_joyshock.find(jcHandle);
+	if (found == handle_to_joyshock.end() || found->second == nullptr)
 		return;
-	jc->_context->callback_lock.lock();
+	shared_ptr<JoyShock> jc = found->second;
+	// The output session ends before the lock is released: the deadline thread pushes to the same queue
+	unique_lock callbackLock(jc->_context->callback_lock);
+	OutputQueue::Session outputSession(jc->_outputQueue, useOutputThread());
 
-	auto timeNow = chrono::steady_clock::now();
+	auto timeNow = jsl->GetPollTime(jcHandle);
 	deltaTime = ((float)chrono::duration_cast<chrono::microseconds>(timeNow - jc->_timeNow).count()) / 1000000.0f;
 	jc->_timeNow = timeNow;
+	// Buttons whose deadline passed since the last poll need an event even if their input didn't change
+	jc->_context->timers.advance(timeNow);
 
 	if (triggerCalibrationStep)
 	{
 		calibrateTriggers(jc);
-		jc->_context->callback_lock.unlock();
 		return;
 	}
 
@@ -374,6 +528,12 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 
 	IMU_STATE imu = jsl->GetIMUState(jc->_handle);
 
+	// Integrate the motion over the interval between sensor reports rather than between callbacks when possible
+	float motionDeltaTime = deltaTime;
+	bool useSensorTimestamps = SettingsManager::getV<Switch>(SettingID::SENSOR_TIMESTAMPS)->value() == Switch::ON;
+	array<IMU_SAMPLE, MAX_IMU_SAMPLES> imuSamples;
+	int numImuSamples = useSensorTimestamps ? jsl->GetIMUSamples(jc->_handle, imuSamples.data(), MAX_IMU_SAMPLES) : 0;
+
 	if (SettingsManager::getV<Switch>(SettingID::AUTO_CALIBRATE_GYRO)->value() == Switch::ON)
 	{
 		motion.SetAutoCalibration(true, 1.2f, 0.015f);
@@ -382,16 +542,58 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	{
 		motion.SetAutoCalibration(false, 0.f, 0.f);
 	}
-	motion.ProcessMotion(imu.gyroX, imu.gyroY, imu.gyroZ, imu.accelX, imu.accelY, imu.accelZ, deltaTime);
 
+	StageTimer motionTimer(Stage::MOTION);
 	float inGyroX, inGyroY, inGyroZ;
-	motion.GetCalibratedGyro(inGyroX, inGyroY, inGyroZ);
+	if (numImuSamples > 0)
+	{
+		// Process every report received since the last poll in order, and use the average speed over that period
+		// so that the gyro output matches the total rotation regardless of the tick time.
+		float sumGyroX = 0.f, sumGyroY = 0.f, sumGyroZ = 0.f;
+		motionDeltaTime = 0.f;
+		for (int i = 0; i < numImuSamples; ++i)
+		{
+			const IMU_STATE &sample = imuSamples[i].imu;
+			float sampleDeltaTime = jc->getSensorDeltaTime(imuSamples[i].timestampUs, deltaTime / numImuSamples);
+			if (sampleDeltaTime > 0.f)
+			{
+				motion.ProcessMotion(sample.gyroX, sample.gyroY, sample.gyroZ, sample.accelX, sample.accelY, sample.accelZ, sampleDeltaTime);
+				motion.GetCalibratedGyro(inGyroX, inGyroY, inGyroZ);
+				sumGyroX += inGyroX * sampleDeltaTime;
+				sumGyroY += inGyroY * sampleDeltaTime;
+				sumGyroZ += inGyroZ * sampleDeltaTime;
+				motionDeltaTime += sampleDeltaTime;
+			}
+		}
+		imu = imuSamples[numImuSamples - 1].imu;
+		motion.GetCalibratedGyro(inGyroX, inGyroY, inGyroZ);
+		if (motionDeltaTime > 0.f)
+		{
+			inGyroX = sumGyroX / motionDeltaTime;
+			inGyroY = sumGyroY / motionDeltaTime;
+			inGyroZ = sumGyroZ / motionDeltaTime;
+		}
+	}
+	else
+	{
+		uint64_t imuTimestampUs = 0;
+		if (useSensorTimestamps && jsl->GetIMUTimestamp(jc->_handle, imuTimestampUs))
+		{
+			motionDeltaTime = jc->getSensorDeltaTime(imuTimestampUs, deltaTime);
+		}
+		if (motionDeltaTime > 0.f) // Don't feed the same report twice
+		{
+			motion.ProcessMotion(imu.gyroX, imu.gyroY, imu.gyroZ, imu.accelX, imu.accelY, imu.accelZ, motionDeltaTime);
+		}
+		motion.GetCalibratedGyro(inGyroX, inGyroY, inGyroZ);
+	}
 
 	float inGravX, inGravY, inGravZ;
 	motion.GetGravity(inGravX, inGravY, inGravZ);
 
 	float inQuatW, inQuatX, inQuatY, inQuatZ;
 	motion.GetOrientation(inQuatW, inQuatX, inQuatY, inQuatZ);
+	motionTimer.stop();
 
 	//// These are for sanity checking sensor fusion against a simple complementary filter:
 	// float angle = sqrtf(inGyroX * inGyroX + inGyroY * inGyroY + inGyroZ * inGyroZ) * PI / 180.f * deltaTime;
@@ -445,6 +647,7 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		COUT << "Neutral orientation for device " << jc->_handle << " set...\n";
 	}
 
+	StageTimer gyroSpaceTimer(Stage::GYRO_SPACE);
 	float gyroX = 0.0;
 	float gyroY = 0.0;
 	GyroSpace gyroSpace = jc->getSetting<GyroSpace>(SettingID::GYRO_SPACE);
@@ -603,15 +806,32 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 			}
 		}
 	}
+	gyroSpaceTimer.stop();
+
+	StageTimer smoothingTimer(Stage::SMOOTHING);
 	float gyroLength = sqrt(gyroX * gyroX + gyroY * gyroY);
-	// do gyro smoothing
-	// convert gyro smooth time to number of samples
-	auto tick_time = SettingsManager::get<float>(SettingID::TICK_TIME)->value();
-	auto numGyroSamples = jc->getSetting(SettingID::GYRO_SMOOTH_TIME) * 1000.f / tick_time;
-	if (numGyroSamples < 1)
-		numGyroSamples = 1; // need at least 1 sample
-	auto threshold = jc->getSetting(SettingID::GYRO_SMOOTH_THRESHOLD);
-	jc->getSmoothedGyro(gyroX, gyroY, gyroLength, threshold / 2.0f, threshold, int(numGyroSamples), gyroX, gyroY);
+	auto gyroFilter = jc->getSetting<GyroFilter>(SettingID::GYRO_FILTER);
+	if (gyroFilter == GyroFilter::SMOOTH)
+	{
+		// do gyro smoothing
+		// convert gyro smooth time to number of samples. One sample is pushed per callback, and with EVENT_POLLING
+		// callbacks follow the controller's reports rather than TICK_TIME: average the measured interval instead.
+		if (deltaTime > 0.f && deltaTime < 1.f)
+		{
+			jc->_pollInterval = jc->_pollInterval > 0.f ? jc->_pollInterval + (deltaTime - jc->_pollInterval) * 0.05f : deltaTime;
+		}
+		float pollInterval = jc->_pollInterval > 0.f ? jc->_pollInterval : SettingsManager::get<float>(SettingID::TICK_TIME)->value() / 1000.f;
+		auto numGyroSamples = jc->getSetting(SettingID::GYRO_SMOOTH_TIME) / pollInterval;
+		if (numGyroSamples < 1)
+			numGyroSamples = 1; // need at least 1 sample
+		auto threshold = jc->getSetting(SettingID::GYRO_SMOOTH_THRESHOLD);
+		jc->getSmoothedGyro(gyroX, gyroY, gyroLength, threshold / 2.0f, threshold, int(numGyroSamples), gyroX, gyroY);
+	}
+	else
+	{
+		jc->getFilteredGyro(gyroFilter, gyroX, gyroY, deltaTime, gyroX, gyroY);
+	}
+	smoothingTimer.stop();
 	// COUT << "%d Samples for threshold: %0.4f\n", numGyroSamples, gyro_smooth_threshold * maxSmoothingSamples);
 
 	// now, honour gyro_cutoff_speed
@@ -737,27 +957,27 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	bool trackball_y_pressed = false;
 
 	// Apply gyro modifiers in the queue from oldest to newest (thus giving priority to most recent)
-	for (auto pair : jc->_context->gyroActionQueue)
+	for (auto &[id, gyroAction] : jc->_context->gyroActionQueue)
 	{
-		if (pair.second.code == GYRO_ON_BIND)
+		if (gyroAction->code == GYRO_ON_BIND)
 			blockGyro = false;
-		else if (pair.second.code == GYRO_OFF_BIND)
+		else if (gyroAction->code == GYRO_OFF_BIND)
 			blockGyro = true;
-		else if (pair.second.code == GYRO_INV_X)
+		else if (gyroAction->code == GYRO_INV_X)
 			gyro_x_sign_to_use = jc->getSetting(SettingID::GYRO_AXIS_X) * -1; // Intentionally don't support multiple inversions
-		else if (pair.second.code == GYRO_INV_Y)
+		else if (gyroAction->code == GYRO_INV_Y)
 			gyro_y_sign_to_use = jc->getSetting(SettingID::GYRO_AXIS_Y) * -1; // Intentionally don't support multiple inversions
-		else if (pair.second.code == GYRO_INVERT)
+		else if (gyroAction->code == GYRO_INVERT)
 		{
 			// Intentionally don't support multiple inversions
 			gyro_x_sign_to_use = jc->getSetting(SettingID::GYRO_AXIS_X) * -1;
 			gyro_y_sign_to_use = jc->getSetting(SettingID::GYRO_AXIS_Y) * -1;
 		}
-		else if (pair.second.code == GYRO_TRACK_X)
+		else if (gyroAction->code == GYRO_TRACK_X)
 			trackball_x_pressed = true;
-		else if (pair.second.code == GYRO_TRACK_Y)
+		else if (gyroAction->code == GYRO_TRACK_Y)
 			trackball_y_pressed = true;
-		else if (pair.second.code == GYRO_TRACKBALL)
+		else if (gyroAction->code == GYRO_TRACKBALL)
 		{
 			trackball_x_pressed = true;
 			trackball_y_pressed = true;
@@ -863,8 +1083,6 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	jc->gyroXVelocity = gyroXVelocity;
 	jc->gyroYVelocity = gyroYVelocity;
 
-	jc->_timeNow = chrono::steady_clock::now();
-
 	// sticks!
 	jc->processed_gyro_stick = false;
 	ControllerOrientation controllerOrientation = jc->getSetting<ControllerOrientation>(SettingID::CONTROLLER_ORIENTATION);
@@ -877,6 +1095,7 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		float calX = jsl->GetLeftX(jc->_handle) * float(axisSign.first);
 		float calY = jsl->GetLeftY(jc->_handle) * float(axisSign.second);
 
+		StageTimer stickTimer(Stage::LEFT_STICK);
 		jc->processStick(calX, calY, jc->_leftStick, mouseCalibrationFactor, deltaTime, leftAny, lockMouse, camSpeedX, camSpeedY);
 		jc->_leftStick.lastX = calX;
 		jc->_leftStick.lastY = calY;
@@ -888,6 +1107,7 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		float calX = jsl->GetRightX(jc->_handle) * float(axisSign.first);
 		float calY = jsl->GetRightY(jc->_handle) * float(axisSign.second);
 
+		StageTimer stickTimer(Stage::RIGHT_STICK);
 		jc->processStick(calX, calY, jc->_rightStick, mouseCalibrationFactor, deltaTime, rightAny, lockMouse, camSpeedX, camSpeedY);
 		jc->_rightStick.lastX = calX;
 		jc->_rightStick.lastY = calY;
@@ -915,7 +1135,9 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 			calY *= gravStickDeflection / gravLength2D;
 		}
 
+		StageTimer stickTimer(Stage::MOTION_STICK);
 		jc->processStick(calX, calY, jc->_motionStick, mouseCalibrationFactor, deltaTime, motionAny, lockMouse, camSpeedX, camSpeedY);
+		stickTimer.stop();
 		jc->_motionStick.lastX = calX;
 		jc->_motionStick.lastY = calY;
 
@@ -996,18 +1218,20 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		}
 	}
 
+	StageTimer buttonsTimer(Stage::BUTTONS);
 	int buttons = jsl->GetButtons(jc->_handle);
-	// button mappings
+	// button mappings. Only the buttons whose bit changed, or who have something to do, get an event.
+	jc->setButtonMask(buttons);
 	if (jc->_splitType != JS_SPLIT_TYPE_RIGHT)
 	{
-		jc->handleButtonChange(ButtonID::UP, buttons & (1 << JSOFFSET_UP));
-		jc->handleButtonChange(ButtonID::DOWN, buttons & (1 << JSOFFSET_DOWN));
-		jc->handleButtonChange(ButtonID::LEFT, buttons & (1 << JSOFFSET_LEFT));
-		jc->handleButtonChange(ButtonID::RIGHT, buttons & (1 << JSOFFSET_RIGHT));
-		jc->handleButtonChange(ButtonID::L, buttons & (1 << JSOFFSET_L));
-		jc->handleButtonChange(ButtonID::MINUS, buttons & (1 << JSOFFSET_MINUS));
-		// for backwards compatibility, we need need to account for the fact that SDL2 maps the touchpad button differently to SDL
-		jc->handleButtonChange(ButtonID::L3, buttons & (1 << JSOFFSET_LCLICK));
+		jc->handleButtons({ { ButtonID::UP, JSOFFSET_UP },
+		  { ButtonID::DOWN, JSOFFSET_DOWN },
+		  { ButtonID::LEFT, JSOFFSET_LEFT },
+		  { ButtonID::RIGHT, JSOFFSET_RIGHT },
+		  { ButtonID::L, JSOFFSET_L },
+		  { ButtonID::MINUS, JSOFFSET_MINUS },
+		  // for backwards compatibility, we need need to account for the fact that SDL2 maps the touchpad button differently to SDL
+		  { ButtonID::L3, JSOFFSET_LCLICK } });
 
 		float lTrigger = jsl->GetLeftTrigger(jc->_handle);
 		jc->handleTriggerChange(ButtonID::ZL, ButtonID::ZLF, jc->getSetting<TriggerMode>(SettingID::ZL_MODE), lTrigger, jc->_leftEffect);
@@ -1017,14 +1241,12 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		{
 		case JS_TYPE_DS:
 			// JSL mapps mic button on the SL index
-			// Edge grips
-			jc->handleButtonChange(ButtonID::LSL, buttons & (1 << JSOFFSET_SL));
-			jc->handleButtonChange(ButtonID::RSR, buttons & (1 << JSOFFSET_SR));
-			// Edge FN
-			jc->handleButtonChange(ButtonID::LSR, buttons & (1 << JSOFFSET_FNL));
-			jc->handleButtonChange(ButtonID::RSL, buttons & (1 << JSOFFSET_FNR));
-
-			jc->handleButtonChange(ButtonID::MIC, buttons & (1 << JSOFFSET_MIC));
+			// Edge grips, Edge FN and mic
+			jc->handleButtons({ { ButtonID::LSL, JSOFFSET_SL },
+			  { ButtonID::RSR, JSOFFSET_SR },
+			  { ButtonID::LSR, JSOFFSET_FNL },
+			  { ButtonID::RSL, JSOFFSET_FNR },
+			  { ButtonID::MIC, JSOFFSET_MIC } });
 			// Don't break but continue onto DS4 stuff too
 		case JS_TYPE_DS4:
 		{
@@ -1035,40 +1257,39 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		}
 		break;
 		case JS_TYPE_XBOXONE_ELITE:
-			jc->handleButtonChange(ButtonID::LSL, buttons & (1 << JSOFFSET_SL)); // Xbox Elite back paddles
-			jc->handleButtonChange(ButtonID::RSR, buttons & (1 << JSOFFSET_SR));
-			jc->handleButtonChange(ButtonID::LSR, buttons & (1 << JSOFFSET_FNL));
-			jc->handleButtonChange(ButtonID::RSL, buttons & (1 << JSOFFSET_FNR));
+			// Xbox Elite back paddles
+			jc->handleButtons({ { ButtonID::LSL, JSOFFSET_SL },
+			  { ButtonID::RSR, JSOFFSET_SR },
+			  { ButtonID::LSR, JSOFFSET_FNL },
+			  { ButtonID::RSL, JSOFFSET_FNR } });
 			break;
 		case JS_TYPE_XBOX_SERIES:
-			jc->handleButtonChange(ButtonID::CAPTURE, buttons & (1 << JSOFFSET_CAPTURE));
+			jc->handleButtons({ { ButtonID::CAPTURE, JSOFFSET_CAPTURE } });
 			break;
 		default: // Switch Pro controllers and left joycon
-		{
-			jc->handleButtonChange(ButtonID::CAPTURE, buttons & (1 << JSOFFSET_CAPTURE));
-			jc->handleButtonChange(ButtonID::LSL, buttons & (1 << JSOFFSET_SL));
-			jc->handleButtonChange(ButtonID::LSR, buttons & (1 << JSOFFSET_SR));
-		}
-		break;
+			jc->handleButtons({ { ButtonID::CAPTURE, JSOFFSET_CAPTURE },
+			  { ButtonID::LSL, JSOFFSET_SL },
+			  { ButtonID::LSR, JSOFFSET_SR } });
+			break;
 		}
 	}
 	else // split type IS right
 	{
 		// Right joycon bumpers
-		jc->handleButtonChange(ButtonID::RSL, buttons & (1 << JSOFFSET_SL));
-		jc->handleButtonChange(ButtonID::RSR, buttons & (1 << JSOFFSET_SR));
+		jc->handleButtons({ { ButtonID::RSL, JSOFFSET_SL },
+		  { ButtonID::RSR, JSOFFSET_SR } });
 	}
 
 	if (jc->_splitType != JS_SPLIT_TYPE_LEFT)
 	{
-		jc->handleButtonChange(ButtonID::E, buttons & (1 << JSOFFSET_E));
-		jc->handleButtonChange(ButtonID::S, buttons & (1 << JSOFFSET_S));
-		jc->handleButtonChange(ButtonID::N, buttons & (1 << JSOFFSET_N));
-		jc->handleButtonChange(ButtonID::W, buttons & (1 << JSOFFSET_W));
-		jc->handleButtonChange(ButtonID::R, buttons & (1 << JSOFFSET_R));
-		jc->handleButtonChange(ButtonID::PLUS, buttons & (1 << JSOFFSET_PLUS));
-		jc->handleButtonChange(ButtonID::HOME, buttons & (1 << JSOFFSET_HOME));
-		jc->handleButtonChange(ButtonID::R3, buttons & (1 << JSOFFSET_RCLICK));
+		jc->handleButtons({ { ButtonID::E, JSOFFSET_E },
+		  { ButtonID::S, JSOFFSET_S },
+		  { ButtonID::N, JSOFFSET_N },
+		  { ButtonID::W, JSOFFSET_W },
+		  { ButtonID::R, JSOFFSET_R },
+		  { ButtonID::PLUS, JSOFFSET_PLUS },
+		  { ButtonID::HOME, JSOFFSET_HOME },
+		  { ButtonID::R3, JSOFFSET_RCLICK } });
 
 		float rTrigger = jsl->GetRightTrigger(jc->_handle);
 		jc->handleTriggerChange(ButtonID::ZR, ButtonID::ZRF, jc->getSetting<TriggerMode>(SettingID::ZR_MODE), rTrigger, jc->_rightEffect);
@@ -1076,10 +1297,12 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	else
 	{
 		// Left joycon bumpers
-		jc->handleButtonChange(ButtonID::LSL, buttons & (1 << JSOFFSET_SL));
-		jc->handleButtonChange(ButtonID::LSR, buttons & (1 << JSOFFSET_SR));
+		jc->handleButtons({ { ButtonID::LSL, JSOFFSET_SL },
+		  { ButtonID::LSR, JSOFFSET_SR } });
 	}
 
+	buttonsTimer.stop();
+
 	auto at = jc->getSetting<Switch>(SettingID::ADAPTIVE_TRIGGER);
 	if (at == Switch::OFF)
 	{
@@ -1094,14 +1317,14 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 		  rightEffect.mode == AdaptiveTriggerMode::ON ? jc->_rightEffect : rightEffect);
 	}
 
-	bool currentMicToggleState = find_if(jc->_context->activeTogglesQueue.cbegin(), jc->_context->activeTogglesQueue.cend(),
-	                               [](const auto &pair)
-	                               {
-		                               return pair.first == ButtonID::MIC;
-	                               }) != jc->_context->activeTogglesQueue.cend();
-	for (auto controller : handle_to_joyshock)
+	bool currentMicToggleState = jc->_context->hasActiveToggle(ButtonID::MIC);
+	if (currentMicToggleState != jc->_micLight)
 	{
-		jsl->SetMicLight(controller.first, currentMicToggleState ? 1 : 0);
+		for (auto controller : handle_to_joyshock)
+		{
+			jsl->SetMicLight(controller.first, currentMicToggleState ? 1 : 0);
+		}
+		jc->_micLight = currentMicToggleState;
 	}
 
 	GyroOutput gyroOutput = jc->getSetting<GyroOutput>(SettingID::GYRO_OUTPUT);
@@ -1131,7 +1354,7 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	{
 		// COUT << "GX: %0.4f GY: %0.4f GZ: %0.4f\n", imuState.gyroX, imuState.gyroY, imuState.gyroZ);
 		float mouseCalibration = jc->getSetting(SettingID::REAL_WORLD_CALIBRATION) / os_mouse_speed / jc->getSetting(SettingID::IN_GAME_SENS);
-		shapedSensitivityMoveMouse(gyroXVelocity * mouseCalibration, gyroYVelocity * mouseCalibration, deltaTime, camSpeedX, -camSpeedY);
+		shapedSensitivityMoveMouse(gyroXVelocity * mouseCalibration, gyroYVelocity * mouseCalibration, motionDeltaTime, camSpeedX, -camSpeedY);
 	}
 
 	if (jc->_context->_vigemController)
@@ -1148,7 +1371,10 @@ void joyShockPollCallback(int jcHandle, JOY_SHOCK_STATE state, JOY_SHOCK_STATE l
 	{
 		jc->_context->nn = (jc->_context->nn + 1) % 22;
 	}
-	jc->_context->callback_lock.unlock();
+	if (!OutputCapture::active())
+	{
+		buttonDeadlines.watch(jc);
+	}
 }
 
 void connectDevices(bool mergeJoycons = true)
@@ -1334,6 +1560,103 @@ bool do_RECONNECT_CONTROLLERS(string_view arguments)
 	return true;
 }
 
+bool do_RECORD(string_view arguments)
+{
+	string fileName;
+	stringstream ss{ string(arguments) };
+	ss >> quoted(fileName);
+	auto recorder = dynamic_pointer_cast<JslRecorder>(jsl);
+	if (!recorder && (fileName.empty() || fileName.compare("OFF") == 0))
+	{
+		CERR << "Nothing is being recorded\n";
+		return true;
+	}
+
+	// No callback can run while the backend is being swapped
+	jsl->DisconnectAndDisposeAll();
+	if (recorder)
+	{
+		jsl = recorder->GetDevice();
+		COUT << "Stopped recording\n";
+	}
+	if (!fileName.empty() && fileName.compare("OFF") != 0)
+	{
+		JslRecorder *newRecorder = JslRecorder::getNew(jsl, fileName);
+		if (newRecorder)
+		{
+			jsl.reset(newRecorder);
+			COUT << "Recording controller input and commands to ";
+			COUT_INFO << fileName << '\n';
+		}
+		else
+		{
+			CERR << "Cannot create the file " << fileName << '\n';
+		}
+	}
+	return do_RECONNECT_CONTROLLERS("");
+}
+
+bool do_REPLAY(CmdRegistry *registry, string_view arguments)
+{
+	string recordingFile, outputFile;
+	stringstream ss{ string(arguments) };
+	ss >> quoted(recordingFile) >> quoted(outputFile);
+	if (recordingFile.empty())
+	{
+		CERR << "Specify the recording to replay\n";
+		return false;
+	}
+	shared_ptr<JslReplay> replay(JslReplay::getNew(recordingFile));
+	if (!replay)
+	{
+		return false;
+	}
+	ofstream output;
+	if (!outputFile.empty())
+	{
+		output.open(outputFile, ios::trunc);
+		if (!output)
+		{
+			CERR << "Cannot create the file " << outputFile << '\n';
+			return false;
+		}
+	}
+
+	COUT << "Replaying ";
+	COUT_INFO << recordingFile << '\n';
+	// Everything the mapping sends, including from the recorded commands, goes to the output log instead of the OS
+	ReplayOutputLog outputLog(*replay, output.is_open() ? &output : nullptr);
+	outputLog.start();
+	auto device = jsl;
+	device->DisconnectAndDisposeAll();
+	jsl = replay;
+	connectDevices();
+	jsl->SetCallback(&joyShockPollCallback);
+	jsl->SetTouchCallback(&touchCallback);
+
+	auto start = chrono::steady_clock::now();
+	size_t polls = replay->Replay([registry](const string &line)
+	  {
+		  // Stopping the recording got recorded too
+		  auto start = line.find_first_not_of(" \t");
+		  if (start != string::npos && line.compare(start, 6, "RECORD") != 0 && line.compare(start, 6, "REPLAY") != 0)
+		  {
+			  registry->processLine(line);
+		  } });
+	float seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+
+	handle_to_joyshock.clear(); // Release what is held at the end of the recording while the output is still captured
+	outputLog.stop();
+	jsl = device;
+	COUT << "Replayed " << polls << " polls in " << seconds << " seconds";
+	if (seconds > 0.f)
+	{
+		COUT << " (" << int(polls / seconds) << " polls per second)";
+	}
+	COUT << '\n';
+	return do_RECONNECT_CONTROLLERS("");
+}
+
 bool do_COUNTER_OS_MOUSE_SPEED()
 {
 	COUT << "Countering OS mouse speed setting\n";
@@ -1412,6 +1735,94 @@ bool do_SET_MOTION_STICK_NEUTRAL()
 	return true;
 }
 
+bool do_SENSOR_REPORTS()
+{
+	if (SettingsManager::getV<Switch>(SettingID::SENSOR_TIMESTAMPS)->value() != Switch::ON)
+	{
+		COUT << "Report counters require ";
+		COUT_INFO << "SENSOR_TIMESTAMPS = ON";
+		COUT << '\n';
+	}
+	for (auto iter = handle_to_joyshock.begin(); iter != handle_to_joyshock.end(); ++iter)
+	{
+		COUT << "Device " << iter->first << ": " << iter->second->_droppedReports << " dropped reports, "
+		     << iter->second->_duplicateReports << " duplicated reports\n";
+	}
+	return true;
+}
+
+bool do_OUTPUT_STATS()
+{
+	if (SettingsManager::getV<Switch>(SettingID::OUTPUT_THREAD)->value() != Switch::ON)
+	{
+		COUT << "Output statistics require ";
+		COUT_INFO << "OUTPUT_THREAD = ON";
+		COUT << '\n';
+	}
+	for (auto iter = handle_to_joyshock.begin(); iter != handle_to_joyshock.end(); ++iter)
+	{
+		auto metrics = iter->second->_outputQueue.metrics();
+		auto averageUs = metrics.events > 0 ? chrono::duration<float, micro>(metrics.totalLatency).count() / metrics.events : 0.f;
+		COUT << "Device " << iter->first << ": " << metrics.events << " events sent, " << metrics.depth << " waiting, at most "
+		     << metrics.maxDepth << " waiting, " << metrics.stalls << " stalls, " << averageUs << "us average latency, "
+		     << chrono::duration<float, micro>(metrics.maxLatency).count() << "us max latency\n";
+		iter->second->_outputQueue.resetMetrics();
+		uint64_t packets, coalesced;
+		if (jsl->GetOutputReportStats(iter->first, packets, coalesced))
+		{
+			COUT << "Device " << iter->first << ": " << packets << " effect packets sent, " << coalesced << " changes merged into them\n";
+		}
+	}
+	return true;
+}
+
+bool do_STATS(string_view argument)
+{
+	if (argument == "RESET")
+	{
+		LatencyStats::reset();
+		COUT << "Latency statistics cleared\n";
+		return true;
+	}
+	if (!argument.empty())
+	{
+		return false;
+	}
+	if (!LatencyStats::enabled())
+	{
+		COUT << "Latency statistics require ";
+		COUT_INFO << "LATENCY_STATS = ON";
+		COUT << '\n';
+	}
+	stringstream table;
+	LatencyStats::print(table, LatencyStats::summarize());
+	COUT << table.str();
+	return true;
+}
+
+bool do_TRACE(string_view argument)
+{
+	if (argument == "STOP")
+	{
+		if (Trace::enabled())
+		{
+			Trace::stop();
+			COUT << "Trace written to " << Trace::fileName() << '\n';
+		}
+		return true;
+	}
+	string fileName = argument.empty() ? "trace.json" : string(argument);
+	if (!Trace::start(fileName))
+	{
+		CERR << "Cannot write " << fileName << " in " << GetCWD() << '\n';
+		return false;
+	}
+	COUT << "Tracing to " << fileName << " until ";
+	COUT_INFO << "TRACE STOP";
+	COUT << '\n';
+	return true;
+}
+
 bool do_SLEEP(string_view argument)
 {
 	// first, check for a parameter
@@ -1778,6 +2189,8 @@ void cleanUp()
 	HideConsole();
 	jsl->DisconnectAndDisposeAll();
 	handle_to_joyshock.clear(); // Destroy Vigem Gamepads
+	releaseVirtualDevices();
+	Trace::stop();
 	ReleaseConsole();
 }
 
@@ -1983,15 +2396,14 @@ ControllerScheme updateVirtualController(ControllerScheme prevScheme, Controller
 	bool success = true;
 	for (auto &js : handle_to_joyshock)
 	{
+		// Destroyed once the lock is released: a gamepad waits for its notifications, which take the lock
+		unique_ptr<Gamepad> previous;
 		lock_guard guard(js.second->_context->callback_lock);
 		if (!js.second->_context->_vigemController ||
 		  js.second->_context->_vigemController->getType() != nextScheme)
 		{
-			if (nextScheme == ControllerScheme::NONE)
-			{
-				js.second->_context->_vigemController.reset(nullptr);
-			}
-			else
+			previous = move(js.second->_context->_vigemController);
+			if (nextScheme != ControllerScheme::NONE)
 			{
 				js.second->_context->_vigemController.reset(Gamepad::getNew(nextScheme, bind(&JoyShock::onVirtualControllerNotification, js.second.get(), placeholders::_1, placeholders::_2, placeholders::_3)));
 				success &= js.second->_context->_vigemController && js.second->_context->_vigemController->isInitialized(&error);
@@ -2509,6 +2921,37 @@ void initJsmSettings(CmdRegistry *commandRegistry)
 	commandRegistry->add((new JSMAssignment<float>(*gyro_smooth_threshold))
 	                       ->setHelp("When the controller's angular velocity is below this threshold (in degrees per second), smoothing will be applied."));
 
+	auto gyro_smooth_kernel = new JSMSetting<SmoothingKernel>(SettingID::GYRO_SMOOTH_KERNEL, SmoothingKernel::BOX);
+	gyro_smooth_kernel->setFilter(&filterInvalidValue<SmoothingKernel, SmoothingKernel::INVALID>);
+	SettingsManager::add(gyro_smooth_kernel);
+	commandRegistry->add((new JSMAssignment<SmoothingKernel>(*gyro_smooth_kernel))
+	                       ->setHelp("How the gyro smoothing window weighs past samples:\n\tBOX averages all the samples of the window equally\n\tEXPONENTIAL gives recent samples more weight, for the same average delay without the sudden drop at the end of the window"));
+
+	auto gyro_filter = new JSMSetting<GyroFilter>(SettingID::GYRO_FILTER, GyroFilter::SMOOTH);
+	gyro_filter->setFilter(&filterInvalidValue<GyroFilter, GyroFilter::INVALID>);
+	SettingsManager::add(gyro_filter);
+	commandRegistry->add((new JSMAssignment<GyroFilter>(*gyro_filter))
+	                       ->setHelp("Filter applied to the gyro before it moves the mouse:\n\tSMOOTH uses GYRO_SMOOTH_TIME and GYRO_SMOOTH_THRESHOLD\n\tONE_EURO filters slow motion at GYRO_FILTER_CUTOFF and raises the cutoff with speed according to GYRO_FILTER_BETA\n\tLOW_PASS removes what changes faster than GYRO_FILTER_CUTOFF\n\tKALMAN tracks the angular velocity and its rate of change with a bandwidth of GYRO_FILTER_CUTOFF, and can predict it GYRO_FILTER_PREDICTION ahead"));
+
+	auto gyro_filter_cutoff = new JSMSetting<float>(SettingID::GYRO_FILTER_CUTOFF, 10.0f);
+	gyro_filter_cutoff->setFilter([](float current, float next) -> float
+	  { return next > 0.f ? next : current; });
+	SettingsManager::add(gyro_filter_cutoff);
+	commandRegistry->add((new JSMAssignment<float>(*gyro_filter_cutoff))
+	                       ->setHelp("Cutoff frequency in Hz of the gyro filter. Lower values remove more jitter but add more lag."));
+
+	auto gyro_filter_beta = new JSMSetting<float>(SettingID::GYRO_FILTER_BETA, 0.05f);
+	gyro_filter_beta->setFilter(&filterPositive);
+	SettingsManager::add(gyro_filter_beta);
+	commandRegistry->add((new JSMAssignment<float>(*gyro_filter_beta))
+	                       ->setHelp("How much the cutoff frequency of the ONE_EURO gyro filter rises, in Hz per degree per second squared of angular acceleration."));
+
+	auto gyro_filter_prediction = new JSMSetting<float>(SettingID::GYRO_FILTER_PREDICTION, 0.0f);
+	gyro_filter_prediction->setFilter(&filterPositive);
+	SettingsManager::add(gyro_filter_prediction);
+	commandRegistry->add((new JSMAssignment<float>(*gyro_filter_prediction))
+	                       ->setHelp("Time in seconds the KALMAN gyro filter predicts the angular velocity ahead to make up for its lag."));
+
 	auto gyro_cutoff_speed = new JSMSetting<float>(SettingID::GYRO_CUTOFF_SPEED, 0.0f);
 	gyro_cutoff_speed->setFilter(&filterPositive);
 	SettingsManager::add(gyro_cutoff_speed);
@@ -2685,6 +3128,86 @@ void initJsmSettings(CmdRegistry *commandRegistry)
 	commandRegistry->add((new JSMAssignment<float>("TICK_TIME", *tick_time))
 	                       ->setHelp("Sets the time in milliseconds that JoyShockMaper waits before reading from each controller again."));
 
+	auto sensor_timestamps = new JSMVariable<Switch>(Switch::OFF);
+	sensor_timestamps->setFilter(&filterInvalidValue<Switch, Switch::INVALID>);
+	SettingsManager::add(SettingID::SENSOR_TIMESTAMPS, sensor_timestamps);
+	commandRegistry->add((new JSMAssignment<Switch>(magic_enum::enum_name(SettingID::SENSOR_TIMESTAMPS).data(), *sensor_timestamps))
+	                       ->setHelp("(SDL2 only) When ON, every sensor report the controller sent since the last poll is processed, each over the time elapsed since the previous report, instead of only the latest one over the time between polls. Valid values are ON and OFF."));
+
+	auto event_polling = new JSMVariable<Switch>(Switch::OFF);
+	event_polling->setFilter(&filterInvalidValue<Switch, Switch::INVALID>);
+	SettingsManager::add(SettingID::EVENT_POLLING, event_polling);
+	commandRegistry->add((new JSMAssignment<Switch>(magic_enum::enum_name(SettingID::EVENT_POLLING).data(), *event_polling))
+	                       ->setHelp("(SDL2 only) When ON, controllers are processed as soon as they send a new report instead of waiting for TICK_TIME. TICK_TIME is still used for controllers that don't send any. Valid values are ON and OFF."));
+
+	auto parallel_mapping = new JSMVariable<Switch>(Switch::OFF);
+	parallel_mapping->setFilter(&filterInvalidValue<Switch, Switch::INVALID>);
+	SettingsManager::add(SettingID::PARALLEL_MAPPING, parallel_mapping);
+	commandRegistry->add((new JSMAssignment<Switch>(magic_enum::enum_name(SettingID::PARALLEL_MAPPING).data(), *parallel_mapping))
+	                       ->setHelp("(SDL2 only) When ON, the mapping of each controller runs on its own worker thread when several controllers are connected. Their keyboard and mouse output then goes through the output thread, as if OUTPUT_THREAD were ON. Valid values are ON and OFF."));
+
+	auto output_thread = new JSMVariable<Switch>(Switch::OFF);
+	output_thread->setFilter(&filterInvalidValue<Switch, Switch::INVALID>);
+	SettingsManager::add(SettingID::OUTPUT_THREAD, output_thread);
+	commandRegistry->add((new JSMAssignment<Switch>(magic_enum::enum_name(SettingID::OUTPUT_THREAD).data(), *output_thread))
+	                       ->setHelp("When ON, the keyboard and mouse output is sent to the OS by a thread of its own, so that a slow write never delays the mapping. OUTPUT_STATS shows how long the output waited. Valid values are ON and OFF."));
+
+	auto output_report_rate = new JSMVariable<float>(125.0f);
+	output_report_rate->setFilter(&filterPositive);
+	SettingsManager::add(SettingID::OUTPUT_REPORT_RATE, output_report_rate);
+	commandRegistry->add((new JSMAssignment<float>(magic_enum::enum_name(SettingID::OUTPUT_REPORT_RATE).data(), *output_report_rate))
+	                       ->setHelp("(SDL2 only) Most effect packets per second sent to a DualSense. The rumble, adaptive trigger, light bar and mic light changes in between are merged into the next one, so that they don't delay the input reports over Bluetooth. 0 sends them with every tick."));
+
+	auto latency_stats = new JSMVariable<Switch>(Switch::OFF);
+	latency_stats->setFilter(&filterInvalidValue<Switch, Switch::INVALID>)->addOnChangeListener([](Switch newValue)
+	  { LatencyStats::setEnabled(newValue == Switch::ON); });
+	SettingsManager::add(SettingID::LATENCY_STATS, latency_stats);
+	commandRegistry->add((new JSMAssignment<Switch>(magic_enum::enum_name(SettingID::LATENCY_STATS).data(), *latency_stats))
+	                       ->setHelp("When ON, JSM measures how long each stage takes between reading a controller and sending the output to the OS. STATS shows the median, 99th percentile and longest time of each stage. Valid values are ON and OFF."));
+
+	auto latency_stats_period = new JSMVariable<float>(0.0f);
+	latencyStatsThread.reset(new PollingThread("Latency stats thread", [](void *param)
+	  {
+		  static auto lastDump = chrono::steady_clock::now();
+		  auto period = SettingsManager::get<float>(SettingID::LATENCY_STATS_PERIOD)->value();
+		  auto now = chrono::steady_clock::now();
+		  if (LatencyStats::enabled() && chrono::duration<float>(now - lastDump).count() >= period)
+		  {
+			  lastDump = now;
+			  if (!LatencyStats::append("latency_stats.csv", LatencyStats::summarize()))
+			  {
+				  CERR << "Cannot write latency_stats.csv in " << GetCWD() << '\n';
+			  }
+		  }
+		  return true;
+	  },
+	  nullptr, 1000, false));
+	latency_stats_period->setFilter(&filterPositive)->addOnChangeListener([](float newValue)
+	  { updateThread(latencyStatsThread.get(), newValue > 0.f ? Switch::ON : Switch::OFF); });
+	SettingsManager::add(SettingID::LATENCY_STATS_PERIOD, latency_stats_period);
+	commandRegistry->add((new JSMAssignment<float>(magic_enum::enum_name(SettingID::LATENCY_STATS_PERIOD).data(), *latency_stats_period))
+	                       ->setHelp("Number of seconds between each time the latency statistics are added to latency_stats.csv in the working directory, while LATENCY_STATS is ON. 0 never writes them."));
+
+	auto virtual_devices = new JSMVariable<VirtualDevices>(VirtualDevices::SEPARATE);
+	virtual_devices->setFilter(&filterInvalidValue<VirtualDevices, VirtualDevices::INVALID>)->addOnChangeListener([](auto) { updateVirtualDevices(); });
+	SettingsManager::add(SettingID::VIRTUAL_DEVICES, virtual_devices);
+	commandRegistry->add((new JSMAssignment<VirtualDevices>(magic_enum::enum_name(SettingID::VIRTUAL_DEVICES).data(), *virtual_devices))
+	                       ->setHelp("(Linux only) SEPARATE sends the keyboard, the mouse and the absolute pointer of the mouse area and mouse ring modes through devices of their own, so that the desktop doesn't mistake the mouse for a tablet. COMBINED sends everything through a single device. Valid values are SEPARATE and COMBINED."));
+
+	auto virtual_mouse_rate = new JSMVariable<float>(0.0f);
+	virtual_mouse_rate->setFilter(&filterPositive)->addOnChangeListener([](auto) { updateVirtualDevices(); });
+	SettingsManager::add(SettingID::VIRTUAL_MOUSE_RATE, virtual_mouse_rate);
+	commandRegistry->add((new JSMAssignment<float>(magic_enum::enum_name(SettingID::VIRTUAL_MOUSE_RATE).data(), *virtual_mouse_rate))
+	                       ->setHelp("(Linux only) Most times per second the virtual mouse reports motion, like the polling rate of a real mouse. Motion in between is added up. Buttons are never held back. The default 0 reports with every tick."));
+
+	auto virtual_pointer_resolution = new JSMVariable(FloatXY{ 1920.f, 1080.f });
+	virtual_pointer_resolution->setFilter([](auto current, auto next)
+	  { return next.x() >= 2.f && next.y() >= 2.f ? FloatXY{ floorf(next.x()), floorf(next.y()) } : current; })
+	  ->addOnChangeListener([](auto) { updateVirtualDevices(); });
+	SettingsManager::add(SettingID::VIRTUAL_POINTER_RESOLUTION, virtual_pointer_resolution);
+	commandRegistry->add((new JSMAssignment<FloatXY>(magic_enum::enum_name(SettingID::VIRTUAL_POINTER_RESOLUTION).data(), *virtual_pointer_resolution))
+	                       ->setHelp("(Linux only) Number of positions across and down the screen the absolute pointer can take. Set it to the resolution of the screen so that every position is a pixel."));
+
 	auto light_bar = new JSMSetting<Color>(SettingID::LIGHT_BAR, 0xFFFFFF);
 	// light_bar needs no filter or listener. The callback polls and updates the color.
 	SettingsManager::add(light_bar);
@@ -2979,6 +3502,7 @@ void initJsmSettings(CmdRegistry *commandRegistry)
 
 }
 
+#ifndef JSM_BENCHMARK // The benchmark provides its own entry point
 #ifdef _WIN32
 int __stdcall wWinMain(HINSTANCE hInstance, HINSTANCE prevInstance, LPWSTR cmdLine, int cmdShow)
 {
@@ -3086,6 +3610,12 @@ int main(int argc, char *argv[])
 	commandRegistry.add((new JSMMacro("SLEEP"))->SetMacro(bind(&do_SLEEP, placeholders::_2))->setHelp("Sleep for the given number of seconds, or one second if no number is given. Can't sleep more than 10 seconds per command."));
 	commandRegistry.add((new JSMMacro("FINISH_GYRO_CALIBRATION"))->SetMacro(bind(&do_FINISH_GYRO_CALIBRATION))->setHelp("Finish calibrating the gyro in all controllers."));
 	commandRegistry.add((new JSMMacro("RESTART_GYRO_CALIBRATION"))->SetMacro(bind(&do_RESTART_GYRO_CALIBRATION))->setHelp("Start calibrating the gyro in all controllers."));
+	commandRegistry.add((new JSMMacro("RECORD"))->SetMacro(bind(&do_RECORD, placeholders::_2))->setHelp("Record the controller input and the commands entered to the given file, to replay them later with REPLAY. Enter RECORD OFF to stop recording."));
+	commandRegistry.add((new JSMMacro("REPLAY"))->SetMacro(bind(&do_REPLAY, &commandRegistry, placeholders::_2))->setHelp("Replay a file made with RECORD as fast as possible, using the current configuration, and report how long it took. Nothing is sent to the OS: give a second file name to write the mouse, key and virtual controller output to it instead."));
+	commandRegistry.add((new JSMMacro("SENSOR_REPORTS"))->SetMacro(bind(&do_SENSOR_REPORTS))->setHelp("Display how many sensor reports were dropped or duplicated by each controller since it connected."));
+	commandRegistry.add((new JSMMacro("OUTPUT_STATS"))->SetMacro(bind(&do_OUTPUT_STATS))->setHelp("Display how much keyboard and mouse output each controller sent through the output thread, how much of it waited in its queue and for how long, and how many effect packets went to each DualSense, since the last time this command was entered."));
+	commandRegistry.add((new JSMMacro("STATS"))->SetMacro(bind(&do_STATS, placeholders::_2))->setHelp("Display how long each stage from reading a controller to sending the output took while LATENCY_STATS was ON: the number of times it ran, the median, the 99th percentile and the longest time, in microseconds. STATS RESET clears them."));
+	commandRegistry.add((new JSMMacro("TRACE"))->SetMacro(bind(&do_TRACE, placeholders::_2))->setHelp("Write the controller reports, the stages of the mapping, the button state changes and the output sent to the OS to the given file, or trace.json, until TRACE STOP is entered. Open the file in Perfetto or chrome://tracing."));
 	commandRegistry.add((new JSMMacro("SET_MOTION_STICK_NEUTRAL"))->SetMacro(bind(&do_SET_MOTION_STICK_NEUTRAL))->setHelp("Set the neutral orientation for motion stick to whatever the orientation of the controller is."));
 	commandRegistry.add((new JSMMacro("README"))->SetMacro(bind(&do_README))->setHelp("Open the latest JoyShockMapper README in your browser."));
 	commandRegistry.add((new JSMMacro("WHITELIST_SHOW"))->SetMacro(bind(&do_WHITELIST_SHOW))->setHelp("Open the whitelister application"));
@@ -3170,6 +3700,10 @@ int main(int argc, char *argv[])
         #endif
 		
 
+		if (auto recorder = dynamic_pointer_cast<JslRecorder>(jsl))
+		{
+			recorder->RecordCommand(enteredCommand);
+		}
 		commandRegistry.processLine(enteredCommand);
 	}
 #ifdef _WIN32
@@ -3178,3 +3712,4 @@ int main(int argc, char *argv[])
 	cleanUp();
 	return 0;
 }
+#endif // JSM_BENCHMARK
@@ -1,5 +1,6 @@
 #include <Windows.h>
 #include "Gamepad.h"
+#include "InputHelpers.h"
 #include "ViGEm/Client.h"
 #include "PlatformDefinitions.h"
 #include <algorithm>
@@ -897,6 +898,8 @@ void Ds4Gamepad::setButton(KeyCode btn, bool pressed)
 
 Gamepad *Gamepad::getNew(ControllerScheme scheme, Callback notification)
 {
+	if (auto capture = OutputCapture::active())
+		return capture->newGamepad(scheme);
 	switch (scheme)
 	{
 	case ControllerScheme::XBOX:
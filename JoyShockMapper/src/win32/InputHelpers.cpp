@@ -1,4 +1,5 @@
 #include "InputHelpers.h"
+#include "LatencyStats.h"
 #include <thread>
 
 #include <unordered_map>
@@ -44,6 +45,40 @@ float getMouseSpeed()
 	return 1.0;
 }
 
+namespace
+{
+// Inputs of the calling thread waiting for the end of its outermost OutputFrame
+thread_local vector<INPUT> pendingInputs;
+thread_local int outputFrameDepth = 0;
+
+UINT sendInput(INPUT &input)
+{
+	if (outputFrameDepth > 0)
+	{
+		pendingInputs.push_back(input);
+		return 1;
+	}
+	StageTimer injectionTimer(Stage::INJECTION);
+	return SendInput(1, &input, sizeof(input));
+}
+} // namespace
+
+OutputFrame::OutputFrame()
+{
+	++outputFrameDepth;
+}
+
+OutputFrame::~OutputFrame()
+{
+	// SendInput inserts an array of inputs without letting any other input in between
+	if (--outputFrameDepth == 0 && !pendingInputs.empty())
+	{
+		StageTimer injectionTimer(Stage::INJECTION);
+		SendInput(UINT(pendingInputs.size()), pendingInputs.data(), sizeof(INPUT));
+		pendingInputs.clear();
+	}
+}
+
 // Map a VK id to mouse event id press (0) or release (1) and mouseData (2) complementary info
 unordered_map<WORD, tuple<DWORD, DWORD, DWORD>> mouseMaps = {
 	{ VK_LBUTTON, { MOUSEEVENTF_LEFTDOWN, MOUSEEVENTF_LEFTUP, 0 } },
@@ -56,8 +91,16 @@ unordered_map<WORD, tuple<DWORD, DWORD, DWORD>> mouseMaps = {
 };
 
 // send mouse button
-int pressMouse(KeyCode vkKey, bool isPressed)
+int pressMouse(const KeyCode &vkKey, bool isPressed)
 {
+	if (OutputQueue::push({ OutputEvent::Type::MOUSE_BUTTON, isPressed, vkKey.code }))
+		return 0;
+	if (auto capture = OutputCapture::active())
+	{
+		capture->pressMouse(vkKey.code, isPressed);
+		return 0;
+	}
+	traceButtonOutput("Mouse button", vkKey.code, isPressed);
 	// https://docs.microsoft.com/en-us/windows/win32/api/winuser/ns-winuser-mouseinput
 	auto val = mouseMaps[vkKey.code];
 
@@ -70,7 +113,7 @@ int pressMouse(KeyCode vkKey, bool isPressed)
 	input.mi.mouseData = get<2>(val);
 	if (input.mi.dwFlags)
 	{ // Ignore if there's no event ID (ex: "wheel release")
-		auto result = SendInput(1, &input, sizeof(input));
+		auto result = sendInput(input);
 		//COUT << key.name << '\n';
 		//COUT << key.key << '\n';
 		return result;
@@ -97,13 +140,13 @@ int pressMouse(KeyCode vkKey, bool isPressed)
 //	return SendInput(1, &input, sizeof(input));
 //}
 
-bool isNumLockKey(KeyCode key)
+bool isNumLockKey(const KeyCode &key)
 {
 	static array<uint8_t, 7> keys { VK_DECIMAL, VK_HOME, VK_END, VK_INSERT, VK_DELETE, VK_PRIOR, VK_NEXT};
 	return (key.code >= VK_NUMPAD0 && key.code <= VK_NUMPAD9) || find(keys.begin(), keys.end(), key.code) != keys.end();
 }
 
-bool isExtendedKey(KeyCode key)
+bool isExtendedKey(const KeyCode &key)
 {
 	return ((key.code >= VK_PRIOR && key.code <= VK_HELP) && key.code != VK_SNAPSHOT) ||
 		(key.code >= VK_LWIN && key.code <= VK_DIVIDE) ||
@@ -111,12 +154,20 @@ bool isExtendedKey(KeyCode key)
 }
 
 // send key press
-int pressKey(KeyCode vkKey, bool pressed)
+int pressKey(const KeyCode &vkKey, bool pressed)
 {
+	if (OutputQueue::push({ OutputEvent::Type::KEY, pressed, vkKey.code }))
+		return 0;
+	if (auto capture = OutputCapture::active())
+	{
+		capture->pressKey(vkKey, pressed);
+		return 0;
+	}
 	if (vkKey.code == 0)
 		return 0;
 	if (vkKey.code <= V_WHEEL_DOWN) // Highest mouse ID
 		return pressMouse(vkKey, pressed);
+	traceButtonOutput("Key", vkKey.code, pressed);
 
 	INPUT input;
 	memset(&input, 0, sizeof(INPUT));
@@ -140,16 +191,22 @@ int pressKey(KeyCode vkKey, bool pressed)
 		input.ki.dwFlags |= KEYEVENTF_SCANCODE;
 	}
 
-	return SendInput(1, &input, sizeof(input));
+	return sendInput(input);
 }
 
 void moveMouse(float x, float y)
 {
+	if (OutputQueue::push({ OutputEvent::Type::MOVE, false, 0, x, y }))
+		return;
+	if (auto capture = OutputCapture::active())
+		return capture->moveMouse(x, y);
+	traceMotionOutput("Mouse move", x, y);
 	accumulatedX += x;
 	accumulatedY += y;
 
-	int applicableX = (int)accumulatedX;
-	int applicableY = (int)accumulatedY;
+	// Round rather than truncate, so that slow motion isn't held back and doesn't lean towards zero
+	int applicableX = (int)lroundf(accumulatedX);
+	int applicableY = (int)lroundf(accumulatedY);
 
 	accumulatedX -= applicableX;
 	accumulatedY -= applicableY;
@@ -162,11 +219,16 @@ void moveMouse(float x, float y)
 	input.mi.dx = applicableX;
 	input.mi.dy = applicableY;
 	input.mi.dwFlags = MOUSEEVENTF_MOVE;
-	SendInput(1, &input, sizeof(input));
+	sendInput(input);
 }
 
 void setMouseNorm(float x, float y)
 {
+	if (OutputQueue::push({ OutputEvent::Type::MOVE_ABSOLUTE, false, 0, x, y }))
+		return;
+	if (auto capture = OutputCapture::active())
+		return capture->setMouseNorm(x, y);
+	traceMotionOutput("Pointer move", x, y);
 	INPUT input;
 	input.type = INPUT_MOUSE;
 	input.mi.mouseData = 0;
@@ -174,7 +236,16 @@ void setMouseNorm(float x, float y)
 	input.mi.dx = LONG(roundf(65535.0f * x));
 	input.mi.dy = LONG(roundf(65535.0f * y));
 	input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE;
-	SendInput(1, &input, sizeof(input));
+	sendInput(input);
+}
+
+void configureVirtualDevices(VirtualDevices layout, float mouseRate, FloatXY pointerResolution)
+{
+	// SendInput goes through the devices Windows already has
+}
+
+void releaseVirtualDevices()
+{
 }
 
 BOOL WriteToConsole(string_view command)